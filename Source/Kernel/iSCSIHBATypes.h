@@ -115,6 +115,52 @@ typedef struct {
 } iSCSIHBANotificationAsyncMessage;
 
 
+/*! Maximum number of capture records that are returned by a single call to
+ *  read capture records (the records must fit in a 4 KB structure). */
+static const UInt32 kiSCSIPDUCaptureMaxRecordsPerRead = 15;
+
+/*! Direction of a captured PDU. */
+enum iSCSIPDUCaptureDirection {
+    
+    /*! PDU was sent from the initiator to the target. */
+    kiSCSIPDUCaptureDirectionSend = 0,
+    
+    /*! PDU was received by the initiator from the target. */
+    kiSCSIPDUCaptureDirectionRecv = 1
+};
+
+/*! A PDU captured by the kernel extension.  Records are retrieved from the
+ *  kernel in batches and written to a capture file by the daemon. */
+typedef struct {
+    
+    /*! Position of the record within the capture ring (used by the kernel
+     *  to detect records that are being written or that were overwritten). */
+    UInt32 sequence;
+    
+    /*! Connection identifier. */
+    ConnectionIdentifier connectionId;
+    
+    /*! Time at which the PDU was captured, in microseconds since 1970. */
+    UInt64 timestamp;
+    
+    /*! Length of the PDU on the wire, excluding digests. */
+    UInt32 originalLength;
+    
+    /*! Number of bytes of the PDU that were captured. */
+    UInt16 capturedLength;
+    
+    /*! Direction of the PDU (see iSCSIPDUCaptureDirection). */
+    UInt8 direction;
+    
+    /*! Reserved. */
+    UInt8 reserved;
+    
+    /*! The leading bytes of the PDU, starting with the basic header segment. */
+    UInt8 data[kiSCSIPDUCaptureMaxSnapLength];
+    
+} iSCSIPDUCaptureRecord;
+
+
 /*! Function pointer indices.  These are the functions that can be called
  *	indirectly by calling IOCallScalarMethod(). */
 enum functionNames {
@@ -146,6 +192,7 @@ enum functionNames {
     kiSCSIGetPortalAddressForConnectionId,
     kiSCSIGetPortalPortForConnectionId,
     kiSCSIGetHostInterfaceForConnectionId,
+    kiSCSIReadPDUCaptureRecords,
 	kiSCSIInitiatorNumMethods
 };
 
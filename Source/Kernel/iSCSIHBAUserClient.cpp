@@ -30,6 +30,7 @@
 #include "iSCSIHBAUserClient.h"
 #include "iSCSITypesShared.h"
 #include "iSCSITypesKernel.h"
+#include "iSCSIPDUCapture.h"
 #include <IOKit/IOLib.h>
 
 /*! Required IOKit macro that defines the constructors, destructors, etc. */
@@ -235,6 +236,13 @@ const IOExternalMethodDispatch iSCSIHBAUserClient::methods[kiSCSIInitiatorNumMet
         0,
         0,                                  // Returned connection count
         kIOUCVariableStructureSize // connection address structures
+    },
+    {
+        (IOExternalMethodAction) &iSCSIHBAUserClient::ReadPDUCaptureRecords,
+        1,                                  // Session ID
+        0,
+        1,                                  // Returned number of lost records
+        kIOUCVariableStructureSize          // Capture records
     }
 };
 
@@ -489,13 +497,18 @@ IOReturn iSCSIHBAUserClient::CreateSession(iSCSIHBAUserClient * target,
     OSString * hostInterface = OSString::withCString((const char *)params[3]);
     const sockaddr_storage * remoteAddress = (struct sockaddr_storage*)params[4];
     const sockaddr_storage * localAddress = (struct sockaddr_storage*)params[5];
+    
+    // Optional socket buffer size (applied before connecting)
+    UInt32 socketBufferSize = 0;
+    if(kNumParams > 6 && paramSize[6] == sizeof(socketBufferSize))
+        memcpy(&socketBufferSize,params[6],sizeof(socketBufferSize));
  
     IOLockLock(target->accessLock);
     
     // Create a connection
     errno_t error = target->provider->CreateSession(
         targetIQN,portalAddress,portalPort,hostInterface,remoteAddress,
-        localAddress,&sessionId,&connectionId);
+        localAddress,socketBufferSize,&sessionId,&connectionId);
     
     IOLockUnlock(target->accessLock);
     
@@ -593,6 +606,18 @@ IOReturn iSCSIHBAUserClient::SetSessionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBASOTargetSessionId:
                 session->targetSessionId = paramVal;
                 break;
+            case kiSCSIHBASOBusyPollBudget:
+                if(paramVal > kiSCSIMaxBusyPollBudget)
+                    paramVal = kiSCSIMaxBusyPollBudget;
+                session->busyPollBudget_us = (UInt32)paramVal;
+                break;
+            case kiSCSIHBASOCaptureSnapLength:
+                if(hba->SetPDUCaptureSnapLength(session,(UInt32)paramVal))
+                    retVal = kIOReturnNoMemory;
+                break;
+            case kiSCSIHBASOCaptureSampleRate:
+                session->captureSampleRate = (UInt32)paramVal;
+                break;
 
             default:
                 retVal = kIOReturnBadArgument;
@@ -673,6 +698,15 @@ IOReturn iSCSIHBAUserClient::GetSessionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBASOTargetSessionId:
                 *paramVal = session->targetSessionId;
                 break;
+            case kiSCSIHBASOBusyPollBudget:
+                *paramVal = session->busyPollBudget_us;
+                break;
+            case kiSCSIHBASOCaptureSnapLength:
+                *paramVal = session->captureSnapLength;
+                break;
+            case kiSCSIHBASOCaptureSampleRate:
+                *paramVal = session->captureSampleRate;
+                break;
             default:
                 retVal = kIOReturnBadArgument;
         };
@@ -717,12 +751,17 @@ IOReturn iSCSIHBAUserClient::CreateConnection(iSCSIHBAUserClient * target,
     const sockaddr_storage * remoteAddress = (struct sockaddr_storage*)params[3];
     const sockaddr_storage * localAddress = (struct sockaddr_storage*)params[4];
     
+    // Optional socket buffer size (applied before connecting)
+    UInt32 socketBufferSize = 0;
+    if(kNumParams > 5 && paramSize[5] == sizeof(socketBufferSize))
+        memcpy(&socketBufferSize,params[5],sizeof(socketBufferSize));
+    
     IOLockLock(target->accessLock);
     
     // Create a connection
     errno_t error = target->provider->CreateConnection(
             sessionId,portalAddress,portalPort,hostInterface,remoteAddress,
-            localAddress,&connectionId);
+            localAddress,socketBufferSize,&connectionId);
     
     IOLockUnlock(target->accessLock);
     
@@ -1027,7 +1066,13 @@ IOReturn iSCSIHBAUserClient::SetConnectionParameter(iSCSIHBAUserClient * target,
                 connection->useHeaderDigest = paramVal;
                 break;
             case kiSCSIHBACOMaxRecvDataSegmentLength:
-                connection->maxRecvDataSegmentLength = (UInt32)paramVal;
+                // The receive arena is in use while the connection is active
+                if(connection->dataRecvEventSource->isEnabled())
+                    retVal = kIOReturnBusy;
+                else if(hba->ResizeRecvArena(connection,(UInt32)paramVal))
+                    retVal = kIOReturnNoMemory;
+                else
+                    connection->maxRecvDataSegmentLength = (UInt32)paramVal;
                 break;
             case kiSCSIHBACOMaxSendDataSegmentLength:
                 connection->maxSendDataSegmentLength = (UInt32)paramVal;
@@ -1035,6 +1080,13 @@ IOReturn iSCSIHBAUserClient::SetConnectionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBACOInitialExpStatSN:
                 connection->expStatSN = (UInt32)paramVal;
                 break;
+            case kiSCSIHBACOSocketBufferSize:
+                if(paramVal > UINT32_MAX)
+                    retVal = kIOReturnBadArgument;
+                else
+                    retVal = hba->GetCommandGate()->runAction(&iSCSIVirtualHBA::SetSocketBufferSizeOnWorkloopThread,
+                                                              connection,(void *)(uintptr_t)paramVal);
+                break;
                 
             default:
                 retVal = kIOReturnBadArgument;
@@ -1108,6 +1160,15 @@ IOReturn iSCSIHBAUserClient::GetConnectionParameter(iSCSIHBAUserClient * target,
             case kiSCSIHBACOInitialExpStatSN:
                 *paramVal = connection->expStatSN;
                 break;
+            case kiSCSIHBACOBytesPerSecond:
+                *paramVal = connection->bytesPerSecond;
+                break;
+            case kiSCSIHBACOLatency:
+                *paramVal = connection->taskLatency_us;
+                break;
+            case kiSCSIHBACOSocketBufferSize:
+                *paramVal = connection->socketBufferSize;
+                break;
                 
             default:
                 return kIOReturnBadArgument;
@@ -1514,5 +1575,43 @@ IOReturn iSCSIHBAUserClient::GetHostInterfaceForConnectionId(iSCSIHBAUserClient
     return retVal;
 }
 
-
-
+IOReturn iSCSIHBAUserClient::ReadPDUCaptureRecords(iSCSIHBAUserClient * target,
+                                                   void * reference,
+                                                   IOExternalMethodArguments * args)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,target->provider);
+    
+    SessionIdentifier sessionId = (SessionIdentifier)args->scalarInput[0];
+    
+    // Range-check input
+    if(sessionId >= kiSCSIMaxSessions)
+        return kIOReturnBadArgument;
+    
+    UInt32 maxRecords = args->structureOutputSize/sizeof(iSCSIPDUCaptureRecord);
+    
+    if(maxRecords > kiSCSIPDUCaptureMaxRecordsPerRead)
+        maxRecords = kiSCSIPDUCaptureMaxRecordsPerRead;
+    
+    IOLockLock(target->accessLock);
+    
+    // Do nothing if session doesn't exist
+    iSCSISession * session = hba->sessionList[sessionId];
+    
+    IOReturn retVal = kIOReturnNotFound;
+    
+    if(session) {
+        retVal = kIOReturnSuccess;
+        
+        UInt32 numRecords = 0, lostRecords = 0;
+        
+        if(session->pduCapture)
+            numRecords = session->pduCapture->readRecords((iSCSIPDUCaptureRecord*)args->structureOutput,
+                                                          maxRecords,&lostRecords);
+        
+        args->structureOutputSize = numRecords*sizeof(iSCSIPDUCaptureRecord);
+        args->scalarOutput[0] = lostRecords;
+    }
+    
+    IOLockUnlock(target->accessLock);
+    return retVal;
+}
@@ -154,6 +154,12 @@ public:
     static IOReturn GetHostInterfaceForConnectionId(iSCSIHBAUserClient * target,
                                                     void * reference,
                                                     IOExternalMethodArguments * args);
+    
+    /*! Dispatched function invoked from user-space to retrieve the PDUs
+     *  that were captured for a session since the last call. */
+    static IOReturn ReadPDUCaptureRecords(iSCSIHBAUserClient * target,
+                                          void * reference,
+                                          IOExternalMethodArguments * args);
 
     /*! Dispatched function invoked from user-space to send data
      *  over an existing, active connection. */
@@ -478,7 +478,7 @@ IOReturn iSCSIInitiatorClient::CreateSession(iSCSIInitiatorClient * target,
     // Create a connection
     errno_t error = target->provider->CreateSession(
         targetIQN,portalAddress,portalPort,hostInterface,portalSockAddr,
-        hostSockAddr,&sessionId,&connectionId);
+        hostSockAddr,0,&sessionId,&connectionId);
     
     IOLockUnlock(target->accessLock);
     
@@ -707,7 +707,7 @@ IOReturn iSCSIInitiatorClient::CreateConnection(iSCSIInitiatorClient * target,
     // Create a connection
     errno_t error = target->provider->CreateConnection(
             sessionId,portalAddress,portalPort,hostInterface,portalSockAddr,
-            hostSockAddr,&connectionId);
+            hostSockAddr,0,&connectionId);
     
     IOLockUnlock(target->accessLock);
     
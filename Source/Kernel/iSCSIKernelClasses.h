@@ -39,6 +39,8 @@
 #define iSCSIVirtualHBA         ADD_PREFIX(iSCSIVirtualHBA)
 #define iSCSITaskQueue          ADD_PREFIX(iSCSITaskQueue)
 #define iSCSIIOEventSource      ADD_PREFIX(iSCSIIOEventSource)
+#define iSCSITimerWheel         ADD_PREFIX(iSCSITimerWheel)
+#define iSCSIPDUCapture         ADD_PREFIX(iSCSIPDUCapture)
 #define iSCSIHBAUserClient      ADD_PREFIX(iSCSIHBAUserClient)
 #define iSCSIInitiator          ADD_PREFIX(iSCSIInitiator)
 
@@ -0,0 +1,196 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kern/clock.h>
+#include <libkern/OSAtomic.h>
+
+#include "iSCSIPDUCapture.h"
+#include "iSCSIPDUShared.h"
+
+#define super OSObject
+
+OSDefineMetaClassAndStructors(iSCSIPDUCapture,OSObject);
+
+bool iSCSIPDUCapture::init()
+{
+    if(!super::init())
+        return false;
+    
+    if(!(ring = (iSCSIPDUCaptureRecord*)IOMalloc(kNumRecords*sizeof(iSCSIPDUCaptureRecord))))
+        return false;
+    
+    if(!(slotLocks = (volatile UInt32*)IOMalloc(kNumRecords*sizeof(UInt32))))
+        return false;
+    
+    // A sequence number of zero marks a slot that holds no record
+    memset(ring,0,kNumRecords*sizeof(iSCSIPDUCaptureRecord));
+    memset((void*)slotLocks,0,kNumRecords*sizeof(UInt32));
+    
+    writeIndex = 0;
+    readIndex = 0;
+    
+    return true;
+}
+
+void iSCSIPDUCapture::free()
+{
+    if(ring)
+        IOFree(ring,kNumRecords*sizeof(iSCSIPDUCaptureRecord));
+    
+    if(slotLocks)
+        IOFree((void*)slotLocks,kNumRecords*sizeof(UInt32));
+    
+    super::free();
+}
+
+/*! Adds a PDU to the ring.
+ *  @param connectionId the connection associated with the PDU.
+ *  @param direction the direction of the PDU (see iSCSIPDUCaptureDirection).
+ *  @param bhs the basic header segment of the PDU.
+ *  @param data the data segment of the PDU, if any.
+ *  @param dataLength the number of bytes available at data.
+ *  @param originalLength the length of the PDU on the wire.
+ *  @param snapLength the maximum number of bytes to capture. */
+void iSCSIPDUCapture::addRecord(ConnectionIdentifier connectionId,
+                                enum iSCSIPDUCaptureDirection direction,
+                                const void * bhs,
+                                const void * data,
+                                size_t dataLength,
+                                UInt32 originalLength,
+                                UInt32 snapLength)
+{
+    // Claim a slot; the sequence number of a published record is its
+    // ticket plus one so that it is never zero
+    UInt32 ticket = (UInt32)OSIncrementAtomic(&writeIndex);
+    UInt32 slot = ticket & (kNumRecords-1);
+    iSCSIPDUCaptureRecord * record = &ring[slot];
+    
+    // Lock the slot (odd); a writer that lapped the ring may still hold it
+    UInt32 version;
+    do {
+        version = slotLocks[slot];
+    } while((version & 1) || !OSCompareAndSwap(version,version+1,&slotLocks[slot]));
+    
+    // A newer record was published while waiting; this one is lost
+    if((SInt32)(record->sequence-(ticket+1)) > 0) {
+        OSMemoryBarrier();
+        slotLocks[slot] = version+2;
+        return;
+    }
+    
+    clock_sec_t secs;
+    clock_usec_t usecs;
+    clock_get_calendar_microtime(&secs,&usecs);
+    
+    record->timestamp = (UInt64)secs*USEC_PER_SEC + usecs;
+    record->connectionId = connectionId;
+    record->direction = direction;
+    record->originalLength = originalLength;
+    
+    UInt32 length = min(snapLength,kiSCSIPDUCaptureMaxSnapLength);
+    UInt32 headerLength = min(length,(UInt32)kiSCSIPDUBasicHeaderSegmentSize);
+    memcpy(record->data,bhs,headerLength);
+    
+    UInt32 capturedLength = headerLength;
+    
+    if(data && length > headerLength) {
+        UInt32 dataCaptured = (UInt32)min((size_t)(length-headerLength),dataLength);
+        memcpy(record->data+headerLength,data,dataCaptured);
+        capturedLength += dataCaptured;
+    }
+    
+    record->capturedLength = capturedLength;
+    
+    // Publish the record and unlock the slot (even)
+    record->sequence = ticket+1;
+    OSMemoryBarrier();
+    slotLocks[slot] = version+2;
+}
+
+/*! Copies the oldest unread records out of the ring.  Must not be called
+ *  concurrently with itself.
+ *  @param records buffer that receives the records.
+ *  @param maxRecords the number of records the buffer can hold.
+ *  @param lostRecords incremented by the number of records that were
+ *  overwritten before they could be read.
+ *  @return the number of records copied. */
+UInt32 iSCSIPDUCapture::readRecords(iSCSIPDUCaptureRecord * records,
+                                    UInt32 maxRecords,
+                                    UInt32 * lostRecords)
+{
+    UInt32 count = 0;
+    
+    while(count < maxRecords)
+    {
+        UInt32 written = (UInt32)writeIndex;
+        
+        // Skip records that writers have lapped
+        if(written-readIndex > kNumRecords) {
+            *lostRecords += written-readIndex-kNumRecords;
+            readIndex = written-kNumRecords;
+        }
+        
+        if(readIndex == written)
+            break;
+        
+        UInt32 slot = readIndex & (kNumRecords-1);
+        iSCSIPDUCaptureRecord * record = &ring[slot];
+        
+        // The slot is being written
+        UInt32 version = slotLocks[slot];
+        if(version & 1)
+            break;
+        
+        OSMemoryBarrier();
+        UInt32 sequence = record->sequence;
+        
+        // The writer holding this ticket has not published it yet
+        if(sequence != readIndex+1) {
+            if((SInt32)(sequence-(readIndex+1)) < 0 || sequence == 0)
+                break;
+            
+            // The slot was reused by a newer writer; try again
+            continue;
+        }
+        
+        memcpy(&records[count],record,sizeof(iSCSIPDUCaptureRecord));
+        OSMemoryBarrier();
+        
+        // Discard the copy if a writer locked the slot while it was copied
+        if(slotLocks[slot] != version) {
+            (*lostRecords)++;
+            readIndex++;
+            continue;
+        }
+        
+        count++;
+        readIndex++;
+    }
+    
+    return count;
+}
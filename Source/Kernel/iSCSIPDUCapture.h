@@ -0,0 +1,107 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_PDU_CAPTURE_H__
+#define __ISCSI_PDU_CAPTURE_H__
+
+#include <IOKit/IOService.h>
+
+#include "iSCSIKernelClasses.h"
+#include "iSCSIHBATypes.h"
+
+/*! Holds PDUs captured from the connections of a session in a fixed-size
+ *  ring.  Records may be added concurrently (PDUs are sent from both the
+ *  workloop and user client threads); each writer claims a ticket with an
+ *  atomic increment and fills the corresponding slot while holding that
+ *  slot's spin lock, taken with a compare-and-swap (the lock value is odd
+ *  while held).  A writer only spins when another writer holds the same
+ *  slot, i.e. when the ring has been lapped, and then only for the time it
+ *  takes to copy one record.  Records are read by a single consumer (the
+ *  user client, under its access lock) that never takes the slot locks; it
+ *  discards copies made while a slot was held.  When the consumer falls
+ *  behind, the oldest records are overwritten. */
+class iSCSIPDUCapture : public OSObject
+{
+    OSDeclareDefaultStructors(iSCSIPDUCapture);
+    
+public:
+    
+    /*! Number of records held by the ring (must be a power of two). */
+    static const UInt32 kNumRecords = 256;
+    
+    /*! Initializes an empty capture ring.
+     *  @return true if the ring was successfully initialized. */
+    virtual bool init();
+    
+    /*! Frees the capture ring. */
+    virtual void free();
+    
+    /*! Adds a PDU to the ring.
+     *  @param connectionId the connection associated with the PDU.
+     *  @param direction the direction of the PDU (see iSCSIPDUCaptureDirection).
+     *  @param bhs the basic header segment of the PDU.
+     *  @param data the data segment of the PDU, if any.
+     *  @param dataLength the number of bytes available at data.
+     *  @param originalLength the length of the PDU on the wire.
+     *  @param snapLength the maximum number of bytes to capture. */
+    void addRecord(ConnectionIdentifier connectionId,
+                   enum iSCSIPDUCaptureDirection direction,
+                   const void * bhs,
+                   const void * data,
+                   size_t dataLength,
+                   UInt32 originalLength,
+                   UInt32 snapLength);
+    
+    /*! Copies the oldest unread records out of the ring.  Must not be called
+     *  concurrently with itself.
+     *  @param records buffer that receives the records.
+     *  @param maxRecords the number of records the buffer can hold.
+     *  @param lostRecords incremented by the number of records that were
+     *  overwritten before they could be read.
+     *  @return the number of records copied. */
+    UInt32 readRecords(iSCSIPDUCaptureRecord * records,
+                       UInt32 maxRecords,
+                       UInt32 * lostRecords);
+    
+private:
+    
+    /*! Records of the ring. */
+    iSCSIPDUCaptureRecord * ring;
+    
+    /*! Spin lock of each slot of the ring; odd while a writer holds the
+     *  slot, incremented again when it is released. */
+    volatile UInt32 * slotLocks;
+    
+    /*! Ticket of the next record to be written. */
+    volatile SInt32 writeIndex;
+    
+    /*! Ticket of the next record to be read. */
+    UInt32 readIndex;
+};
+
+#endif /* defined(__ISCSI_PDU_CAPTURE_H__) */
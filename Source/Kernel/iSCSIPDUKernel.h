@@ -195,7 +195,7 @@ namespace iSCSIPDU {
     
     /*! Basic header segment for a target management request PDU. */
     typedef struct __iSCSIPDUTaskMgmtReqBHS {
-        const UInt8 opCode;
+        UInt8 opCode;
         UInt8 function;
         UInt16 reserved;
         UInt8 totalAHSLength;
@@ -272,7 +272,6 @@ namespace iSCSIPDU {
         UInt8 totalAHSLength;
         UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
         UInt64 reserved3;
-        UInt32 reserved4;
         UInt32 flag;
         UInt32 reserved5;
         UInt32 statSN;
@@ -383,22 +382,27 @@ namespace iSCSIPDU {
     
     inline size_t iSCSIPDUGetDataSegmentLength(iSCSIPDUTargetBHS * bhs)
     {
-        UInt32 length = 0;
-        memcpy(&length,bhs->dataSegmentLength,kiSCSIPDUDataSegmentLengthSize);
-        length = OSSwapBigToHostInt32(length<<8);
-        return length;
+        return iSCSIPDUCommonBHSGetDataSegmentLength((iSCSIPDUCommonBHS*)bhs);
     }
     
     inline size_t iSCSIPDUGetPaddedDataSegmentLength(iSCSIPDUTargetBHS * bhs)
     {
-        size_t length = iSCSIPDUGetDataSegmentLength(bhs);
-        UInt32 padding = (UInt32)(length - length % 4);
-        
-        if(padding != 4)
-            return length+padding;
-        return length;
+        return iSCSIPDUGetPaddedLength(iSCSIPDUCommonBHSGetDataSegmentLength((iSCSIPDUCommonBHS*)bhs));
     }
     
+    iSCSIPDUAssertBHSSize(iSCSIPDUDataInBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUDataOutBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUSCSICmdBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUSCSIRspBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUTaskMgmtReqBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUTaskMgmtRspBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUR2TBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUSNACKReqBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDURejectBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUAsyncMsgBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUNOPOutBHS);
+    iSCSIPDUAssertBHSSize(iSCSIPDUNOPInBHS);
+    
     extern const iSCSIPDUDataOutBHS iSCSIPDUDataOutBHSInit;
     extern const iSCSIPDUSCSICmdBHS iSCSIPDUSCSICmdBHSInit;
     extern const iSCSIPDUTaskMgmtReqBHS iSCSIPDUTaskMgmtReqBHSInit;
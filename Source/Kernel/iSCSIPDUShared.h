@@ -44,6 +44,17 @@
 #include <CoreFoundation/CoreFoundation.h>
 #endif
 
+/*! Verifies the layout of a PDU structure at compile time. */
+#ifdef __cplusplus
+#define iSCSIPDUStaticAssert(expr,msg) static_assert(expr,msg)
+#else
+#define iSCSIPDUStaticAssert(expr,msg) _Static_assert(expr,msg)
+#endif
+
+/*! Verifies that a basic header segment structure is exactly 48 bytes. */
+#define iSCSIPDUAssertBHSSize(type) \
+    iSCSIPDUStaticAssert(sizeof(type) == 48,#type " must be 48 bytes")
+
 ///////////////////// BYTE SIZE OF VARIOUS PDU FIELDS //////////////////////
 
 /*! Byte size of the data segment length field in all iSCSI PDUs. */
@@ -118,6 +129,40 @@ typedef struct __iSCSIPDUTargetBHS {
     UInt32 reserved3;
 } __attribute__((packed)) iSCSIPDUTargetBHS;
 
+iSCSIPDUAssertBHSSize(iSCSIPDUCommonBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDUInitiatorBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDUTargetBHS);
+
+/*! Gets the value of the data segment length field of a PDU.  The field is
+ *  a 24-bit big-endian value and is at the same offset in all PDUs.
+ *  @param bhs the basic header segment of a PDU.
+ *  @return the length of the data segment (bytes, excluding padding). */
+static inline UInt32 iSCSIPDUCommonBHSGetDataSegmentLength(const iSCSIPDUCommonBHS * bhs)
+{
+    return ((UInt32)bhs->dataSegmentLength[0] << 16) |
+           ((UInt32)bhs->dataSegmentLength[1] << 8)  |
+            (UInt32)bhs->dataSegmentLength[2];
+}
+
+/*! Sets the value of the data segment length field of a PDU.
+ *  @param bhs the basic header segment of a PDU.
+ *  @param length the length of the data segment (bytes, excluding padding). */
+static inline void iSCSIPDUCommonBHSSetDataSegmentLength(iSCSIPDUCommonBHS * bhs,UInt32 length)
+{
+    bhs->dataSegmentLength[0] = (UInt8)(length >> 16);
+    bhs->dataSegmentLength[1] = (UInt8)(length >> 8);
+    bhs->dataSegmentLength[2] = (UInt8)length;
+}
+
+/*! Gets the length of a data segment once it has been padded to a
+ *  multiple of kiSCSIPDUByteAlignment bytes.
+ *  @param length the length of the data segment.
+ *  @return the padded length of the data segment. */
+static inline UInt32 iSCSIPDUGetPaddedLength(UInt32 length)
+{
+    return (length + kiSCSIPDUByteAlignment - 1) & ~(UInt32)(kiSCSIPDUByteAlignment - 1);
+}
+
 /*! Possible reject codes that may be issued throughout the login process. */
 enum iSCSIPDURejectCode {
     
@@ -49,35 +49,73 @@ bool iSCSITaskQueue::init(iSCSIVirtualHBA * owner,
     iSCSITaskQueue::session = session;
     iSCSITaskQueue::connection = connection;
     
-    // Initialize task queue to store parallel SCSI tasks for processing
-    queue_init(&taskQueue);
+    // Initialize task queues to store parallel SCSI tasks for processing
+    for(UInt32 taskClass = 0; taskClass < kNumTaskClasses; taskClass++)
+        queue_init(&taskQueues[taskClass]);
 
+    currentTask = NULL;
+    bypassCount = 0;
     newTask = false;
     
 	return true;
 }
 
+/*! Removes the next task to dispatch from the class queues and makes it
+ *  the current task.  Must be called with the command gate held. */
+void iSCSITaskQueue::dequeueNextTask()
+{
+    // Find the highest and lowest classes that have waiting tasks
+    int firstClass = -1, lastClass = -1;
+    
+    for(int taskClass = 0; taskClass < kNumTaskClasses; taskClass++)
+    {
+        if(queue_empty(&taskQueues[taskClass]))
+            continue;
+        
+        if(firstClass < 0)
+            firstClass = taskClass;
+        lastClass = taskClass;
+    }
+    
+    if(firstClass < 0)
+        return;
+    
+    // Dispatch from the highest class, unless tasks of a lower class have
+    // been passed over too many times in a row
+    int taskClass = firstClass;
+    
+    if(firstClass == lastClass)
+        bypassCount = 0;
+    else if(++bypassCount > kMaxBypassCount) {
+        taskClass = lastClass;
+        bypassCount = 0;
+    }
+    
+    queue_remove_first(&taskQueues[taskClass],currentTask,iSCSITask *,queueChain);
+}
+
 /*! Queues a new iSCSI task for delayed processing.
- *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
-void iSCSITaskQueue::queueTask(UInt32 initiatorTaskTag)
+ *  @param initiatorTaskTag the iSCSI task tag associated with the task.
+ *  @param taskClass the dispatch class of the task. */
+void iSCSITaskQueue::queueTask(UInt32 initiatorTaskTag,TaskClass taskClass)
 {
-    // Signal the workloop thread that work is available only if this is
-    // the only task in the queue (otherwise the task preceding this is
-    // being processed; we'll get to this once that's done).
+    // Signal the workloop thread that work is available only if no other
+    // task is being processed (otherwise we'll get to this task once the
+    // current task is done).
     iSCSITask * task = (iSCSITask*)IOMalloc(sizeof(iSCSITask));
     task->initiatorTaskTag = initiatorTaskTag;
     
+    if(taskClass >= kNumTaskClasses)
+        taskClass = kTaskClassNormal;
+    
     if(!onThread())
         OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
     
-    bool firstTaskInQueue = false;
-    if(queue_empty(&taskQueue))
-        firstTaskInQueue = true;
-    
-    queue_enter(&taskQueue,task,iSCSITask *,queueChain);
+    queue_enter(&taskQueues[taskClass],task,iSCSITask *,queueChain);
     
     // Signal the workloop to process a new task...
-    if(firstTaskInQueue) {
+    if(!currentTask) {
+        dequeueNextTask();
         newTask = true;
         
         if(getWorkLoop())
@@ -91,26 +129,23 @@ void iSCSITaskQueue::queueTask(UInt32 initiatorTaskTag)
 UInt32 iSCSITaskQueue::completeCurrentTask()
 {
     UInt32 taskTag = 0;
-    iSCSITask * task = NULL;
-    
-    // Do nothing if the queue is empty
-    if(queue_empty(&taskQueue))
-        return taskTag;
     
-    // Remove the completed task (at the head of the queue) and then
-    // move onto the next task if one exists
     if(!onThread())
         OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    
+    // Do nothing if no task is being processed
+    if(!currentTask)
+        return taskTag;
 
-    queue_remove_first(&taskQueue,task,iSCSITask *, queueChain);
-
-    if(task) {
-        taskTag = task->initiatorTaskTag;
-        IOFree(task,sizeof(iSCSITask));
-    }
+    // Remove the completed task and then move onto the next task if one exists
+    taskTag = currentTask->initiatorTaskTag;
+    IOFree(currentTask,sizeof(iSCSITask));
+    currentTask = NULL;
+    
+    dequeueNextTask();
     
     // If there are still tasks to process let the HBA know...
-    if(!queue_empty(&taskQueue)) {
+    if(currentTask) {
         newTask = true;
         if(getWorkLoop())
             signalWorkAvailable();
@@ -139,11 +174,10 @@ bool iSCSITaskQueue::checkForWork()
         if(!onThread())
             OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
         
-        if(queue_empty(&taskQueue))
+        if(!currentTask)
             return false;
         
-        iSCSITask * task = (iSCSITask *)queue_first(&taskQueue);
-        taskTag = task->initiatorTaskTag;
+        taskTag = currentTask->initiatorTaskTag;
         
         (*action)(owner,session,connection,taskTag);
     }
@@ -158,17 +192,50 @@ void iSCSITaskQueue::clearTasksFromQueue()
     // Ensure the event source is disabled before proceeding...
     disable();
     
-    // Iterate over queue and clear all tasks (free memory for each task)
+    // Iterate over queues and clear all tasks (free memory for each task)
     iSCSITask * task = NULL;
     
     if(!onThread())
         OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
     
-    while(!queue_empty(&taskQueue))
+    if(currentTask) {
+        IOFree(currentTask,sizeof(iSCSITask));
+        currentTask = NULL;
+    }
+    
+    for(UInt32 taskClass = 0; taskClass < kNumTaskClasses; taskClass++)
     {
-        queue_remove_first(&taskQueue,task,iSCSITask *, queueChain);
-        if(task)
-            IOFree(task,sizeof(iSCSITask));
+        while(!queue_empty(&taskQueues[taskClass]))
+        {
+            queue_remove_first(&taskQueues[taskClass],task,iSCSITask *, queueChain);
+            if(task)
+                IOFree(task,sizeof(iSCSITask));
+        }
     }
+    bypassCount = 0;
+}
+
+/*! Determines whether any tasks are queued or being processed.
+ *  @return true if the queue is empty. */
+bool iSCSITaskQueue::isEmpty()
+{
+    if(!onThread())
+        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    
+    // The current task is only NULL when no tasks are waiting
+    return (currentTask == NULL);
 }
 
+/*! Gets the task that is currently being processed.
+ *  @return the iSCSI task tag of the current task, or 0 if the queue
+ *  is empty. */
+UInt32 iSCSITaskQueue::getCurrentTask()
+{
+    if(!onThread())
+        OSDynamicCast(iSCSIVirtualHBA,owner)->GetCommandGate();
+    
+    if(!currentTask)
+        return 0;
+    
+    return currentTask->initiatorTaskTag;
+}
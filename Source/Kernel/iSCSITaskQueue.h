@@ -44,13 +44,33 @@ struct iSCSITask;
  *  This queue will invoke a callback function gated against
  *  the HBA workloop to process new tasks as existing tasks are completed.
  *  Once the task is processed, the HBA should call completeCurrentTask() to 
- *  let the queue know that the task has been processed. */
+ *  let the queue know that the task has been processed.
+ *  Tasks are dispatched by class: control tasks first, then head-of-queue
+ *  tasks, then all other tasks in the order they were queued.  To prevent
+ *  starvation, a waiting lower-class task is dispatched after
+ *  kMaxBypassCount higher-class tasks have been dispatched ahead of it. */
 class iSCSITaskQueue : public IOEventSource
 {
     OSDeclareDefaultStructors(iSCSITaskQueue);
 
 public:
     
+    /*! Dispatch classes for queued tasks (lower values are dispatched first). */
+    enum TaskClass {
+        
+        /*! Connection management tasks (e.g., keepalive pings). */
+        kTaskClassControl = 0,
+        
+        /*! SCSI tasks with the HEAD OF QUEUE or ACA task attribute. */
+        kTaskClassHeadOfQueue = 1,
+        
+        /*! All other SCSI tasks (SIMPLE and ORDERED). */
+        kTaskClassNormal = 2,
+        
+        /*! Number of dispatch classes. */
+        kNumTaskClasses = 3
+    };
+    
     /*! Pointer to the method that is called (within the driver's workloop)
 	 *	when data becomes available at a network socket. */
     typedef bool (*Action) (iSCSIVirtualHBA * owner,
@@ -72,8 +92,9 @@ public:
                       iSCSIConnection * connection);
     
     /*! Queues a new iSCSI task for delayed processing. 
-     *  @param initiatorTaskTag the iSCSI task tag associated with the task. */
-    void queueTask(UInt32 initiatorTaskTag);
+     *  @param initiatorTaskTag the iSCSI task tag associated with the task.
+     *  @param taskClass the dispatch class of the task. */
+    void queueTask(UInt32 initiatorTaskTag,TaskClass taskClass = kTaskClassNormal);
     
     /*! Removes a task from the queue (either the task has been successfully
      *  completed or aborted).
@@ -83,6 +104,15 @@ public:
     /*! Removes all tasks from the queue. */
     void clearTasksFromQueue();
     
+    /*! Determines whether any tasks are queued or being processed.
+     *  @return true if the queue is empty. */
+    bool isEmpty();
+    
+    /*! Gets the task that is currently being processed.
+     *  @return the iSCSI task tag of the current task, or 0 if the queue
+     *  is empty. */
+    UInt32 getCurrentTask();
+    
 protected:
     
     /*! Called by the attached work loop to check if there is any processing
@@ -93,13 +123,29 @@ protected:
 
 private:
     
+    /*! Maximum number of consecutive tasks that may be dispatched ahead of
+     *  a waiting task of a lower class. */
+    static const UInt32 kMaxBypassCount = 8;
+    
+    /*! Removes the next task to dispatch from the class queues and makes it
+     *  the current task.  Must be called with the command gate held. */
+    void dequeueNextTask();
+    
     /*! The iSCSI session associated with this event source. */
     iSCSISession * session;
     
     /*! The iSCSI connection associated with this event source. */
     iSCSIConnection * connection;
     
-    queue_head_t taskQueue;
+    /*! Tasks waiting to be dispatched, one queue per class. */
+    queue_head_t taskQueues[kNumTaskClasses];
+    
+    /*! The task being processed, or NULL if no task is being processed. */
+    struct iSCSITask * currentTask;
+    
+    /*! Number of consecutive tasks dispatched while a lower-class task
+     *  was waiting. */
+    UInt32 bypassCount;
     
     bool newTask;
     
@@ -0,0 +1,270 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <kern/clock.h>
+
+#include "iSCSITimerWheel.h"
+#include "iSCSIVirtualHBA.h"
+
+#define super IOTimerEventSource
+
+OSDefineMetaClassAndStructors(iSCSITimerWheel,IOTimerEventSource);
+
+bool iSCSITimerWheel::init(iSCSIVirtualHBA * owner,
+                           iSCSITimerWheel::Action action)
+{
+    // The superclass calls tick() on the workloop, which in turn dispatches
+    // expired timers to the specified action
+    if(!super::init(owner,(IOTimerEventSource::Action)&iSCSITimerWheel::tick))
+        return false;
+    
+    expireAction = action;
+    
+    for(UInt32 level = 0; level < kLevels; level++)
+        for(UInt32 slot = 0; slot < kSlotsPerLevel; slot++)
+            queue_init(&slots[level][slot]);
+    
+    clock_get_uptime(&startTime);
+    currentTick = 0;
+    armedCount = 0;
+    scheduledTick = 0;
+    tickScheduled = false;
+    
+    return true;
+}
+
+/*! Prepares a timer for use with the wheel.  This must be called once
+ *  before a timer is armed for the first time.
+ *  @param timer the timer to initialize.
+ *  @param type the type of the timer (see iSCSITimerTypes).
+ *  @param sessionId the session associated with the timer.
+ *  @param connectionId the connection associated with the timer.
+ *  @param context an object associated with the timer. */
+void iSCSITimerWheel::initTimer(iSCSITimer * timer,
+                                enum iSCSITimerTypes type,
+                                SessionIdentifier sessionId,
+                                ConnectionIdentifier connectionId,
+                                void * context)
+{
+    queue_init(&timer->queueChain);
+    timer->deadline = 0;
+    timer->context = context;
+    timer->sessionId = sessionId;
+    timer->connectionId = connectionId;
+    timer->type = type;
+    timer->armed = false;
+}
+
+/*! Arms a timer.  If the timer is already armed it is re-armed using the
+ *  new timeout.
+ *  @param timer the timer to arm.
+ *  @param timeoutMs the number of milliseconds until the timer expires. */
+void iSCSITimerWheel::armTimer(iSCSITimer * timer,UInt32 timeoutMs)
+{
+    if(workLoop)
+        closeGate();
+    
+    if(timer->armed)
+        remqueue((queue_entry_t)timer);
+    else {
+        // If the wheel was idle no ticks have been processed in the meantime;
+        // since every slot is empty the wheel can simply jump to the present
+        if(armedCount == 0)
+            currentTick = getCurrentTick();
+        
+        armedCount++;
+    }
+    
+    UInt64 ticks = (timeoutMs + kTickMs - 1) / kTickMs;
+    timer->deadline = getCurrentTick() + (ticks ? ticks : 1);
+    timer->armed = true;
+    
+    insertTimer(timer);
+    scheduleTick();
+    
+    if(workLoop)
+        openGate();
+}
+
+/*! Cancels a timer.  Canceling a timer that is not armed has no effect.
+ *  @param timer the timer to cancel. */
+void iSCSITimerWheel::cancelTimer(iSCSITimer * timer)
+{
+    if(workLoop)
+        closeGate();
+    
+    // The timer may be linked into a slot or into a batch of expired timers
+    // that is being dispatched; either way it is simply unlinked
+    if(timer->armed) {
+        remqueue((queue_entry_t)timer);
+        timer->armed = false;
+        armedCount--;
+    }
+    
+    if(workLoop)
+        openGate();
+}
+
+void iSCSITimerWheel::tick(OSObject * owner,IOTimerEventSource * sender)
+{
+    iSCSITimerWheel * wheel = OSDynamicCast(iSCSITimerWheel,sender);
+    
+    if(!wheel)
+        return;
+    
+    wheel->tickScheduled = false;
+    wheel->advance();
+    wheel->scheduleTick();
+}
+
+UInt64 iSCSITimerWheel::getCurrentTick()
+{
+    UInt64 now, elapsedNs;
+    clock_get_uptime(&now);
+    absolutetime_to_nanoseconds(now - startTime,&elapsedNs);
+    
+    return elapsedNs / (kTickMs * NSEC_PER_MSEC);
+}
+
+void iSCSITimerWheel::insertTimer(iSCSITimer * timer)
+{
+    // Timers that are already due go into the slot processed next
+    if(timer->deadline < currentTick)
+        timer->deadline = currentTick;
+    
+    UInt64 delta = timer->deadline - currentTick;
+    UInt64 slotTick = timer->deadline;
+    
+    // Timers beyond the span of the wheel are parked in the last slot of
+    // the top level; the deadline is kept, so that the timer is re-inserted
+    // (and parked again if necessary) when that slot is cascaded
+    const UInt64 span = 1ULL << (kSlotBits*kLevels);
+    if(delta >= span) {
+        slotTick = currentTick + span - 1;
+        delta = span - 1;
+    }
+    
+    // Each level covers kSlotsPerLevel times the range of the level below
+    UInt32 level = 0;
+    while(delta >= (1ULL << (kSlotBits*(level+1))))
+        level++;
+    
+    UInt32 slot = (UInt32)(slotTick >> (kSlotBits*level)) & kSlotMask;
+    enqueue_tail(&slots[level][slot],(queue_entry_t)timer);
+}
+
+UInt32 iSCSITimerWheel::cascade(UInt32 level)
+{
+    UInt32 index = (UInt32)(currentTick >> (kSlotBits*level)) & kSlotMask;
+    
+    // Detach the slot first since timers may be re-inserted into it
+    queue_head_t pending;
+    queue_init(&pending);
+    
+    while(!queue_empty(&slots[level][index]))
+        enqueue_tail(&pending,dequeue_head(&slots[level][index]));
+    
+    while(!queue_empty(&pending))
+        insertTimer((iSCSITimer*)dequeue_head(&pending));
+    
+    return index;
+}
+
+void iSCSITimerWheel::advance()
+{
+    UInt64 now = getCurrentTick();
+    
+    // Expired timers are collected first and dispatched as one batch once
+    // the wheel has caught up with the current time
+    queue_head_t expired;
+    queue_init(&expired);
+    
+    while(currentTick <= now && armedCount != 0)
+    {
+        UInt32 index = (UInt32)currentTick & kSlotMask;
+        
+        // When a level wraps around, pull the next slot of the level above
+        // down into the lower levels
+        if(index == 0) {
+            for(UInt32 level = 1; level < kLevels; level++)
+                if(cascade(level) != 0)
+                    break;
+        }
+        
+        while(!queue_empty(&slots[0][index]))
+            enqueue_tail(&expired,dequeue_head(&slots[0][index]));
+        
+        currentTick++;
+    }
+    
+    if(armedCount == 0)
+        currentTick = now + 1;
+    
+    iSCSIVirtualHBA * hba = (iSCSIVirtualHBA*)owner;
+    
+    while(!queue_empty(&expired))
+    {
+        iSCSITimer * timer = (iSCSITimer*)dequeue_head(&expired);
+        timer->armed = false;
+        armedCount--;
+        
+        // The action may arm or cancel other timers, including timers that
+        // are still part of this batch
+        if(expireAction && hba)
+            (*expireAction)(hba,timer);
+    }
+}
+
+void iSCSITimerWheel::scheduleTick()
+{
+    if(armedCount == 0)
+        return;
+    
+    // Wake up for the next occupied slot of the lowest level, or otherwise
+    // for the next cascade of the higher levels
+    UInt64 wakeTick = (currentTick | kSlotMask) + 1;
+    
+    for(UInt64 tick = currentTick; tick < wakeTick; tick++)
+    {
+        if(!queue_empty(&slots[0][tick & kSlotMask])) {
+            wakeTick = tick;
+            break;
+        }
+    }
+    
+    // Nothing to do if an earlier (or identical) tick is already pending
+    if(tickScheduled && scheduledTick <= wakeTick)
+        return;
+    
+    UInt64 now = getCurrentTick();
+    UInt64 ticks = (wakeTick > now) ? (wakeTick - now) : 1;
+    
+    scheduledTick = wakeTick;
+    tickScheduled = true;
+    setTimeoutMS((UInt32)(ticks * kTickMs));
+}
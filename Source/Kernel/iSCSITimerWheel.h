@@ -0,0 +1,156 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_TIMER_WHEEL_H__
+#define __ISCSI_TIMER_WHEEL_H__
+
+#include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/queue.h>
+
+#include "iSCSIKernelClasses.h"
+#include "iSCSITypesKernel.h"
+
+class iSCSIVirtualHBA;
+
+/*! Provides a hierarchical timer wheel for the iSCSI HBA.  Task deadlines,
+ *  R2T deadlines, NOP keepalives and connection recovery intervals are all
+ *  tracked by a single wheel that is driven from the HBA workloop.  Arming
+ *  and canceling a timer is O(1); the wheel only ticks while at least one
+ *  timer is armed, and all timers that expire during a tick are collected
+ *  and handed to the owner in a single batch. */
+class iSCSITimerWheel : public IOTimerEventSource
+{
+    OSDeclareDefaultStructors(iSCSITimerWheel);
+    
+public:
+    
+    /*! Pointer to the method that is called (within the driver's workloop)
+     *  for each timer that has expired. */
+    typedef void (*Action) (iSCSIVirtualHBA * owner,
+                            iSCSITimer * timer);
+    
+    /*! Resolution of the timer wheel (milliseconds per tick). */
+    static const UInt32 kTickMs = 10;
+    
+    /*! Initializes the timer wheel with an owner and an action.
+     *  @param owner the owner that this event source will be attached to.
+     *  @param action pointer to a function to call for each expired timer.
+     *  This function executes in the owner's workloop.
+     *  @return true if the timer wheel was successfully initialized. */
+    virtual bool init(iSCSIVirtualHBA * owner,
+                      iSCSITimerWheel::Action action);
+    
+    /*! Prepares a timer for use with the wheel.  This must be called once
+     *  before a timer is armed for the first time.
+     *  @param timer the timer to initialize.
+     *  @param type the type of the timer (see iSCSITimerTypes).
+     *  @param sessionId the session associated with the timer.
+     *  @param connectionId the connection associated with the timer.
+     *  @param context an object associated with the timer. */
+    static void initTimer(iSCSITimer * timer,
+                          enum iSCSITimerTypes type,
+                          SessionIdentifier sessionId,
+                          ConnectionIdentifier connectionId,
+                          void * context);
+    
+    /*! Arms a timer.  If the timer is already armed it is re-armed using the
+     *  new timeout.
+     *  @param timer the timer to arm.
+     *  @param timeoutMs the number of milliseconds until the timer expires. */
+    void armTimer(iSCSITimer * timer,UInt32 timeoutMs);
+    
+    /*! Cancels a timer.  Canceling a timer that is not armed has no effect.
+     *  @param timer the timer to cancel. */
+    void cancelTimer(iSCSITimer * timer);
+    
+    /*! Gets whether a timer is armed.
+     *  @param timer the timer to check.
+     *  @return true if the timer is armed. */
+    static bool isTimerArmed(iSCSITimer * timer) { return timer->armed; }
+    
+private:
+    
+    /*! Number of bits used to index the slots of a single level. */
+    static const UInt32 kSlotBits = 6;
+    
+    /*! Number of slots per level. */
+    static const UInt32 kSlotsPerLevel = (1 << kSlotBits);
+    
+    /*! Mask used to compute a slot index. */
+    static const UInt32 kSlotMask = kSlotsPerLevel - 1;
+    
+    /*! Number of levels in the wheel.  With 10 ms ticks, four levels of 64
+     *  slots span roughly 46 hours. */
+    static const UInt32 kLevels = 4;
+    
+    /*! Called by IOTimerEventSource on the workloop each tick. */
+    static void tick(OSObject * owner,IOTimerEventSource * sender);
+    
+    /*! Returns the current time, in ticks, since the wheel was initialized. */
+    UInt64 getCurrentTick();
+    
+    /*! Links an armed timer into the slot that corresponds to its deadline. */
+    void insertTimer(iSCSITimer * timer);
+    
+    /*! Moves the timers in the current slot of a level down to the lower
+     *  levels of the wheel.
+     *  @return the index of the slot that was cascaded. */
+    UInt32 cascade(UInt32 level);
+    
+    /*! Processes all ticks up to the current time and dispatches the
+     *  timers that expired. */
+    void advance();
+    
+    /*! Schedules the next tick if timers are armed.  Ticks are skipped
+     *  while the lowest level of the wheel has nothing due. */
+    void scheduleTick();
+    
+    /*! Called for each timer that expires. */
+    iSCSITimerWheel::Action expireAction;
+    
+    /*! Wheel slots, indexed by level and then by slot. */
+    queue_head_t slots[kLevels][kSlotsPerLevel];
+    
+    /*! Next tick that will be processed by the wheel. */
+    UInt64 currentTick;
+    
+    /*! Uptime (absolute time units) when the wheel was initialized. */
+    UInt64 startTime;
+    
+    /*! Number of timers that are currently armed. */
+    UInt32 armedCount;
+    
+    /*! Tick for which the next wakeup has been scheduled. */
+    UInt64 scheduledTick;
+    
+    /*! Indicates that a tick has been scheduled. */
+    bool tickScheduled;
+};
+
+#endif /* defined(__ISCSI_TIMER_WHEEL_H__) */
@@ -32,11 +32,81 @@
 
 #include <IOKit/IOLib.h>
 #include <sys/socket.h>
+#include <kern/queue.h>
 
 #include "iSCSITypesShared.h"
 
 class iSCSITaskQueue;
 class iSCSIIOEventSource;
+class iSCSIPDUCapture;
+
+/*! Kinds of deadlines that are tracked by the HBA timer wheel. The type
+ *  determines how the HBA reacts when a timer expires. */
+enum iSCSITimerTypes {
+    
+    /*! Overall deadline for a SCSI task. */
+    kiSCSITimerTypeTask = 0,
+    
+    /*! Deadline for the target to solicit outstanding write data (R2T). */
+    kiSCSITimerTypeR2T = 1,
+    
+    /*! Idle interval after which a NOP out is sent to the target. */
+    kiSCSITimerTypeKeepalive = 2,
+    
+    /*! Time to wait (DefaultTime2Wait) after a connection is lost before
+     *  the daemon is asked to reconnect. */
+    kiSCSITimerTypeTime2Wait = 3,
+    
+    /*! Time to retain (DefaultTime2Retain) the state of a lost connection
+     *  before it is released. */
+    kiSCSITimerTypeTime2Retain = 4
+};
+
+/*! A single timer that can be armed on the HBA timer wheel.  Timers are
+ *  embedded in the objects whose deadlines they track (tasks, connections)
+ *  so that arming and canceling never allocates memory. */
+typedef struct iSCSITimer {
+    
+    /*! Links the timer into a wheel slot (must be the first member). */
+    queue_chain_t queueChain;
+    
+    /*! Tick at which the timer expires. */
+    UInt64 deadline;
+    
+    /*! Object associated with the timer (e.g., the parallel task). */
+    void * context;
+    
+    /*! Session associated with the timer. */
+    SessionIdentifier sessionId;
+    
+    /*! Connection associated with the timer. */
+    ConnectionIdentifier connectionId;
+    
+    /*! The kind of deadline this timer tracks (see iSCSITimerTypes). */
+    UInt8 type;
+    
+    /*! Whether the timer is currently linked into the wheel. */
+    bool armed;
+    
+} iSCSITimer;
+
+/*! HBA-specific data that is stored with each SCSI parallel task (see
+ *  ReportHBASpecificTaskDataSize()). */
+typedef struct iSCSITaskData {
+    
+    /*! Connection that the task was assigned to (must be the first member). */
+    UInt32 connectionId;
+    
+    /*! Time at which the task was sent to the target (absolute time). */
+    UInt64 startTime;
+    
+    /*! Overall deadline for the task. */
+    iSCSITimer taskTimer;
+    
+    /*! Deadline for the target to request outstanding write data. */
+    iSCSITimer R2TTimer;
+    
+} iSCSITaskData;
 
 /*! Definition of a single connection that is associated with a particular
  *  iSCSI session. */
@@ -83,31 +153,50 @@ typedef struct iSCSIConnection {
      *  is a session option while the latter is a connection option. */
     UInt32 immediateDataLength;
     
-    /*! Keeps track of when processing began for a particualr task, as
-     *  represented by the system uptime (seconds component). */
-    clock_sec_t taskStartTimeSec;
+    /*! Keeps track of the iSCSI data transfer rate (goodput) of this
+     *  connection, in units of bytes per second.  This is an exponentially
+     *  weighted moving average of per-task measurements. */
+    UInt32 bytesPerSecond;
     
-    /*! Keeps track of when processing began for a particualr task, as
-     *  represented by the system uptime (microseconds component). */
-    clock_usec_t taskStartTimeUSec;
+    /*! Keeps track of the average time it takes to complete a task on
+     *  this connection (microseconds). */
+    UInt32 taskLatency_us;
     
-    /*! Keeps track of the iSCSI data transfer rate of this connection,
-     *  in units of bytes per second.  This number is obtained by averaging
-     *  over 5 tasks. */
-    UInt32 bytesPerSecond;
+    /*! Gain of the moving averages above, expressed as a shift (each new
+     *  measurement has a weight of 1/8). */
+    static const UInt8 kEstimatorGainShift = 3;
     
-    /*! Size of moving average (# points) to use to compute average speed. */
-    static const UInt8 kBytesPerSecAvgWindowSize = 30;
+    /*! Moving average of bytesPerSecond, scaled by 2^kEstimatorGainShift. */
+    UInt64 bytesPerSecondScaled;
     
-    /*! Last few measurements of bytes per second on this connection. */
-    UInt32 bytesPerSecondHistory[kBytesPerSecAvgWindowSize];
+    /*! Moving average of taskLatency_us, scaled by 2^kEstimatorGainShift. */
+    UInt64 taskLatencyScaled;
     
-    /*! Keeps track of the index in the above array should be populated next. */
-    UInt8 bytesPerSecHistoryIdx;
+    /*! Time at which the last task completed on this connection (absolute
+     *  time).  Tasks that overlap are measured from this point onwards so
+     *  that time spent transferring data is not counted more than once. */
+    UInt64 lastCompletionTime;
     
     /*! Keeps track of the connection latency (ms). */
     UInt32 latency_ms;
     
+    /*! Current size of the socket send and receive buffers (bytes). */
+    UInt32 socketBufferSize;
+    
+    /*! Socket buffer size requested by the user (bytes), or 0 if the
+     *  buffers are sized automatically. */
+    UInt32 socketBufferSizeOverride;
+    
+    /*! Timer used to send NOP out PDUs when the connection is idle. */
+    iSCSITimer keepaliveTimer;
+    
+    /*! Indicates that a NOP out was sent and no NOP in has arrived yet. */
+    bool keepaliveOutstanding;
+    
+    /*! Timer used to apply DefaultTime2Wait and DefaultTime2Retain after
+     *  the connection has timed out. */
+    iSCSITimer recoveryTimer;
+    
     //////////////////// Configured Connection Parameters /////////////////////
     
     /*! Flag that indicates if this connection uses header digests. */
@@ -133,6 +222,14 @@ typedef struct iSCSIConnection {
     
     /*! Maximum data segment length initiator can receive. */
     UInt32 maxRecvDataSegmentLength;
+    
+    /*! Preallocated buffer used to receive data segments that are not
+     *  placed directly into a task's data buffer (e.g., sense data), and
+     *  to stage data-in segments in chunks. */
+    UInt8 * recvArena;
+    
+    /*! Size of the receive arena (bytes). */
+    UInt32 recvArenaSize;
 
     
 } iSCSIConnection;
@@ -208,6 +305,22 @@ typedef struct iSCSISession {
     /*! Target portal group tag. */
     TargetPortalGroupTag targetPortalGroupTag;
     
+    /*! Time to poll a connection for a response after a command has been
+     *  sent (microseconds), or 0 to rely on socket callbacks only. */
+    UInt32 busyPollBudget_us;
+    
+    /*! Captured PDUs, or NULL if capture was never enabled. */
+    iSCSIPDUCapture * pduCapture;
+    
+    /*! Number of bytes of each PDU to capture, or 0 if capture is off. */
+    UInt32 captureSnapLength;
+    
+    /*! Capture one out of every N PDUs. */
+    UInt32 captureSampleRate;
+    
+    /*! Number of PDUs considered for capture (used for sampling). */
+    volatile SInt32 captureCount;
+    
 } iSCSISession;
 
 #endif /* defined(__ISCSI_TYPES_KERNEL_H__) */
@@ -29,6 +29,8 @@
 #include "iSCSIVirtualHBA.h"
 #include "iSCSIIOEventSource.h"
 #include "iSCSITaskQueue.h"
+#include "iSCSITimerWheel.h"
+#include "iSCSIPDUCapture.h"
 #include "iSCSITypesKernel.h"
 #include "iSCSIRFC3720Defaults.h"
 #include "iSCSIHBAUserClient.h"
@@ -37,6 +39,7 @@
 #include <sys/ioctl.h>
 #include <sys/unistd.h>
 #include <sys/select.h>
+#include <sys/kpi_mbuf.h>
 
 #include <IOKit/IORegistryEntry.h>
 
@@ -83,6 +86,16 @@ const UInt32 iSCSIVirtualHBA::kiSCSITaskTimeoutMs = 20000;
 /*! Default TCP timeout for new connections (seconds). */
 const UInt32 iSCSIVirtualHBA::kiSCSITCPTimeoutSec = 1;
 
+/*! Time allowed for the target to request outstanding write data
+ *  using an R2T PDU (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kiSCSIR2TTimeoutMs = 10000;
+
+/*! Idle time after which a NOP out is sent over a connection (milliseconds). */
+const UInt32 iSCSIVirtualHBA::kiSCSIKeepaliveIntervalMs = 5000;
+
+/*! Largest receive arena for a connection (bytes); the arena is wired. */
+const UInt32 iSCSIVirtualHBA::kiSCSIMaxRecvArenaSize = 262144;
+
 
 OSDefineMetaClassAndStructors(iSCSIVirtualHBA,IOSCSIParallelInterfaceController);
 
@@ -180,6 +193,7 @@ SCSIServiceResponse iSCSIVirtualHBA::AbortTaskRequest(SCSITargetIdentifier targe
 
     // Create a SCSI target management PDU and send
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncAbortTask);
     bhs.LUN = OSSwapHostToBigInt64(LUN);
     bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncAbortTask;
@@ -203,6 +217,7 @@ SCSIServiceResponse iSCSIVirtualHBA::AbortTaskSetRequest(SCSITargetIdentifier ta
 
     // Create a SCSI target management PDU and send
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncAbortTaskSet);
     bhs.LUN = OSSwapHostToBigInt64(LUN);
     bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncAbortTaskSet;
@@ -225,6 +240,7 @@ SCSIServiceResponse iSCSIVirtualHBA::ClearACARequest(SCSITargetIdentifier target
 
     // Create a SCSI target management PDU and send
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncClearACA);
     bhs.LUN = OSSwapHostToBigInt64(LUN);
     bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncClearACA;
@@ -247,6 +263,7 @@ SCSIServiceResponse iSCSIVirtualHBA::ClearTaskSetRequest(SCSITargetIdentifier ta
 
     // Create a SCSI target management PDU and send
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncClearTaskSet);
     bhs.LUN = OSSwapHostToBigInt64(LUN);
     bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncClearTaskSet;
@@ -269,6 +286,7 @@ SCSIServiceResponse iSCSIVirtualHBA::LogicalUnitResetRequest(SCSITargetIdentifie
 
     // Create a SCSI target management PDU and send
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,LUN,kiSCSIPDUTaskMgmtFuncLUNReset);
     bhs.LUN = OSSwapHostToBigInt64(LUN);
     bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncLUNReset;
@@ -290,6 +308,7 @@ SCSIServiceResponse iSCSIVirtualHBA::TargetResetRequest(SCSITargetIdentifier tar
 
     // Create a SCSI target management PDU and send
     iSCSIPDUTaskMgmtReqBHS bhs = iSCSIPDUTaskMgmtReqBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.function = kiSCSIPDUTaskMgmtFuncFlag | kiSCSIPDUTaskMgmtFuncTargetWarmReset;
     bhs.initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeTaskMgmt,0,kiSCSIPDUTaskMgmtFuncTargetWarmReset);
     
@@ -317,9 +336,10 @@ UInt32 iSCSIVirtualHBA::ReportMaximumTaskCount()
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificTaskDataSize()
 {
-    // Due to a bug (feature?) in the SCSI family driver, this value cannot
-    // be zero, even if task data is not required.
-	return 1;
+    // Each task carries the connection it was assigned to along with its
+    // timers (this also satisfies the SCSI family, which does not allow
+    // this value to be zero).
+	return sizeof(iSCSITaskData);
 }
 
 UInt32 iSCSIVirtualHBA::ReportHBASpecificDeviceDataSize()
@@ -352,6 +372,18 @@ bool iSCSIVirtualHBA::InitializeController()
     
     memset(sessionList,0,kMaxSessions*sizeof(iSCSISession *));
     
+    // Setup the timer wheel used for task and connection deadlines
+    if(!(timerWheel = OSTypeAlloc(iSCSITimerWheel)))
+        return false;
+    
+    if(!timerWheel->init(this,(iSCSITimerWheel::Action)&TimerExpiredOnWorkloopThread) ||
+       GetWorkLoop()->addEventSource(timerWheel) != kIOReturnSuccess)
+    {
+        timerWheel->release();
+        timerWheel = NULL;
+        return false;
+    }
+    
     // Set product name.
     SetHBAProperty(kIOPropertyProductNameKey,OSString::withCString(ISCSI_PRODUCT_NAME));
     SetHBAProperty(kIOPropertyProductRevisionLevelKey,OSString::withCString(ISCSI_PRODUCT_REVISION_LEVEL));
@@ -377,6 +409,11 @@ void iSCSIVirtualHBA::TerminateController()
     // Free up our list of sessions and targets
     IOFree(sessionList,kMaxSessions*sizeof(iSCSISession*));
     targetList->free();
+    
+    if(timerWheel) {
+        timerWheel->release();
+        timerWheel = NULL;
+    }
 }
 
 bool iSCSIVirtualHBA::StartController()
@@ -387,6 +424,10 @@ bool iSCSIVirtualHBA::StartController()
 
 void iSCSIVirtualHBA::StopController()
 {
+    if(timerWheel) {
+        timerWheel->cancelTimeout();
+        GetWorkLoop()->removeEventSource(timerWheel);
+    }
 }
 
 void iSCSIVirtualHBA::HandleInterruptRequest()
@@ -401,7 +442,7 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Determine the target identifier (session identifier) and connection
     // associated with this task and remove the task from the task queue.
     SessionIdentifier sessionId = (UInt16)GetTargetIdentifier(task);
-    ConnectionIdentifier connectionId = *((UInt32*)GetHBADataPointer(task));
+    ConnectionIdentifier connectionId = ((iSCSITaskData*)GetHBADataPointer(task))->connectionId;
     
     if(connectionId >= kMaxConnectionsPerSession)
         return;
@@ -422,13 +463,18 @@ void iSCSIVirtualHBA::HandleTimeout(SCSIParallelTaskIdentifier task)
     // Otherwise the target may be taking too long, just report it up the
     // driver stack
     struct sockaddr peername;
-    if(sock_getpeername(connection->socket,&peername,sizeof(peername))) {
+    bool recovering = iSCSITimerWheel::isTimerArmed(&connection->recoveryTimer);
+    
+    if(!recovering && sock_getpeername(connection->socket,&peername,sizeof(peername))) {
         HandleConnectionTimeout(sessionId,connectionId);
         return;
     }
 
-    // Let task queue know that the last (current) task should be removed
-    connection->taskQueue->completeCurrentTask();
+    // Let task queue know that the last (current) task should be removed;
+    // while the connection is being recovered the queue is not processed
+    // and the task need not be the current one
+    if(!recovering || connection->taskQueue->getCurrentTask() == (UInt32)GetControllerTaskIdentifier(task))
+        connection->taskQueue->completeCurrentTask();
     
     // Notify the SCSI stack that the task could not be delivered
     CompleteParallelTask(session,
@@ -445,9 +491,17 @@ void iSCSIVirtualHBA::HandleConnectionTimeout(SessionIdentifier sessionId,Connec
 {
     // If this is the last connection, release the session...
     iSCSISession * session;
+    iSCSIConnection * connection;
+    
+    if(sessionId >= kMaxSessions || connectionId >= kMaxConnectionsPerSession)
+        return;
     
-    if(!(session = sessionList[sessionId]))
+    if(!(session = sessionList[sessionId]) || !(connection = session->connections[connectionId]))
        return;
+    
+    // Recovery is already underway for this connection
+    if(iSCSITimerWheel::isTimerArmed(&connection->recoveryTimer))
+        return;
 
     DBLog("iscsi: Connection timeout (sid: %d, cid: %d)\n",sessionId,connectionId);
     
@@ -461,20 +515,91 @@ void iSCSIVirtualHBA::HandleConnectionTimeout(SessionIdentifier sessionId,Connec
         DeactivateConnection(sessionId,connectionId);
     else
         DeactivateAllConnections(sessionId);
-
-    // Send a notification to the daemon; if the daemon does not respond then
-    // release the session or connection as appropriate
-    iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)getClient();
     
-    if(client)
-        client->sendTimeoutMessageNotification(sessionId,connectionId);
-    else
-    {
+    // Without a daemon the connection cannot be reinstated; release it now
+    if(!getClient()) {
         if(connectionCount > 1)
             ReleaseConnection(sessionId,connectionId);
         else
             ReleaseSession(sessionId);
+        return;
     }
+
+    // Wait DefaultTime2Wait seconds before the daemon is notified (and
+    // attempts to reconnect); see TimerExpiredOnWorkloopThread()
+    connection->recoveryTimer.type = kiSCSITimerTypeTime2Wait;
+    timerWheel->armTimer(&connection->recoveryTimer,session->defaultTime2Wait*1000);
+}
+
+/*! Handles expired timers; called by the timer wheel on the workloop thread.
+ *  @param owner the HBA that owns the timer wheel.
+ *  @param timer the timer that expired. */
+void iSCSIVirtualHBA::TimerExpiredOnWorkloopThread(iSCSIVirtualHBA * owner,
+                                                   iSCSITimer * timer)
+{
+    // Task deadlines (command completion or outstanding R2T)
+    if(timer->type == kiSCSITimerTypeTask || timer->type == kiSCSITimerTypeR2T) {
+        owner->HandleTimeout((SCSIParallelTaskIdentifier)timer->context);
+        return;
+    }
+    
+    iSCSISession * session = owner->sessionList[timer->sessionId];
+    if(!session)
+        return;
+    
+    iSCSIConnection * connection = session->connections[timer->connectionId];
+    if(!connection)
+        return;
+    
+    switch(timer->type)
+    {
+        // Connection has been idle; probe the target with a NOP out. If the
+        // previous probe went unanswered the connection has timed out.
+        case kiSCSITimerTypeKeepalive:
+            if(connection->keepaliveOutstanding) {
+                DBLog("iscsi: Keepalive unanswered (sid: %d, cid: %d)\n",
+                      session->sessionId,connection->cid);
+                owner->HandleConnectionTimeout(session->sessionId,connection->cid);
+                return;
+            }
+            // Only idle connections are probed; tasks in flight are covered
+            // by their own timeouts. The probe is considered outstanding
+            // once it has been sent (see MeasureConnectionLatency())
+            if(connection->taskQueue->isEmpty())
+                connection->taskQueue->queueTask(owner->BuildInitiatorTaskTag(kInitiatorTaskTypeLatency,0,0),
+                                                 iSCSITaskQueue::kTaskClassControl);
+            owner->timerWheel->armTimer(timer,kiSCSIKeepaliveIntervalMs);
+            break;
+            
+        // DefaultTime2Wait has elapsed; let the daemon attempt to reinstate
+        // the connection within DefaultTime2Retain seconds
+        case kiSCSITimerTypeTime2Wait:
+        {
+            iSCSIHBAUserClient * client = (iSCSIHBAUserClient*)owner->getClient();
+            
+            if(client)
+                client->sendTimeoutMessageNotification(session->sessionId,connection->cid);
+
+            timer->type = kiSCSITimerTypeTime2Retain;
+            owner->timerWheel->armTimer(timer,session->defaultTime2Retain*1000);
+            break;
+        }
+            
+        // Connection was not reinstated in time, release its resources
+        case kiSCSITimerTypeTime2Retain:
+        {
+            ConnectionIdentifier connectionCount = 0;
+            for(ConnectionIdentifier connectionId = 0; connectionId < kMaxConnectionsPerSession; connectionId++)
+                if(session->connections[connectionId])
+                    connectionCount++;
+            
+            if(connectionCount > 1)
+                owner->ReleaseConnection(session->sessionId,connection->cid);
+            else
+                owner->ReleaseSession(session->sessionId);
+            break;
+        }
+    };
 }
 
 SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentifier parallelTask)
@@ -491,10 +616,10 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
         return kSCSIServiceResponse_FUNCTION_REJECTED;
     
     // Determine which connection this task should be assigned to based on
-    // bitrate and processing load; we do this by looking at the amount of
-    // data each connection needs to transfer
+    // bitrate and processing load; we do this by estimating how long each
+    // connection needs to complete the data it has been asked to transfer
     iSCSIConnection * connection = NULL;
-    size_t minTimeToTransfer = INT64_MAX;
+    UInt64 minTimeToTransfer = UINT64_MAX;
     
     for(UInt32 idx = 0; idx < kiSCSIMaxConnectionsPerSession; idx++)
     {
@@ -504,27 +629,38 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
         if(!conn || !conn->taskQueue->isEnabled())
             continue;
         
+        // Connections that have not been measured yet are used first
         if(conn->bytesPerSecond == 0) {
             connection = conn;
             break;
         }
         
-        size_t timeToTransfer = conn->dataToTransfer / conn->bytesPerSecond;
+        UInt64 timeToTransfer = conn->taskLatency_us +
+            (conn->dataToTransfer * USEC_PER_SEC) / conn->bytesPerSecond;
         
-        if(timeToTransfer <= minTimeToTransfer) {
+        if(timeToTransfer < minTimeToTransfer) {
             minTimeToTransfer = timeToTransfer;
             connection = conn;
         }
     }
     
-    connection = session->connections[0];
+    if(!connection)
+        connection = session->connections[0];
+    
     if(!connection || !connection->dataRecvEventSource)
         return kSCSIServiceResponse_FUNCTION_REJECTED;
     
     // Associate a connection identifier with this task; this is used to
     // maintain the connection associated with a task when only task information
     // is available (e.g., in the case of a task timeout).
-    *((UInt32*)GetHBADataPointer(parallelTask)) = 0;
+    iSCSITaskData * taskData = (iSCSITaskData*)GetHBADataPointer(parallelTask);
+    taskData->connectionId = connection->cid;
+    taskData->startTime = 0;
+    
+    iSCSITimerWheel::initTimer(&taskData->taskTimer,kiSCSITimerTypeTask,
+                               session->sessionId,connection->cid,parallelTask);
+    iSCSITimerWheel::initTimer(&taskData->R2TTimer,kiSCSITimerTypeR2T,
+                               session->sessionId,connection->cid,parallelTask);
     
     // Add the amount of data that we need to transfer to this connection
     OSAddAtomic64(GetRequestedDataTransferCount(parallelTask),&connection->dataToTransfer);
@@ -536,9 +672,20 @@ SCSIServiceResponse iSCSIVirtualHBA::ProcessParallelTask(SCSIParallelTaskIdentif
     DBLog("iscsi: Transfer size: %llu (sid: %d, cid: %d)\n",
           connection->dataToTransfer,session->sessionId,connection->cid);
     
+    // HEAD OF QUEUE and ACA tasks are dispatched ahead of other queued tasks;
+    // SIMPLE and ORDERED tasks are dispatched in the order they arrive
+    iSCSITaskQueue::TaskClass taskClass = iSCSITaskQueue::kTaskClassNormal;
+    
+    switch(GetTaskAttribute(parallelTask)) {
+        case kSCSITask_HEAD_OF_QUEUE:
+        case kSCSITask_ACA:
+            taskClass = iSCSITaskQueue::kTaskClassHeadOfQueue; break;
+        default: break;
+    };
+    
     // Queue task in the event source (we'll remove it from the queue when were
     // done processing the task)
-    connection->taskQueue->queueTask(initiatorTaskTag);
+    connection->taskQueue->queueTask(initiatorTaskTag,taskClass);
     
     DBLog("iscsi: Queued task %#x (sid: %d, cid: %d)\n",
           initiatorTaskTag,session->sessionId,connection->cid);
@@ -576,9 +723,9 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     DBLog("iscsi: Starting task %#x (sid: %d, cid: %d)\n",
           initiatorTaskTag,session->sessionId,connection->cid);
     
-    // Timestamp the connection indicating when we started processing the task
-    clock_get_system_microtime(&(connection->taskStartTimeSec),
-                               &(connection->taskStartTimeUSec));
+    // Timestamp the task indicating when we started processing it
+    iSCSITaskData * taskData = (iSCSITaskData*)owner->GetHBADataPointer(parallelTask);
+    clock_get_uptime(&taskData->startTime);
     
     iSCSIPDUSCSICmdBHS bhs  = iSCSIPDUSCSICmdBHSInit;
     bhs.dataTransferLength  = OSSwapHostToBigInt32(transferSize);
@@ -618,20 +765,22 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
     };
     
     // Default timeout for new tasks...
-    owner->SetTimeoutForTask(parallelTask,kiSCSITaskTimeoutMs);
+    owner->timerWheel->armTimer(&taskData->taskTimer,kiSCSITaskTimeoutMs);
     
     // For non-WRITE commands, send off SCSI command PDU immediately.
     if(transferDirection != kSCSIDataTransfer_FromInitiatorToTarget) {
         bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
         owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
+        owner->PollConnectionForTask(session,connection,initiatorTaskTag);
         return;
     }
     
     // If there is no unsolicited data to send, simply send the WRITE
-    // command and return.
+    // command and return (the target must now request data using R2Ts).
     if(session->initialR2T && !session->immediateData) {
         bhs.flags |= kiSCSIPDUSCSICmdFlagNoUnsolicitedData;
         owner->SendPDU(session,connection,(iSCSIPDUInitiatorBHS *)&bhs,NULL,NULL,0);
+        owner->timerWheel->armTimer(&taskData->R2TTimer,kiSCSIR2TTimeoutMs);
         return;
     }
     
@@ -679,7 +828,14 @@ void iSCSIVirtualHBA::BeginTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
         
         owner->ProcessDataOutForTask(session,connection,parallelTask,dataOffset,dataLength,bhs.LUN,
                                      initiatorTaskTag,kiSCSIPDUTargetTransferTagReserved);
+        dataOffset += dataLength;
     }
+    
+    // Any data that was not sent unsolicited must be requested by the target
+    if(dataOffset < transferSize)
+        owner->timerWheel->armTimer(&taskData->R2TTimer,kiSCSIR2TTimeoutMs);
+    else
+        owner->PollConnectionForTask(session,connection,initiatorTaskTag);
 }
 
 bool iSCSIVirtualHBA::ProcessTaskOnWorkloopThread(iSCSIVirtualHBA * owner,
@@ -754,46 +910,64 @@ void iSCSIVirtualHBA::CompleteParallelTask(iSCSISession * session,
                                            SCSITaskStatus completionStatus,
                                            SCSIServiceResponse serviceResponse)
 {
-    if(GetDataTransferDirection(parallelRequest) == kSCSIDataTransfer_NoDataTransfer) {
+    // Task is no longer outstanding; disarm any deadlines associated with it
+    iSCSITaskData * taskData = (iSCSITaskData*)GetHBADataPointer(parallelRequest);
+    timerWheel->cancelTimer(&taskData->taskTimer);
+    timerWheel->cancelTimer(&taskData->R2TTimer);
+    
+    // Tasks that were never sent to the target (or failed) are not measured
+    if(taskData->startTime == 0 || completionStatus != kSCSITaskStatus_GOOD) {
         super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
         return;
     }
-
-    // Compute the time it took to complete this task; first grab the timestamp
-    // when task was first started
-    clock_usec_t usecs;
-    clock_sec_t  secs;
-    clock_get_system_microtime(&secs,&usecs);
     
-    UInt64 duration_usecs = (secs  - connection->taskStartTimeSec)*1e6 +
-                            (usecs - connection->taskStartTimeUSec);
+    const UInt8 shift = connection->kEstimatorGainShift;
+    UInt64 now, elapsedNs;
+    clock_get_uptime(&now);
+    
+    // Update the moving average of the task latency (start to completion)
+    absolutetime_to_nanoseconds(now - taskData->startTime,&elapsedNs);
+    UInt64 latency_us = elapsedNs / NSEC_PER_USEC;
+    
+    if(connection->taskLatencyScaled == 0)
+        connection->taskLatencyScaled = latency_us << shift;
+    else
+        connection->taskLatencyScaled += latency_us - (connection->taskLatencyScaled >> shift);
     
-    // Calculate transfer speed over entire task...
-    UInt64 bytesTransferred = GetRequestedDataTransferCount(parallelRequest);
+    connection->taskLatency_us = (UInt32)(connection->taskLatencyScaled >> shift);
+    
+    // If tasks overlap, only the time since the last completion is attributed
+    // to this task; this way the estimate reflects the rate at which the
+    // connection delivers data rather than the rate of an individual task
+    UInt64 intervalStart = taskData->startTime;
+    if(connection->lastCompletionTime > intervalStart)
+        intervalStart = connection->lastCompletionTime;
 
-    // Add newest measurement to list (overwriting oldest one)
-    connection->bytesPerSecondHistory[connection->bytesPerSecHistoryIdx]
-        = (UInt32)(bytesTransferred / (duration_usecs / 1.0e6));
+    connection->lastCompletionTime = now;
     
-    // Advance index so next oldest record is overwritten next time (roll over)
-    connection->bytesPerSecHistoryIdx++;
-    if(connection->bytesPerSecHistoryIdx == connection->kBytesPerSecAvgWindowSize)
-    {
-        connection->bytesPerSecHistoryIdx = 0;
-        
-        // Queue a latency measurement operation
-        UInt32 initiatorTaskTag = BuildInitiatorTaskTag(kInitiatorTaskTypeLatency,0,0);
-        connection->taskQueue->queueTask(initiatorTaskTag);
+    UInt64 bytesTransferred = GetRealizedDataTransferCount(parallelRequest);
+    absolutetime_to_nanoseconds(now - intervalStart,&elapsedNs);
+    
+    if(bytesTransferred == 0 || elapsedNs == 0) {
+        super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
+        return;
     }
     
-    // Iterate over last few points, compute peak value
-    connection->bytesPerSecond = 0;
-    for(UInt8 i = 0; i < connection->kBytesPerSecAvgWindowSize; i++)
-        if(connection->bytesPerSecond < connection->bytesPerSecondHistory[i])
-            connection->bytesPerSecond = connection->bytesPerSecondHistory[i];
+    // Update the moving average of the goodput of the connection
+    UInt64 bytesPerSecond = (bytesTransferred * NSEC_PER_SEC) / elapsedNs;
+    
+    if(connection->bytesPerSecondScaled == 0)
+        connection->bytesPerSecondScaled = bytesPerSecond << shift;
+    else
+        connection->bytesPerSecondScaled += bytesPerSecond - (connection->bytesPerSecondScaled >> shift);
+
+    bytesPerSecond = connection->bytesPerSecondScaled >> shift;
+    connection->bytesPerSecond = (bytesPerSecond > UINT32_MAX) ? UINT32_MAX : (UInt32)bytesPerSecond;
+    
+    DBLog("iscsi: Bytes per second: %d, task latency: %d us (sid: %d, cid: %d)\n",
+          connection->bytesPerSecond,connection->taskLatency_us,session->sessionId,connection->cid);
     
-    DBLog("iscsi: Bytes per second: %d (sid: %d, cid: %d)\n",
-          connection->bytesPerSecond,session->sessionId,connection->cid);
+    TuneSocketBuffers(connection);
 
     super::CompleteParallelTask(parallelRequest,completionStatus,serviceResponse);
 }
@@ -853,22 +1027,42 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
 {
     const size_t length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
     
+    // A response to our own ping completes the latency measurement task,
+    // which is the current task of the queue; if the payload can't be used
+    // the task must still be completed or the queue stalls
+    const bool response = (bhs->targetTransferTag == kiSCSIPDUTargetTransferTagReserved);
+    
     // Grab data payload (could be ping data or other data, if it exists)
-    UInt8 data[length];
+    UInt8 * data = connection->recvArena;
+    
+    if(length > connection->recvArenaSize) {
+        DBLog("iscsi: NOP in data exceeds receive arena (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        DiscardPDUData(session,connection,length);
+        
+        if(response)
+            connection->taskQueue->completeCurrentTask();
+        return;
+    }
 
     if(length > 0 && RecvPDUData(session,connection,data,length,MSG_WAITALL) != 0) {
         DBLog("iscsi: Failed to retreive NOP in data (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
+        
+        if(response)
+            connection->taskQueue->completeCurrentTask();
         return;
     }
     
     // Response to a previous ping from this initiator
-    if(bhs->targetTransferTag == kiSCSIPDUTargetTransferTagReserved)
+    if(response)
     {
         // Will use this to calculate latency; our initiated NOP contained
         // a timestamp that is sent back to us
-        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t)))
+        if(length != (sizeof(clock_sec_t) + sizeof(clock_usec_t))) {
+            connection->taskQueue->completeCurrentTask();
             return;
+        }
         
         clock_sec_t secs_stamp, secs;
         clock_usec_t usecs_stamp, usecs;
@@ -885,6 +1079,9 @@ void iSCSIVirtualHBA::ProcessNOPIn(iSCSISession * session,
         DBLog("iscsi: Connection latency: %d ms (sid: %d, cid: %d)\n",
               connection->latency_ms,session->sessionId,connection->cid);
         
+        connection->keepaliveOutstanding = false;
+        TuneSocketBuffers(connection);
+        
         // Remove latency measurement task from queue
         connection->taskQueue->completeCurrentTask();
     }
@@ -910,10 +1107,16 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
     // Byte size of sense data (SAM)
     const UInt8 senseDataHeaderSize = 2;
     
-    const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
-    UInt8 data[length];
-    memset(data, length, 0);
-    if(length > 0) {
+    UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS*)bhs);
+    UInt8 * data = connection->recvArena;
+    
+    if(length > connection->recvArenaSize) {
+        DBLog("iscsi: Sense data exceeds receive arena (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        DiscardPDUData(session,connection,length);
+        length = 0;
+    }
+    else if(length > 0) {
         if(RecvPDUData(session,connection,data,length,MSG_WAITALL))
             DBLog("iscsi: Error retrieving data segment (sid: %d, cid: %d)\n",
                   session->sessionId,connection->cid);
@@ -928,13 +1131,9 @@ void iSCSIVirtualHBA::ProcessSCSIResponse(iSCSISession * session,
     
     if(!parallelTask)
     {
-        DBLog("iscsi: Task not found, flushing stream (ProcessSCSIResponse) (sid: %d, cid: %d)\n",
+        // The data segment has already been received; nothing to flush
+        DBLog("iscsi: Task not found (ProcessSCSIResponse) (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
-        
-        // Flush stream
-        UInt8 buffer[length];
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
-        
         return;
     }
     
@@ -1012,30 +1211,55 @@ void iSCSIVirtualHBA::ProcessDataIn(iSCSISession * session,
         return;
     }
     
-    UInt8 buffer[length];
-    
     // If task not found, flush stream
     if(!parallelTask)
     {
         DBLog("iscsi: Task not found (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
-        RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+        DiscardPDUData(session,connection,length);
         return;
     }
     
     // System buffer offset for this PDU data segment...
     UInt32 dataOffset = OSSwapBigToHostInt32(bhs->bufferOffset);
+    IOMemoryDescriptor * dataDesc = GetDataBuffer(parallelTask);
+    errno_t error = 0;
     
-    if(RecvPDUData(session,connection,buffer,length,0))
-        DBLog("iscsi: Error in retrieving data segment length (sid: %d, cid: %d)\n",
+    // Data beyond the end of the task's buffer is a protocol error; the
+    // task fails (the segment is discarded to keep the stream in sync)
+    if(!dataDesc || (UInt64)dataOffset + length > GetRequestedDataTransferCount(parallelTask)) {
+        DBLog("iscsi: Data segment exceeds task buffer (sid: %d, cid: %d)\n",
               session->sessionId,connection->cid);
-    else {
-        IOMemoryDescriptor  * dataDesc = GetDataBuffer(parallelTask);
-        dataDesc->writeBytes(dataOffset,buffer,length);
-        SetRealizedDataTransferCount(parallelTask,dataOffset+length);
-        connection->dataToTransfer -= length;
+        
+        if(DiscardPDUData(session,connection,length))
+            return;
+        error = EIO;
+    }
+    // Any error other than a digest error starts connection recovery,
+    // which completes the task
+    else if((error = RecvPDUDataToBuffer(session,connection,dataDesc,dataOffset,length))) {
+        DBLog("iscsi: Error in retrieving data segment (sid: %d, cid: %d)\n",
+              session->sessionId,connection->cid);
+        
+        if(error != EIO)
+            return;
     }
     
+    if(error) {
+        CompleteParallelTask(session,
+                             connection,
+                             parallelTask,
+                             kSCSITaskStatus_DeliveryFailure,
+                             kSCSIServiceResponse_SERVICE_DELIVERY_OR_TARGET_FAILURE);
+        
+        // Task is complete, remove it from the queue
+        connection->taskQueue->completeCurrentTask();
+        return;
+    }
+    
+    SetRealizedDataTransferCount(parallelTask,dataOffset+length);
+    connection->dataToTransfer -= length;
+    
     // If the PDU contains a status response, complete this task
     if((bhs->flags & kiSCSIPDUDataInFinalFlag) && (bhs->flags & kiSCSIPDUDataInStatusFlag))
     {
@@ -1069,18 +1293,12 @@ void iSCSIVirtualHBA::ProcessAsyncMsg(iSCSISession * session,
                                       iSCSIConnection * connection,
                                       iSCSIPDU::iSCSIPDUAsyncMsgBHS * bhs)
 {
-    // Grab any data associated with the PDU (e.g., sense data for SCSI
-    // asynchronous message)
+    // Skip any data associated with the PDU (e.g., sense data for SCSI
+    // asynchronous message); SCSI and vendor-specific events are unsupported
     const UInt32 length = GetDataSegmentLength((iSCSIPDUTargetBHS *)bhs);
-    UInt8 * data = NULL;
     
-    if(length) {
-        if(!(data = (UInt8*)IOMalloc(length))) {
-            DBLog("iscsi: couldn't allocate memory for PDU data (ProcessAsyncMsg)\n");
-            return;
-        }
-        RecvPDUData(session,connection,data,length,MSG_WAITALL);
-    }
+    if(length)
+        DiscardPDUData(session,connection,length);
 
     iSCSIPDUAsyncMsgEvent asyncEvent = (iSCSIPDUAsyncMsgEvent)(bhs->asyncEvent);
     
@@ -1126,9 +1344,6 @@ void iSCSIVirtualHBA::ProcessAsyncMsg(iSCSISession * session,
     // message is not vendor-specific or a SCSI message.
     if(asyncEvent != kiSCSIPDUAsyncMsgSCSIAsyncMsg && asyncEvent != kiSCSIPDUAsyncMsgVendorCode)
         client->sendAsyncMessageNotification(session->sessionId,connection->cid,asyncEvent);
-
-    if(data)
-        IOFree(data,length);
 }
 
 /*! Process an incoming R2T PDU.
@@ -1156,7 +1371,14 @@ void iSCSIVirtualHBA::ProcessR2T(iSCSISession * session,
     
     ProcessDataOutForTask(session,connection,parallelTask,dataOffset,dataLength,
                           bhs->LUN,bhs->initiatorTaskTag,bhs->targetTransferTag);
-
+    
+    // Restart the R2T deadline if the target has yet to request all data
+    iSCSITaskData * taskData = (iSCSITaskData*)GetHBADataPointer(parallelTask);
+    
+    if(GetRealizedDataTransferCount(parallelTask) < GetRequestedDataTransferCount(parallelTask))
+        timerWheel->armTimer(&taskData->R2TTimer,kiSCSIR2TTimeoutMs);
+    else
+        timerWheel->cancelTimer(&taskData->R2TTimer);
 }
 
 void iSCSIVirtualHBA::ProcessDataOutForTask(iSCSISession * session,
@@ -1239,8 +1461,13 @@ void iSCSIVirtualHBA::ProcessReject(iSCSISession * session,
         return;
     }
     
-    UInt8 buffer[length];
-    RecvPDUData(session,connection,buffer,length,MSG_WAITALL);
+    // The data segment holds the header of the rejected PDU
+    if(length > connection->recvArenaSize) {
+        DiscardPDUData(session,connection,length);
+        return;
+    }
+    
+    RecvPDUData(session,connection,connection->recvArena,length,MSG_WAITALL);
     
     enum iSCSIPDURejectCode rejectCode = (enum iSCSIPDURejectCode)bhs->reason;
     
@@ -1273,6 +1500,7 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
     // Setup a NOP out PDU (LUN field is unused with a value of 0 and the target
     // transfer tag takes on the reserved value fo this type of NOP out)
     iSCSIPDUNOPOutBHS bhs = iSCSIPDUNOPOutBHSInit;
+    bhs.opCode |= kiSCSIPDUImmediateDeliveryFlag;
     bhs.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
     bhs.initiatorTaskTag  = 0;
     
@@ -1288,7 +1516,122 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
     memcpy(data,&secs,sizeof(clock_sec_t));
     memcpy(data+sizeof(clock_sec_t),&usecs,sizeof(clock_usec_t));
     
-    SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,NULL,data,length);
+    if(!SendPDU(session,connection,(iSCSIPDUInitiatorBHS*)&bhs,NULL,data,length))
+        connection->keepaliveOutstanding = true;
+}
+
+void iSCSIVirtualHBA::CapturePDU(iSCSISession * session,
+                                 iSCSIConnection * connection,
+                                 enum iSCSIPDUCaptureDirection direction,
+                                 const void * bhs,
+                                 const void * data,
+                                 size_t dataLength)
+{
+    if(!session->pduCapture)
+        return;
+    
+    UInt32 count = (UInt32)OSIncrementAtomic(&session->captureCount);
+    
+    if(session->captureSampleRate > 1 && (count % session->captureSampleRate) != 0)
+        return;
+    
+    UInt32 segmentLength = iSCSIPDUCommonBHSGetDataSegmentLength((const iSCSIPDUCommonBHS*)bhs);
+    UInt32 originalLength = kiSCSIPDUBasicHeaderSegmentSize + iSCSIPDUGetPaddedLength(segmentLength);
+    
+    session->pduCapture->addRecord(connection->cid,direction,bhs,data,dataLength,
+                                   originalLength,session->captureSnapLength);
+}
+
+void iSCSIVirtualHBA::PollConnectionForTask(iSCSISession * session,
+                                            iSCSIConnection * connection,
+                                            UInt32 initiatorTaskTag)
+{
+    if(session->busyPollBudget_us == 0)
+        return;
+    
+    UInt64 deadline;
+    clock_interval_to_deadline(session->busyPollBudget_us,NSEC_PER_USEC,&deadline);
+    
+    // Process PDUs inline for as long as the task is outstanding; since we
+    // are on the workloop thread the socket callback cannot intervene
+    while(connection->taskQueue->getCurrentTask() == initiatorTaskTag &&
+          connection->dataRecvEventSource->isEnabled())
+    {
+        if(isPDUAvailable(connection))
+            ProcessTaskOnWorkloopThread(this,session,connection);
+        else if(mach_absolute_time() >= deadline)
+            break;
+    }
+}
+
+void iSCSIVirtualHBA::TuneSocketBuffers(iSCSIConnection * connection)
+{
+    UInt32 bufferSize = connection->socketBufferSizeOverride;
+    
+    if(bufferSize != 0)
+    {
+        if(bufferSize < kiSCSIMinSocketBufferSize)
+            bufferSize = kiSCSIMinSocketBufferSize;
+        if(bufferSize > kiSCSIMaxSocketBufferSize)
+            bufferSize = kiSCSIMaxSocketBufferSize;
+    }
+    else
+    {
+        // Prefer the round-trip time measured using NOP outs; fall back on
+        // the average task latency (an upper bound) otherwise
+        UInt64 rtt_us = connection->latency_ms * USEC_PER_MSEC;
+        if(rtt_us == 0)
+            rtt_us = connection->taskLatency_us;
+        
+        // Allow for twice the bandwidth-delay product; if the current rate
+        // is limited by the window the buffers will continue to grow
+        UInt64 size = 2 * (connection->bytesPerSecond * rtt_us) / USEC_PER_SEC;
+        
+        if(size < kiSCSIMinSocketBufferSize)
+            size = kiSCSIMinSocketBufferSize;
+        if(size > kiSCSIMaxSocketBufferSize)
+            size = kiSCSIMaxSocketBufferSize;
+        
+        bufferSize = (UInt32)size;
+        
+        // Avoid adjusting the buffers for small changes in the estimates
+        UInt32 currentSize = connection->socketBufferSize;
+        if(bufferSize < currentSize + currentSize/4 && bufferSize + bufferSize/4 > currentSize)
+            return;
+    }
+    
+    if(bufferSize == connection->socketBufferSize)
+        return;
+    
+    int value = bufferSize;
+    if(sock_setsockopt(connection->socket,SOL_SOCKET,SO_SNDBUF,&value,sizeof(value)) ||
+       sock_setsockopt(connection->socket,SOL_SOCKET,SO_RCVBUF,&value,sizeof(value)))
+    {
+        DBLog("iscsi: Failed to set socket buffer size %d (cid: %d)\n",bufferSize,connection->cid);
+        return;
+    }
+    
+    connection->socketBufferSize = bufferSize;
+    
+    DBLog("iscsi: Socket buffer size: %d (cid: %d)\n",bufferSize,connection->cid);
+}
+
+IOReturn iSCSIVirtualHBA::SetSocketBufferSizeOnWorkloopThread(OSObject * owner,
+                                                              void * connection,
+                                                              void * bufferSize,
+                                                              void *,
+                                                              void *)
+{
+    iSCSIVirtualHBA * hba = OSDynamicCast(iSCSIVirtualHBA,owner);
+    iSCSIConnection * conn = (iSCSIConnection *)connection;
+    
+    if(!hba || !conn)
+        return kIOReturnBadArgument;
+    
+    conn->socketBufferSizeOverride = (UInt32)(uintptr_t)bufferSize;
+    hba->TuneSocketBuffers(conn);
+    
+    return kIOReturnSuccess;
 }
 
 
@@ -1301,6 +1644,8 @@ void iSCSIVirtualHBA::MeasureConnectionLatency(iSCSISession * session,
  *  @param hostInterface the host interface to use for the connection.
  *  @param portalSockaddr the BSD socket structure used to identify the target.
  *  @param hostSockaddr the BSD socket structure used to identify the host adapter.
+ *  @param socketBufferSize the socket buffer size to use, or 0 to size
+ *  the buffers automatically.
  *  @param sessionId identifier for the new session.
  *  @param connectionId identifier for the new connection.
  *  @return error code indicating result of operation. */
@@ -1310,6 +1655,7 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
                                        OSString * hostInterface,
                                        const struct sockaddr_storage * portalSockaddr,
                                        const struct sockaddr_storage * hostSockaddr,
+                                       UInt32 socketBufferSize,
                                        SessionIdentifier * sessionId,
                                        ConnectionIdentifier * connectionId)
 {
@@ -1371,6 +1717,11 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
     newSession->maxBurstLength = kRFC3720_MaxBurstLength;
     newSession->maxConnections = kRFC3720_MaxConnections;
     newSession->maxOutStandingR2T = kRFC3720_MaxOutstandingR2T;
+    newSession->busyPollBudget_us = 0;
+    newSession->pduCapture = NULL;
+    newSession->captureSnapLength = 0;
+    newSession->captureSampleRate = 1;
+    newSession->captureCount = 0;
     
     // Retain new session
     sessionList[sessionIdx] = newSession;
@@ -1381,7 +1732,7 @@ errno_t iSCSIVirtualHBA::CreateSession(OSString * targetIQN,
 
     // Create a connection associated with this session
     if((error = CreateConnection(*sessionId,portalAddress,portalPort,hostInterface,
-                                 portalSockaddr,hostSockaddr,connectionId)))
+                                 portalSockaddr,hostSockaddr,socketBufferSize,connectionId)))
         goto SESSION_CREATE_CONNECTION_FAILURE;
 
     // Success
@@ -1447,6 +1798,9 @@ void iSCSIVirtualHBA::ReleaseSession(SessionIdentifier sessionId)
     sessionList[sessionId] = NULL;
     
     // Free connection list and session object
+    if(theSession->pduCapture)
+        theSession->pduCapture->release();
+    
     IOFree(theSession->connections,kMaxConnectionsPerSession*sizeof(iSCSIConnection*));
     IOFree(theSession,sizeof(iSCSISession));
     
@@ -1472,6 +1826,8 @@ void iSCSIVirtualHBA::ReleaseSession(SessionIdentifier sessionId)
  *  @param hostInterface the host interface to use for the connection.
  *  @param portalSockaddr the BSD socket structure used to identify the target.
  *  @param hostSockaddr the BSD socket structure used to identify the host adapter.
+ *  @param socketBufferSize the socket buffer size to use, or 0 to size
+ *  the buffers automatically.
  *  @param connectionId identifier for the new connection.
  *  @return error code indicating result of operation. */
 errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
@@ -1480,6 +1836,7 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
                                           OSString * hostInterface,
                                           const struct sockaddr_storage * portalSockaddr,
                                           const struct sockaddr_storage * hostSockaddr,
+                                          UInt32 socketBufferSize,
                                           ConnectionIdentifier * connectionId)
 {
     // Range-check inputs
@@ -1509,6 +1866,13 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     newConn->expStatSN = 0;
     newConn->dataToTransfer = 0;
     newConn->bytesPerSecond = 0;
+    newConn->bytesPerSecondScaled = 0;
+    newConn->taskLatency_us = 0;
+    newConn->taskLatencyScaled = 0;
+    newConn->lastCompletionTime = 0;
+    newConn->latency_ms = 0;
+    newConn->socketBufferSize = 0;
+    newConn->socketBufferSizeOverride = socketBufferSize;
     newConn->cid = index;
     
     newConn->maxRecvDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
@@ -1519,12 +1883,22 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     newConn->useIFMarker = kRFC3720_IFMarker;
     newConn->OFMarkInt = kRFC3720_OFMarkInt;
     newConn->IFMarkInt = kRFC3720_IFMarkInt;
+    newConn->recvArena = NULL;
+    newConn->recvArenaSize = 0;
+    
+    // Keepalive (NOP out) and recovery (Time2Wait/Time2Retain) deadlines
+    iSCSITimerWheel::initTimer(&newConn->keepaliveTimer,kiSCSITimerTypeKeepalive,sessionId,index,NULL);
+    iSCSITimerWheel::initTimer(&newConn->recoveryTimer,kiSCSITimerTypeTime2Wait,sessionId,index,NULL);
+    newConn->keepaliveOutstanding = false;
     
     session->connections[index] = newConn;
     *connectionId = index;
     
     // Initialize default error (try again)
     errno_t error = EAGAIN;
+    
+    if(ResizeRecvArena(newConn,newConn->maxRecvDataSegmentLength))
+        goto RECVARENA_ALLOC_FAILURE;
 
     if(!(newConn->taskQueue = OSTypeAlloc(iSCSITaskQueue)))
         goto TASKQUEUE_ALLOC_FAILURE;
@@ -1567,6 +1941,10 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
 
     // Set connection timeout...
     sock_setsockopt(newConn->socket,IPPROTO_TCP,TCP_CONNECTIONTIMEOUT,(const void*)&timeout,sizeof(struct timeval));
+    
+    // Size socket buffers before connecting so that an appropriate TCP
+    // window scale is negotiated
+    TuneSocketBuffers(newConn);
 
     // Bind socket to a particular host connection
     if((error = sock_bind(newConn->socket,(sockaddr*)hostSockaddr)))
@@ -1580,10 +1958,6 @@ errno_t iSCSIVirtualHBA::CreateConnection(SessionIdentifier sessionId,
     sock_setsockopt(newConn->socket,SOL_SOCKET,SO_SNDTIMEO,(const void*)&timeout,sizeof(struct timeval));
     sock_setsockopt(newConn->socket,SOL_SOCKET,SO_RCVTIMEO,(const void*)&timeout,sizeof(struct timeval));
 
-    // Initialize queue that keeps track of connection speed
-    memset(newConn->bytesPerSecondHistory,0,sizeof(UInt8)*newConn->kBytesPerSecAvgWindowSize);
-    newConn->bytesPerSecHistoryIdx = 0;
-
     newConn->portalAddress = portalAddress;
     newConn->portalPort = portalPort;
     newConn->hostInteface = hostInterface;
@@ -1615,6 +1989,9 @@ TASKQUEUE_INIT_FAILURE:
     newConn->taskQueue->release();
     
 TASKQUEUE_ALLOC_FAILURE:
+    ResizeRecvArena(newConn,0);
+    
+RECVARENA_ALLOC_FAILURE:
 
     session->connections[index] = 0;
     IOFree(newConn,sizeof(iSCSIConnection));
@@ -1645,6 +2022,9 @@ void iSCSIVirtualHBA::ReleaseConnection(SessionIdentifier sessionId,
     // First deactivate connection before proceeding
     if(connection->taskQueue->isEnabled())
         DeactivateConnection(sessionId,connectionId);
+    
+    timerWheel->cancelTimer(&connection->keepaliveTimer);
+    timerWheel->cancelTimer(&connection->recoveryTimer);
 
     // Prevents other from trying to access this connection...
     session->connections[connectionId] = NULL;
@@ -1660,6 +2040,7 @@ void iSCSIVirtualHBA::ReleaseConnection(SessionIdentifier sessionId,
     connection->taskQueue->release();
     connection->dataToTransfer = 0;
     
+    ResizeRecvArena(connection,0);
     IOFree(connection,sizeof(iSCSIConnection));
     
     DBLog("iscsi: Released connection (sid: %d, cid: %d)\n",sessionId,connectionId);
@@ -1706,6 +2087,12 @@ errno_t iSCSIVirtualHBA::ActivateConnection(SessionIdentifier sessionId,Connecti
     }
 
     OSIncrementAtomic(&session->numActiveConnections);
+    
+    // Any pending recovery is complete once the connection is back in the
+    // full feature phase; start probing the connection while it is idle
+    timerWheel->cancelTimer(&connection->recoveryTimer);
+    connection->keepaliveOutstanding = false;
+    timerWheel->armTimer(&connection->keepaliveTimer,kiSCSIKeepaliveIntervalMs);
 
     return 0;
 }
@@ -1759,6 +2146,7 @@ errno_t iSCSIVirtualHBA::DeactivateConnection(SessionIdentifier sessionId,Connec
 
     connection->dataRecvEventSource->disable();
     connection->taskQueue->disable();
+    timerWheel->cancelTimer(&connection->keepaliveTimer);
     
     // Tell driver stack that tasks have been rejected (stack will reattempt
     // the task on a different connection, if one is available)
@@ -1857,6 +2245,9 @@ errno_t iSCSIVirtualHBA::SendPDU(iSCSISession * session,
     bhs->expStatSN = OSSwapHostToBigInt32(connection->expStatSN);
     
     SetDataSegmentLength((iSCSIPDUInitiatorBHS*)bhs,(UInt32)length);
+    
+    if(session->captureSnapLength)
+        CapturePDU(session,connection,kiSCSIPDUCaptureDirectionSend,bhs,data,length);
 
     // Send data over the network, return true if all bytes were sent
     struct msghdr msg;
@@ -2033,6 +2424,16 @@ errno_t iSCSIVirtualHBA::RecvPDUHeader(iSCSISession * session,
         }
     }
     
+    // The data segment has not been received yet; capture the header only
+    if(session->captureSnapLength)
+        CapturePDU(session,connection,kiSCSIPDUCaptureDirectionRecv,bhs,NULL,0);
+    
+    // The target is alive; postpone the next keepalive for this connection
+    if(connection->taskQueue->isEnabled()) {
+        connection->keepaliveOutstanding = false;
+        timerWheel->armTimer(&connection->keepaliveTimer,kiSCSIKeepaliveIntervalMs);
+    }
+    
     // Update command sequence numbers only if the PDU was not a data PDU
     // (unless the data PDU contains a SCSI service response)
 
@@ -2144,3 +2545,200 @@ errno_t iSCSIVirtualHBA::RecvPDUData(iSCSISession * session,
 
     return error;
 }
+
+/*! Receives and discards a data segment (along with any padding and
+ *  digest) without copying it.
+ *  @param session the session associated with the connection.
+ *  @param connection the connection to receive from.
+ *  @param length the length of the data segment.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::DiscardPDUData(iSCSISession * session,
+                                        iSCSIConnection * connection,
+                                        size_t length)
+{
+    // Range-check inputs
+    if(!session || !connection)
+        return EINVAL;
+    
+    // Padding bytes and the data digest are discarded along with the data
+    size_t remaining = length + ((4 - (length % 4)) % 4);
+    
+    if(connection->useDataDigest)
+        remaining += sizeof(UInt32);
+    
+    // Take the data from the socket as a chain of mbufs and free it; this
+    // avoids copying the data out of the socket buffer
+    while(remaining > 0)
+    {
+        mbuf_t data = NULL;
+        size_t bytesRecv = remaining;
+        errno_t error = sock_receivembuf(connection->socket,NULL,&data,MSG_WAITALL,&bytesRecv);
+        
+        if(data)
+            mbuf_freem(data);
+        
+        if(error && error != EWOULDBLOCK) {
+            DBLog("iscsi: sock_receivembuf error returned with code %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
+            HandleConnectionTimeout(session->sessionId,connection->cid);
+            return error;
+        }
+        
+        if(bytesRecv == 0)
+            return EIO;
+        
+        remaining -= bytesRecv;
+    }
+    return 0;
+}
+
+/*! Receives exactly the specified number of bytes from a socket.
+ *  @param socket the socket to receive from.
+ *  @param buffer the buffer to receive into.
+ *  @param length the number of bytes to receive.
+ *  @return error code indicating result of operation. */
+static errno_t RecvAll(socket_t socket,void * buffer,size_t length)
+{
+    size_t filled = 0;
+    
+    while(filled < length)
+    {
+        struct iovec iovec;
+        iovec.iov_base = (UInt8*)buffer + filled;
+        iovec.iov_len  = length - filled;
+        
+        struct msghdr msg;
+        memset(&msg,0,sizeof(struct msghdr));
+        msg.msg_iov = &iovec;
+        msg.msg_iovlen = 1;
+        
+        size_t bytesRecv = 0;
+        errno_t error = sock_receive(socket,&msg,MSG_WAITALL,&bytesRecv);
+        
+        if(error && error != EWOULDBLOCK)
+            return error;
+        
+        if(bytesRecv == 0)
+            return ENOTCONN;
+        
+        filled += bytesRecv;
+    }
+    return 0;
+}
+
+errno_t iSCSIVirtualHBA::RecvPDUDataToBuffer(iSCSISession * session,
+                                             iSCSIConnection * connection,
+                                             IOMemoryDescriptor * buffer,
+                                             UInt32 offset,
+                                             size_t length)
+{
+    // Range-check inputs
+    if(!session || !connection || !buffer || !connection->recvArena)
+        return EINVAL;
+    
+    UInt32 calcDigest = 0;
+    size_t received = 0;
+    
+    while(received < length)
+    {
+        size_t chunk = min((UInt32)(length - received),connection->recvArenaSize);
+        errno_t error = RecvAll(connection->socket,connection->recvArena,chunk);
+        
+        if(error) {
+            DBLog("iscsi: sock_receive error returned with code %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
+            HandleConnectionTimeout(session->sessionId,connection->cid);
+            return ECONNRESET;
+        }
+        
+        if(connection->useDataDigest)
+            calcDigest = crc32c(calcDigest,connection->recvArena,chunk);
+        
+        buffer->writeBytes(offset + received,connection->recvArena,chunk);
+        received += chunk;
+    }
+    
+    // Receive padding bytes and the data digest, if one exists
+    UInt8 trailer[3 + sizeof(UInt32)];
+    size_t trailerLength = (4 - (length % 4)) % 4;
+    size_t paddingLength = trailerLength;
+    
+    if(connection->useDataDigest)
+        trailerLength += sizeof(UInt32);
+    
+    errno_t error = RecvAll(connection->socket,trailer,trailerLength);
+    
+    if(error) {
+        DBLog("iscsi: sock_receive error returned with code %d (sid: %d, cid: %d)\n",error,session->sessionId,connection->cid);
+        HandleConnectionTimeout(session->sessionId,connection->cid);
+        return ECONNRESET;
+    }
+    
+    if(connection->useDataDigest)
+    {
+        UInt32 dataDigest;
+        memcpy(&dataDigest,trailer + paddingLength,sizeof(dataDigest));
+        
+        if(dataDigest != calcDigest) {
+            DBLog("iscsi: Failed data digest (sid: %d, cid: %d)\n",session->sessionId,connection->cid);
+            return EIO;
+        }
+    }
+    return 0;
+}
+
+/*! Sizes the receive arena of a connection.
+ *  @param connection the connection.
+ *  @param size the new size of the arena (bytes), or 0 to free it; sizes
+ *  above kiSCSIMaxRecvArenaSize are capped.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::ResizeRecvArena(iSCSIConnection * connection,UInt32 size)
+{
+    if(!connection)
+        return EINVAL;
+    
+    if(size > kiSCSIMaxRecvArenaSize)
+        size = kiSCSIMaxRecvArenaSize;
+    
+    if(size == connection->recvArenaSize)
+        return 0;
+    
+    UInt8 * arena = NULL;
+    
+    if(size && !(arena = (UInt8*)IOMalloc(size)))
+        return ENOMEM;
+    
+    if(connection->recvArena)
+        IOFree(connection->recvArena,connection->recvArenaSize);
+    
+    connection->recvArena = arena;
+    connection->recvArenaSize = size;
+    
+    return 0;
+}
+
+/*! Sets the number of bytes of each PDU that are captured for a session.
+ *  @param session the session.
+ *  @param snapLength the number of bytes to capture, or 0 to stop.
+ *  @return error code indicating result of operation. */
+errno_t iSCSIVirtualHBA::SetPDUCaptureSnapLength(iSCSISession * session,UInt32 snapLength)
+{
+    if(!session)
+        return EINVAL;
+    
+    // The ring is kept until the session is released since PDUs may be
+    // captured concurrently from the workloop and from user clients
+    if(snapLength && !session->pduCapture) {
+        iSCSIPDUCapture * capture = OSTypeAlloc(iSCSIPDUCapture);
+        
+        if(!capture)
+            return ENOMEM;
+        
+        if(!capture->init()) {
+            capture->release();
+            return ENOMEM;
+        }
+        session->pduCapture = capture;
+    }
+    
+    session->captureSnapLength = min(snapLength,kiSCSIPDUCaptureMaxSnapLength);
+    return 0;
+}
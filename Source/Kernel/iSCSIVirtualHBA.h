@@ -44,6 +44,8 @@
 #include "iSCSIHBATypes.h"
 #include "iSCSIPDUKernel.h"
 
+class iSCSITimerWheel;
+
 // BSD socket includes
 #include <sys/kernel_types.h>
 #include <sys/types.h>
@@ -176,6 +178,14 @@ public:
                                              iSCSISession * session,
                                              iSCSIConnection * connection);
     
+    /*! Called by our timer wheel (iSCSITimerWheel) for each timer that has
+     *  expired.  Depending on the timer type this times out a task, pings an
+     *  idle connection or advances the recovery of a lost connection.
+     *  @param owner an instance of this class.
+     *  @param timer the timer that expired. */
+    static void TimerExpiredOnWorkloopThread(iSCSIVirtualHBA * owner,
+                                             iSCSITimer * timer);
+    
     /*! This function has been overloaded to provide additional task-timing
      *  support for multiple connections.
      *  @param session the session associated with the task.
@@ -199,6 +209,8 @@ public:
      *  @param hostInterface the host interface to use for the connection.
      *  @param portalSockaddr the BSD socket structure used to identify the target.
      *  @param hostSockaddr the BSD socket structure used to identify the host adapter.
+     *  @param socketBufferSize the socket buffer size to use, or 0 to size
+     *  the buffers automatically.
      *  @param sessionId identifier for the new session.
      *  @param connectionId identifier for the new connection.
      *  @return error code indicating result of operation. */
@@ -208,6 +220,7 @@ public:
                           OSString * hostInterface,
                           const struct sockaddr_storage * portalSockaddr,
                           const struct sockaddr_storage * hostSockaddr,
+                          UInt32 socketBufferSize,
                           SessionIdentifier * sessionId,
                           ConnectionIdentifier * connectionId);
     
@@ -227,6 +240,8 @@ public:
      *  @param hostInterface the host interface to use for the connection.
      *  @param portalSockaddr the BSD socket structure used to identify the target.
      *  @param hostSockaddr the BSD socket structure used to identify the host adapter.
+     *  @param socketBufferSize the socket buffer size to use, or 0 to size
+     *  the buffers automatically.
      *  @param connectionId identifier for the new connection.
      *  @return error code indicating result of operation. */
     errno_t CreateConnection(SessionIdentifier sessionId,
@@ -235,6 +250,7 @@ public:
                              OSString * hostInterface,
                              const struct sockaddr_storage * portalSockaddr,
                              const struct sockaddr_storage * hostSockaddr,
+                             UInt32 socketBufferSize,
                              ConnectionIdentifier * connectionId);
     
     /*! Frees a given iSCSI connection associated with a given session.
@@ -324,6 +340,50 @@ public:
                         size_t length,
                         int flags);
     
+    /*! Receives and discards a data segment (along with any padding and
+     *  digest) without copying it.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to receive from.
+     *  @param length the length of the data segment.
+     *  @return error code indicating result of operation. */
+    errno_t DiscardPDUData(iSCSISession * session,
+                           iSCSIConnection * connection,
+                           size_t length);
+    
+    /*! Receives a data segment (along with any padding and digest) into
+     *  a task's data buffer, staging it through the receive arena of the
+     *  connection in chunks of up to the size of the arena.
+     *  @param session the session associated with the connection.
+     *  @param connection the connection to receive from.
+     *  @param buffer the data buffer of the task.
+     *  @param offset the offset into the data buffer.
+     *  @param length the length of the data segment.
+     *  @return error code indicating result of operation; EIO indicates
+     *  that the data digest did not match (the stream remains usable),
+     *  other errors indicate that connection recovery has been started. */
+    errno_t RecvPDUDataToBuffer(iSCSISession * session,
+                                iSCSIConnection * connection,
+                                IOMemoryDescriptor * buffer,
+                                UInt32 offset,
+                                size_t length);
+    
+    /*! Sizes the receive arena of a connection.  The arena holds the data
+     *  segments of received PDUs that are not placed directly into a task's
+     *  data buffer; it is sized to the maximum data segment length
+     *  negotiated for the connection, up to kiSCSIMaxRecvArenaSize (larger
+     *  data-in segments are received in chunks).
+     *  @param connection the connection.
+     *  @param size the new size of the arena (bytes), or 0 to free it.
+     *  @return error code indicating result of operation. */
+    errno_t ResizeRecvArena(iSCSIConnection * connection,UInt32 size);
+    
+    /*! Sets the number of bytes of each PDU that are captured for a session,
+     *  allocating the capture ring the first time capture is enabled.
+     *  @param session the session.
+     *  @param snapLength the number of bytes to capture, or 0 to stop.
+     *  @return error code indicating result of operation. */
+    errno_t SetPDUCaptureSnapLength(iSCSISession * session,UInt32 snapLength);
+    
 private:
     
     /*! Process an incoming task management response PDU.
@@ -406,6 +466,55 @@ private:
     void MeasureConnectionLatency(iSCSISession * session,
                                   iSCSIConnection * connection);
     
+    /*! Sizes the socket send and receive buffers of a connection.  Unless
+     *  the size has been set explicitly, the buffers are sized from the
+     *  bandwidth-delay product of the connection (as measured by the
+     *  throughput and latency estimates) and adjusted as these change.
+     *  Sizes are kept between kiSCSIMinSocketBufferSize and
+     *  kiSCSIMaxSocketBufferSize.
+     *  @param connection the connection to tune. */
+    void TuneSocketBuffers(iSCSIConnection * connection);
+    
+    /*! Sets the socket buffer size of a connection (0 to size the buffers
+     *  automatically) and retunes the buffers.  Run through the command gate
+     *  so that it does not race the workloop, which also tunes the buffers.
+     *  @param owner an instance of this class.
+     *  @param connection the connection to tune.
+     *  @param bufferSize the buffer size (bytes), cast to a pointer.
+     *  @return an I/O Kit return code. */
+    static IOReturn SetSocketBufferSizeOnWorkloopThread(OSObject * owner,
+                                                        void * connection,
+                                                        void * bufferSize,
+                                                        void *,
+                                                        void *);
+    
+    /*! Adds a PDU to the capture ring of a session if capture is enabled
+     *  and the PDU is selected by the session's sample rate.
+     *  @param session the session associated with the PDU.
+     *  @param connection the connection associated with the PDU.
+     *  @param direction the direction of the PDU.
+     *  @param bhs the basic header segment of the PDU (in network order).
+     *  @param data the data segment of the PDU, if available.
+     *  @param dataLength the number of bytes available at data. */
+    void CapturePDU(iSCSISession * session,
+                    iSCSIConnection * connection,
+                    enum iSCSIPDUCaptureDirection direction,
+                    const void * bhs,
+                    const void * data,
+                    size_t dataLength);
+    
+    /*! Polls a connection for incoming PDUs after a command has been sent,
+     *  processing PDUs as they arrive until the task completes or the busy
+     *  poll budget of the session is exhausted.  This avoids the latency of
+     *  a socket callback and workloop wakeup for fast targets.  Any PDUs
+     *  that arrive afterwards are handled using socket callbacks as usual.
+     *  @param session the session associated with the task.
+     *  @param connection the connection to poll.
+     *  @param initiatorTaskTag the task that was just sent. */
+    void PollConnectionForTask(iSCSISession * session,
+                               iSCSIConnection * connection,
+                               UInt32 initiatorTaskTag);
+    
     
 	
     /*! Maximum allowable sessions. */
@@ -432,6 +541,17 @@ private:
     
     /*! Default timeout for new connections (seconds). */
     static const UInt32 kiSCSITCPTimeoutSec;
+    
+    /*! Time allowed for the target to request outstanding write data
+     *  using an R2T PDU (milliseconds). */
+    static const UInt32 kiSCSIR2TTimeoutMs;
+    
+    /*! Idle time after which a NOP out is sent over a connection
+     *  (milliseconds). */
+    static const UInt32 kiSCSIKeepaliveIntervalMs;
+    
+    /*! Maximum size of the receive arena of a connection (bytes). */
+    static const UInt32 kiSCSIMaxRecvArenaSize;
 
     
     /*! Used as part of the iSCSI layer intiator task tag to specify the 
@@ -476,17 +596,12 @@ private:
     
     inline void SetDataSegmentLength(iSCSIPDUInitiatorBHS * bhs,UInt32 length)
     {
-        // Set data segment length field
-        UInt32 dataSegLength = (OSSwapHostToBigInt32((UInt32)length)>>8);
-        memcpy(bhs->dataSegmentLength,&dataSegLength,kiSCSIPDUDataSegmentLengthSize);
+        iSCSIPDUCommonBHSSetDataSegmentLength((iSCSIPDUCommonBHS*)bhs,length);
     }
     
     inline UInt32 GetDataSegmentLength(iSCSIPDUTargetBHS * bhs)
     {
-        // Length of the data segment of the PDU
-        UInt32 length = 0;
-        memcpy(&length,bhs->dataSegmentLength,kiSCSIPDUDataSegmentLengthSize);
-        return OSSwapBigToHostInt32(length<<8);
+        return iSCSIPDUCommonBHSGetDataSegmentLength((iSCSIPDUCommonBHS*)bhs);
     }
     
     /*! Initiator ID of the virtual HBA.  This value is auto-generated upon
@@ -501,6 +616,10 @@ private:
     /*! Lookup table mapping target names (IQN names) to session identifiers. */
     OSDictionary * targetList;
     
+    /*! Timer wheel that tracks task, R2T, keepalive and connection recovery
+     *  deadlines for all sessions. */
+    iSCSITimerWheel * timerWheel;
+    
     friend class iSCSITaskQueue;
 };
 
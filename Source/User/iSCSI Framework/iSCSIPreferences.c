@@ -69,6 +69,18 @@ CFStringRef kiSCSIPKErrorRecoveryLevel = CFSTR("Error Recovery Level");
 /*! Preference key name for maximum number of connections. */
 CFStringRef kiSCSIPKMaxConnections = CFSTR("Maximum Connections");
 
+/*! Preference key name for the busy poll budget (microseconds). */
+CFStringRef kiSCSIPKBusyPollBudget = CFSTR("Busy Poll Budget");
+
+/*! Preference key name for the PDU capture file. */
+CFStringRef kiSCSIPKPDUCaptureFile = CFSTR("PDU Capture File");
+
+/*! Preference key name for the PDU capture snap length (bytes). */
+CFStringRef kiSCSIPKPDUCaptureSnapLength = CFSTR("PDU Capture Snap Length");
+
+/*! Preference key name for the PDU capture sample rate. */
+CFStringRef kiSCSIPKPDUCaptureSampleRate = CFSTR("PDU Capture Sample Rate");
+
 /*! Preference key name for data digest. */
 CFStringRef kiSCSIPKDataDigest = CFSTR("Data Digest");
 
@@ -126,6 +138,9 @@ CFStringRef kiSCSIPKSendTargetsEnabled = CFSTR("SendTargets");
 /*! Preference key name for iSCSI discovery interval. */
 CFStringRef kiSCSIPKDiscoveryInterval = CFSTR("Interval");
 
+/*! Preference key name for keeping iSCSI discovery sessions open. */
+CFStringRef kiSCSIPKDiscoveryPersistentSessions = CFSTR("Persistent Sessions");
+
 /*! Preference key naem for iSCSI discovery portal that manages target. */
 CFStringRef kiSCSIPKSendTargetsPortal = CFSTR("Managing Portal");
 
@@ -180,6 +195,7 @@ CFMutableDictionaryRef iSCSIPreferencesCreateDiscoveryDict()
 
     CFDictionaryAddValue(discoveryDict,kiSCSIPKSendTargetsEnabled,kCFBooleanFalse);
     CFDictionaryAddValue(discoveryDict,kiSCSIPKDiscoveryInterval,value);
+    CFDictionaryAddValue(discoveryDict,kiSCSIPKDiscoveryPersistentSessions,kCFBooleanFalse);
 
     CFRelease(value);
 
@@ -399,6 +415,132 @@ UInt32 iSCSIPreferencesGetMaxConnectionsForTarget(iSCSIPreferencesRef preference
     return maxConnections;
 }
 
+/*! Sets the time to poll for responses after sending a command to the
+ *  target (microseconds).
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param budget the busy poll budget, or 0 to disable polling. */
+void iSCSIPreferencesSetBusyPollBudgetForTarget(iSCSIPreferencesRef preferences,
+                                                CFStringRef targetIQN,
+                                                UInt32 budget)
+{
+    // Get the target information dictionary
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    CFNumberRef value = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&budget);
+    CFDictionarySetValue(targetDict,kiSCSIPKBusyPollBudget,value);
+    CFRelease(value);
+}
+
+/*! Gets the time to poll for responses after sending a command to the
+ *  target (microseconds).
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the busy poll budget, or 0 if polling is disabled. */
+UInt32 iSCSIPreferencesGetBusyPollBudgetForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
+{
+    // Get the target information dictionary
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    UInt32 budget = 0;
+    
+    if(targetDict) {
+        CFNumberRef value = CFDictionaryGetValue(targetDict,kiSCSIPKBusyPollBudget);
+        if(value)
+            CFNumberGetValue(value,kCFNumberIntType,&budget);
+    }
+    return budget;
+}
+
+/*! Sets the file to which PDUs exchanged with the target are captured.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param path the path of the capture file, or NULL to disable capture. */
+void iSCSIPreferencesSetPDUCaptureFileForTarget(iSCSIPreferencesRef preferences,
+                                                CFStringRef targetIQN,
+                                                CFStringRef path)
+{
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    
+    if(!targetDict)
+        return;
+    
+    if(path && CFStringGetLength(path) > 0)
+        CFDictionarySetValue(targetDict,kiSCSIPKPDUCaptureFile,path);
+    else
+        CFDictionaryRemoveValue(targetDict,kiSCSIPKPDUCaptureFile);
+}
+
+/*! Gets the file to which PDUs exchanged with the target are captured.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the path of the capture file, or NULL if capture is disabled. */
+CFStringRef iSCSIPreferencesGetPDUCaptureFileForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
+{
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    
+    if(targetDict)
+        return CFDictionaryGetValue(targetDict,kiSCSIPKPDUCaptureFile);
+    
+    return NULL;
+}
+
+/*! Sets the number of bytes of each PDU to capture for the target.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param snapLength the number of bytes to capture. */
+void iSCSIPreferencesSetPDUCaptureSnapLengthForTarget(iSCSIPreferencesRef preferences,
+                                                      CFStringRef targetIQN,
+                                                      UInt32 snapLength)
+{
+    // Get the target information dictionary
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    CFNumberRef value = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&snapLength);
+    CFDictionarySetValue(targetDict,kiSCSIPKPDUCaptureSnapLength,value);
+    CFRelease(value);
+}
+
+/*! Gets the number of bytes of each PDU to capture for the target.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the number of bytes to capture. */
+UInt32 iSCSIPreferencesGetPDUCaptureSnapLengthForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
+{
+    // Get the target information dictionary
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    UInt32 snapLength = kiSCSIPDUCaptureDefaultSnapLength;
+    
+    if(targetDict) {
+        CFNumberRef value = CFDictionaryGetValue(targetDict,kiSCSIPKPDUCaptureSnapLength);
+        if(value)
+            CFNumberGetValue(value,kCFNumberIntType,&snapLength);
+    }
+    return snapLength;
+}
+
+/*! Sets the fraction of PDUs that are captured for the target.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param sampleRate capture one out of every sampleRate PDUs. */
+void iSCSIPreferencesSetPDUCaptureSampleRateForTarget(iSCSIPreferencesRef preferences,
+                                                      CFStringRef targetIQN,
+                                                      UInt32 sampleRate)
+{
+    // Get the target information dictionary
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    CFNumberRef value = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&sampleRate);
+    CFDictionarySetValue(targetDict,kiSCSIPKPDUCaptureSampleRate,value);
+    CFRelease(value);
+}
+
+/*! Gets the fraction of PDUs that are captured for the target.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return one out of every N PDUs is captured. */
+UInt32 iSCSIPreferencesGetPDUCaptureSampleRateForTarget(iSCSIPreferencesRef preferences,CFStringRef targetIQN)
+{
+    // Get the target information dictionary
+    CFMutableDictionaryRef targetDict = iSCSIPreferencesGetTargetDict(preferences,targetIQN,false);
+    UInt32 sampleRate = 1;
+    
+    if(targetDict) {
+        CFNumberRef value = CFDictionaryGetValue(targetDict,kiSCSIPKPDUCaptureSampleRate);
+        if(value)
+            CFNumberGetValue(value,kCFNumberIntType,&sampleRate);
+    }
+    return sampleRate;
+}
+
 /*! Gets the error recovery level to use for the target.
  *  @param targetIQN the target iSCSI qualified name (IQN).
  *  @return the error recovery level. */
@@ -1307,6 +1449,34 @@ CFIndex iSCSIPreferencesGetSendTargetsDiscoveryInterval(iSCSIPreferencesRef pref
     return interval;
 }
 
+/*! Sets whether SendTargets discovery sessions are kept open between
+ *  discovery intervals.
+ *  @param enable True to keep discovery sessions open, false otherwise. */
+void iSCSIPreferencesSetSendTargetsDiscoveryPersistentSessions(iSCSIPreferencesRef preferences,Boolean enable)
+{
+    CFMutableDictionaryRef discoveryDict = iSCSIPreferencesGetDiscoveryDict(preferences,true);
+
+    if(enable)
+        CFDictionarySetValue(discoveryDict,kiSCSIPKDiscoveryPersistentSessions,kCFBooleanTrue);
+    else
+        CFDictionarySetValue(discoveryDict,kiSCSIPKDiscoveryPersistentSessions,kCFBooleanFalse);
+}
+
+/*! Gets whether SendTargets discovery sessions are kept open between
+ *  discovery intervals.
+ *  @return True if discovery sessions are kept open, false otherwise. */
+Boolean iSCSIPreferencesGetSendTargetsDiscoveryPersistentSessions(iSCSIPreferencesRef preferences)
+{
+    CFMutableDictionaryRef discoveryDict = iSCSIPreferencesGetDiscoveryDict(preferences,true);
+    CFBooleanRef value = CFDictionaryGetValue(discoveryDict,kiSCSIPKDiscoveryPersistentSessions);
+
+    // Preferences written before this setting existed do not contain it
+    if(!value)
+        return false;
+
+    return CFBooleanGetValue(value);
+}
+
 /*! Resets iSCSI preferences, removing all defined targets and
  *  configuration parameters. */
 void iSCSIPreferencesReset(iSCSIPreferencesRef preferences)
@@ -183,6 +183,69 @@ void iSCSIPreferencesSetMaxConnectionsForTarget(iSCSIPreferencesRef preferences,
 UInt32 iSCSIPreferencesGetMaxConnectionsForTarget(iSCSIPreferencesRef preferences,
                                          CFStringRef targetIQN);
 
+/*! Sets the time to poll for responses after sending a command to the
+ *  target.  Polling trades CPU time for lower latency with fast targets.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param budget the busy poll budget (microseconds), or 0 to disable. */
+void iSCSIPreferencesSetBusyPollBudgetForTarget(iSCSIPreferencesRef preferences,
+                                                CFStringRef targetIQN,
+                                                UInt32 budget);
+
+/*! Gets the time to poll for responses after sending a command to the
+ *  target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the busy poll budget (microseconds), or 0 if disabled. */
+UInt32 iSCSIPreferencesGetBusyPollBudgetForTarget(iSCSIPreferencesRef preferences,
+                                                  CFStringRef targetIQN);
+
+/*! Sets the file to which PDUs exchanged with the target are captured.  The
+ *  file is written in pcapng format while the target is logged in.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param path the path of the capture file, or NULL to disable capture. */
+void iSCSIPreferencesSetPDUCaptureFileForTarget(iSCSIPreferencesRef preferences,
+                                                CFStringRef targetIQN,
+                                                CFStringRef path);
+
+/*! Gets the file to which PDUs exchanged with the target are captured.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the path of the capture file, or NULL if capture is disabled. */
+CFStringRef iSCSIPreferencesGetPDUCaptureFileForTarget(iSCSIPreferencesRef preferences,
+                                                       CFStringRef targetIQN);
+
+/*! Sets the number of bytes of each PDU to capture for the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param snapLength the number of bytes to capture. */
+void iSCSIPreferencesSetPDUCaptureSnapLengthForTarget(iSCSIPreferencesRef preferences,
+                                                      CFStringRef targetIQN,
+                                                      UInt32 snapLength);
+
+/*! Gets the number of bytes of each PDU to capture for the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return the number of bytes to capture. */
+UInt32 iSCSIPreferencesGetPDUCaptureSnapLengthForTarget(iSCSIPreferencesRef preferences,
+                                                        CFStringRef targetIQN);
+
+/*! Sets the fraction of PDUs that are captured for the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param sampleRate capture one out of every sampleRate PDUs. */
+void iSCSIPreferencesSetPDUCaptureSampleRateForTarget(iSCSIPreferencesRef preferences,
+                                                      CFStringRef targetIQN,
+                                                      UInt32 sampleRate);
+
+/*! Gets the fraction of PDUs that are captured for the target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @return one out of every N PDUs is captured. */
+UInt32 iSCSIPreferencesGetPDUCaptureSampleRateForTarget(iSCSIPreferencesRef preferences,
+                                                        CFStringRef targetIQN);
+
 /*! Sets the error recovery level to use for the target.
  *  @param preferences an iSCSI preferences object.
  *  @param targetIQN the target iSCSI qualified name (IQN).
@@ -395,6 +458,19 @@ void iSCSIPreferencesSetSendTargetsDiscoveryInterval(iSCSIPreferencesRef prefere
  *  @return the discovery interval, in seconds. */
 CFIndex iSCSIPreferencesGetSendTargetsDiscoveryInterval(iSCSIPreferencesRef preferences);
 
+/*! Sets whether SendTargets discovery sessions are kept open between
+ *  discovery intervals.
+ *  @param preferences an iSCSI preferences object.
+ *  @param enable True to keep discovery sessions open, false otherwise. */
+void iSCSIPreferencesSetSendTargetsDiscoveryPersistentSessions(iSCSIPreferencesRef preferences,
+                                                               Boolean enable);
+
+/*! Gets whether SendTargets discovery sessions are kept open between
+ *  discovery intervals.
+ *  @param preferences an iSCSI preferences object.
+ *  @return True if discovery sessions are kept open, false otherwise. */
+Boolean iSCSIPreferencesGetSendTargetsDiscoveryPersistentSessions(iSCSIPreferencesRef preferences);
+
 /*! Resets iSCSI preferences, removing all defined targets and
  *  configuration parameters.
  *  @param preferences an iSCSI preferences object. */
@@ -116,4 +116,8 @@ static CFStringRef kRFC3720_Key_SessionId = CFSTR("SessionId");
 // Not technically a RFC3720 key but used to get the connection identifier
 static CFStringRef kRFC3720_Key_ConnectionId = CFSTR("ConnectionId");
 
+// Not technically RFC3720 keys but used to get connection statistics
+static CFStringRef kRFC3720_Key_BytesPerSecond = CFSTR("BytesPerSecond");
+static CFStringRef kRFC3720_Key_Latency = CFSTR("Latency");
+
 #endif
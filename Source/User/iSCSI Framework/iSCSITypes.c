@@ -30,10 +30,12 @@
 
 /*! iSCSI portal records are dictionaries with three keys with string values
  *  that specify the address (DNS name or IP address), the port, and the
- *  host interface to use when connecting to the portal. */
+ *  host interface to use when connecting to the portal.  An optional
+ *  numeric key specifies the socket buffer size to use for connections. */
 CFStringRef kiSCSIPortalAddresssKey = CFSTR("Address");
 CFStringRef kiSCSIPortalPortKey = CFSTR("Port");
 CFStringRef kiSCSIPortalHostInterfaceKey = CFSTR("Host Interface");
+CFStringRef kiSCSIPortalSocketBufferSizeKey = CFSTR("Socket Buffer Size");
 
 
 
@@ -100,6 +102,30 @@ void iSCSIPortalSetHostInterface(iSCSIMutablePortalRef portal,CFStringRef hostIn
     CFDictionarySetValue(portal,kiSCSIPortalHostInterfaceKey,hostInterface);
 }
 
+UInt32 iSCSIPortalGetSocketBufferSize(iSCSIPortalRef portal)
+{
+    UInt32 socketBufferSize = 0;
+    CFNumberRef value = CFDictionaryGetValue(portal,kiSCSIPortalSocketBufferSizeKey);
+    
+    if(value)
+        CFNumberGetValue(value,kCFNumberSInt32Type,&socketBufferSize);
+    
+    return socketBufferSize;
+}
+
+void iSCSIPortalSetSocketBufferSize(iSCSIMutablePortalRef portal,UInt32 socketBufferSize)
+{
+    // Automatic sizing is the default; don't clutter the portal record
+    if(socketBufferSize == 0) {
+        CFDictionaryRemoveValue(portal,kiSCSIPortalSocketBufferSizeKey);
+        return;
+    }
+    
+    CFNumberRef value = CFNumberCreate(kCFAllocatorDefault,kCFNumberSInt32Type,&socketBufferSize);
+    CFDictionarySetValue(portal,kiSCSIPortalSocketBufferSizeKey,value);
+    CFRelease(value);
+}
+
 /*! Releases memory associated with iSCSI portals. */
 void iSCSIPortalRelease(iSCSIPortalRef portal)
 {
@@ -549,6 +575,31 @@ CFArrayRef iSCSIDiscoveryRecGetPortals(iSCSIDiscoveryRecRef discoveryRec,
     return portalGroup;
 }
 
+/*! Compares the portal groups and portals of a target in two discovery
+ *  records.
+ *  @param discoveryRec the discovery record.
+ *  @param otherRec the discovery record to compare against.
+ *  @param targetIQN the name of the target.
+ *  @return true if the target is absent from both records or if it has
+ *  identical portal groups and portals in both records. */
+Boolean iSCSIDiscoveryRecTargetIsEqual(iSCSIDiscoveryRecRef discoveryRec,
+                                       iSCSIDiscoveryRecRef otherRec,
+                                       CFStringRef targetIQN)
+{
+    // Validate inputs
+    if(!discoveryRec || !otherRec || !targetIQN)
+        return false;
+    
+    CFDictionaryRef targetDict = NULL, otherTargetDict = NULL;
+    CFDictionaryGetValueIfPresent(discoveryRec,targetIQN,(void *)&targetDict);
+    CFDictionaryGetValueIfPresent(otherRec,targetIQN,(void *)&otherTargetDict);
+    
+    if(!targetDict || !otherTargetDict)
+        return targetDict == otherTargetDict;
+    
+    return CFEqual(targetDict,otherTargetDict);
+}
+
 /*! Releases memory associated with an iSCSI discovery record object.
  * @param target the iSCSI discovery record object. */
 void iSCSIDiscoveryRecRelease(iSCSIDiscoveryRecRef discoveryRec)
@@ -588,6 +639,7 @@ CFDataRef iSCSIDiscoveryRecCreateData(iSCSIMutableDiscoveryRecRef discoveryRec)
 CFStringRef kiSCSISessionConfigErrorRecoveryKey = CFSTR("Error Recovery Level");
 CFStringRef kiSCSISessionConfigPortalGroupTagKey = CFSTR("Target Portal Group Tag");
 CFStringRef kiSCSISessionConfigMaxConnectionsKey = CFSTR("Maximum Connections");
+CFStringRef kiSCSISessionConfigBusyPollBudgetKey = CFSTR("Busy Poll Budget");
 
 /*! Convenience function.  Creates a new iSCSISessionConfigRef with the above keys. */
 iSCSIMutableSessionConfigRef iSCSISessionConfigCreateMutable()
@@ -596,6 +648,7 @@ iSCSIMutableSessionConfigRef iSCSISessionConfigCreateMutable()
     iSCSISessionConfigSetErrorRecoveryLevel(config,kRFC3720_ErrorRecoveryLevel);
     iSCSISessionConfigSetMaxConnections(config,kRFC3720_MaxConnections);
     iSCSISessionConfigSetTargetPortalGroupTag(config,0);
+    iSCSISessionConfigSetBusyPollBudget(config,0);
     return config;
 }
 
@@ -660,6 +713,25 @@ void iSCSISessionConfigSetMaxConnections(iSCSIMutableSessionConfigRef target,
     CFRelease(maxConnectionsNum);
 }
 
+/*! Gets the busy poll budget (microseconds). */
+UInt32 iSCSISessionConfigGetBusyPollBudget(iSCSISessionConfigRef target)
+{
+    UInt32 budget = 0;
+    CFNumberRef budgetNum = CFDictionaryGetValue(target,kiSCSISessionConfigBusyPollBudgetKey);
+    if(budgetNum)
+        CFNumberGetValue(budgetNum,kCFNumberIntType,&budget);
+    return budget;
+}
+
+/*! Sets the busy poll budget (microseconds). */
+void iSCSISessionConfigSetBusyPollBudget(iSCSIMutableSessionConfigRef target,
+                                         UInt32 budget)
+{
+    CFNumberRef budgetNum = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&budget);
+    CFDictionarySetValue(target,kiSCSISessionConfigBusyPollBudgetKey,budgetNum);
+    CFRelease(budgetNum);
+}
+
 /*! Releases memory associated with an iSCSI session configuration object.
  *  @param config an iSCSI session configuration object. */
 void iSCSISessionConfigRelease(iSCSISessionConfigRef config)
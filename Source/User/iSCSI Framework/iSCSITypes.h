@@ -266,6 +266,19 @@ CFStringRef iSCSIPortalGetHostInterface(iSCSIPortalRef portal);
 void iSCSIPortalSetHostInterface(iSCSIMutablePortalRef portal,
                                  CFStringRef hostInterface);
 
+/*! Gets the socket buffer size to use for connections to the iSCSI portal.
+ *  @param portal an iSCSI portal object.
+ *  @return the socket buffer size in bytes, or 0 if the buffers should be
+ *  sized automatically. */
+UInt32 iSCSIPortalGetSocketBufferSize(iSCSIPortalRef portal);
+
+/*! Sets the socket buffer size to use for connections to the iSCSI portal.
+ *  @param portal an iSCSI portal object.
+ *  @param socketBufferSize the socket buffer size in bytes, or 0 to size
+ *  the buffers automatically. */
+void iSCSIPortalSetSocketBufferSize(iSCSIMutablePortalRef portal,
+                                    UInt32 socketBufferSize);
+
 /*! Releases memory associated with an iSCSI portal object.
  *  @param portal an iSCSI portal object. */
 void iSCSIPortalRelease(iSCSITargetRef portal);
@@ -456,6 +469,17 @@ CFArrayRef iSCSIDiscoveryRecGetPortals(iSCSIDiscoveryRecRef discoveryRec,
                                        CFStringRef targetIQN,
                                        CFStringRef portalGroupTag);
 
+/*! Compares the portal groups and portals of a target in two discovery
+ *  records.
+ *  @param discoveryRec the discovery record.
+ *  @param otherRec the discovery record to compare against.
+ *  @param targetIQN the name of the target.
+ *  @return true if the target is absent from both records or if it has
+ *  identical portal groups and portals in both records. */
+Boolean iSCSIDiscoveryRecTargetIsEqual(iSCSIDiscoveryRecRef discoveryRec,
+                                       iSCSIDiscoveryRecRef otherRec,
+                                       CFStringRef targetIQN);
+
 /*! Releases memory associated with an iSCSI discovery record object.
  * @param target the iSCSI discovery record object. */
 void iSCSIDiscoveryRecRelease(iSCSIDiscoveryRecRef discoveryRec);
@@ -512,6 +536,15 @@ UInt32 iSCSISessionConfigGetMaxConnections(iSCSISessionConfigRef config);
 void iSCSISessionConfigSetMaxConnections(iSCSIMutableSessionConfigRef config,
                                          UInt32 maxConnections);
 
+/*! Gets the time to poll for responses after a command is sent
+ *  (microseconds, 0 if polling is disabled). */
+UInt32 iSCSISessionConfigGetBusyPollBudget(iSCSISessionConfigRef config);
+
+/*! Sets the time to poll for responses after a command is sent
+ *  (microseconds, 0 to disable polling). */
+void iSCSISessionConfigSetBusyPollBudget(iSCSIMutableSessionConfigRef config,
+                                         UInt32 budget);
+
 /*! Releases memory associated with an iSCSI session configuration object.
  *  @param config an iSCSI session configuration object. */
 void iSCSISessionConfigRelease(iSCSISessionConfigRef config);
@@ -57,6 +57,28 @@ static const UInt16 kiSCSIMaxSessions = 16;
 /*! Max number of connections per session. */
 static const UInt32 kiSCSIMaxConnectionsPerSession = 2;
 
+/*! Maximum time, in microseconds, to busy poll for a response.  Polling
+ *  runs on the workloop of the HBA and must be kept short. */
+static const UInt32 kiSCSIMaxBusyPollBudget = 1000;
+
+/*! Smallest socket buffer size used for a connection (bytes); this is
+ *  also the initial size before any measurements are available. */
+static const UInt32 kiSCSIMinSocketBufferSize = 262144;
+
+/*! Largest socket buffer size used for a connection (bytes). */
+static const UInt32 kiSCSIMaxSocketBufferSize = 4194304;
+
+/*! Minimum number of bytes captured from each PDU when PDU capture is
+ *  enabled (the basic header segment). */
+static const UInt32 kiSCSIPDUCaptureMinSnapLength = 48;
+
+/*! Maximum number of bytes captured from each PDU. */
+static const UInt32 kiSCSIPDUCaptureMaxSnapLength = 240;
+
+/*! Default number of bytes captured from each PDU when PDU capture is
+ *  enabled (the basic header segment and the start of the data segment). */
+static const UInt32 kiSCSIPDUCaptureDefaultSnapLength = 96;
+
 /*! An enumeration of configurable session parameters. */
 enum iSCSIHBASessionParameters {
     
@@ -99,6 +121,19 @@ enum iSCSIHBASessionParameters {
     /*! Target portal group tag (TPGT). */
     kiSCSIHBASOTargetPortalGroupTag,
     
+    /*! Time to poll for a response after a command is sent, in microseconds
+     *  (UInt32).  A value of 0 disables polling. */
+    kiSCSIHBASOBusyPollBudget,
+    
+    /*! Number of bytes of each PDU to capture (UInt32).  Only the basic
+     *  header segment of received PDUs is captured.  A value of 0
+     *  disables PDU capture for the session. */
+    kiSCSIHBASOCaptureSnapLength,
+    
+    /*! Capture one out of every N PDUs (UInt32).  A value of 0 or 1
+     *  captures every PDU. */
+    kiSCSIHBASOCaptureSampleRate,
+    
 };
 
 
@@ -130,7 +165,19 @@ enum iSCSIHBAConnectionParameters {
     kiSCSIHBACOMaxRecvDataSegmentLength,
     
     /*! Initial expStatSN. */
-    kiSCSIHBACOInitialExpStatSN
+    kiSCSIHBACOInitialExpStatSN,
+    
+    /*! Average data transfer rate of the connection, in bytes per
+     *  second (UInt32, read-only). */
+    kiSCSIHBACOBytesPerSecond,
+    
+    /*! Average time to complete a task on the connection, in
+     *  microseconds (UInt32, read-only). */
+    kiSCSIHBACOLatency,
+    
+    /*! Size of the socket send and receive buffers, in bytes (UInt32).  A
+     *  value of 0 sizes the buffers automatically. */
+    kiSCSIHBACOSocketBufferSize
     
 };
 
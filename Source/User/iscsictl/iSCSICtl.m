@@ -158,6 +158,21 @@ CFStringRef kOptKeyMaxConnections = CFSTR("MaxConnections");
 /*! Error recovery level command line option. */
 CFStringRef kOptKeyErrorRecoveryLevel = CFSTR("ErrorRecoveryLevel");
 
+/*! Busy poll budget command line option. */
+CFStringRef kOptKeyBusyPollBudget = CFSTR("BusyPollBudget");
+
+/*! PDU capture file command line option. */
+CFStringRef kOptKeyCaptureFile = CFSTR("CaptureFile");
+
+/*! PDU capture snap length command line option. */
+CFStringRef kOptKeyCaptureSnapLength = CFSTR("CaptureSnapLength");
+
+/*! PDU capture sample rate command line option. */
+CFStringRef kOptKeyCaptureSampleRate = CFSTR("CaptureSampleRate");
+
+/*! Socket buffer size command line option. */
+CFStringRef kOptKeySocketBufferSize = CFSTR("SocketBufferSize");
+
 /*! Header digest command line option. */
 CFStringRef kOptKeyHeaderDigest = CFSTR("HeaderDigest");
 
@@ -182,6 +197,9 @@ CFStringRef kOptValueDiscoveryDisable = CFSTR("disable");
 /*! Discovery interval command-line option. */
 CFStringRef kOptKeyDiscoveryInterval = CFSTR("interval");
 
+/*! Discovery persistent sessions enable/disable command-line option. */
+CFStringRef kOptKeyDiscoveryPersistent = CFSTR("persistent");
+
 /*! Empty value. */
 CFStringRef kOptValueEmpty = CFSTR("");
 
@@ -625,6 +643,31 @@ errno_t iSCSICtlModifyPortalFromOptions(CFDictionaryRef options,
             
         iSCSIPortalRelease(portalUpdates);
     }
+    
+    // If the socket buffer size was specified, update it
+    CFStringRef value = NULL;
+    if(CFDictionaryGetValueIfPresent(options,kOptKeySocketBufferSize,(const void **)&value))
+    {
+        char buffer[32];
+        char * end = NULL;
+        long socketBufferSize = -1;
+        
+        // Reject anything that is not entirely a non-negative number
+        if(CFStringGetCString(value,buffer,sizeof(buffer),kCFStringEncodingASCII)) {
+            errno = 0;
+            socketBufferSize = strtol(buffer,&end,10);
+            if(errno || end == buffer || *end != '\0')
+                socketBufferSize = -1;
+        }
+        
+        // 0 sizes the buffers automatically
+        if(socketBufferSize < 0 || (socketBufferSize != 0 &&
+           (socketBufferSize < kiSCSIMinSocketBufferSize || socketBufferSize > kiSCSIMaxSocketBufferSize))) {
+            iSCSICtlDisplayError(CFSTR("The specified socket buffer size is invalid (0, or 262144 - 4194304 bytes)"));
+            return EINVAL;
+        }
+        iSCSIPortalSetSocketBufferSize(portal,(UInt32)socketBufferSize);
+    }
 
     return 0;
 }
@@ -1256,6 +1299,70 @@ errno_t iSCSICtlModifyTargetFromOptions(AuthorizationRef authorization,
         validOption = true;
     }
 
+    // Check for busy poll budget
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyBusyPollBudget,(const void **)&value))
+    {
+        SInt32 budget = CFStringGetIntValue(value);
+        
+        if(budget < 0 || (UInt32)budget > kiSCSIMaxBusyPollBudget) {
+            iSCSICtlDisplayError(CFSTR("The specified busy poll budget is invalid (0 - 1000 microseconds)"));
+            error = EINVAL;
+        }
+        else
+            iSCSIPreferencesSetBusyPollBudgetForTarget(preferences,targetIQN,budget);
+        
+        validOption = true;
+    }
+
+    // Check for PDU capture file ("none" disables capture)
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyCaptureFile,(const void **)&value))
+    {
+        if(CFStringCompare(value,CFSTR("none"),kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetPDUCaptureFileForTarget(preferences,targetIQN,NULL);
+        else if(!CFStringHasPrefix(value,CFSTR("/"))) {
+            iSCSICtlDisplayError(CFSTR("The capture file must be specified using an absolute path"));
+            error = EINVAL;
+        }
+        else
+            iSCSIPreferencesSetPDUCaptureFileForTarget(preferences,targetIQN,value);
+        
+        validOption = true;
+    }
+
+    // Check for PDU capture snap length
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyCaptureSnapLength,(const void **)&value))
+    {
+        SInt32 snapLength = CFStringGetIntValue(value);
+        
+        if(snapLength < kiSCSIPDUCaptureMinSnapLength || snapLength > kiSCSIPDUCaptureMaxSnapLength) {
+            CFStringRef errorString = CFStringCreateWithFormat(kCFAllocatorDefault,0,
+                CFSTR("The capture snap length must be between %u and %u bytes"),
+                kiSCSIPDUCaptureMinSnapLength,kiSCSIPDUCaptureMaxSnapLength);
+            iSCSICtlDisplayError(errorString);
+            CFRelease(errorString);
+            error = EINVAL;
+        }
+        else
+            iSCSIPreferencesSetPDUCaptureSnapLengthForTarget(preferences,targetIQN,snapLength);
+        
+        validOption = true;
+    }
+
+    // Check for PDU capture sample rate
+    if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyCaptureSampleRate,(const void **)&value))
+    {
+        SInt32 sampleRate = CFStringGetIntValue(value);
+        
+        if(sampleRate < 1) {
+            iSCSICtlDisplayError(CFSTR("The specified capture sample rate is invalid"));
+            error = EINVAL;
+        }
+        else
+            iSCSIPreferencesSetPDUCaptureSampleRateForTarget(preferences,targetIQN,sampleRate);
+        
+        validOption = true;
+    }
+
     // Check for error recovery level
     if(!error && CFDictionaryGetValueIfPresent(options,kOptKeyErrorRecoveryLevel,(const void **)&value))
     {
@@ -1411,8 +1518,7 @@ errno_t iSCSICtlModifyTarget(AuthorizationRef authorization,CFDictionaryRef opti
             if(portal) {
                 if(iSCSIDaemonIsPortalActive(handle,target,portal))
                     iSCSICtlDisplayString(CFSTR("The specified portal is connected and cannot be modified\n"));
-                else {
-                    iSCSICtlModifyPortalFromOptions(options,portal);
+                else if(!(error = iSCSICtlModifyPortalFromOptions(options,portal))) {
                     iSCSIPreferencesSetPortalForTarget(preferences,targetIQN,portal);
                     iSCSICtlDisplayString(CFSTR("Portal settings have been updated\n"));
                 }
@@ -1524,14 +1630,18 @@ void displayPortalInfo(iSCSITargetRef target,
     else {
         
         CFNumberRef connectionId = CFDictionaryGetValue(properties,kRFC3720_Key_ConnectionId);
+        CFNumberRef bytesPerSecond = CFDictionaryGetValue(properties,kRFC3720_Key_BytesPerSecond);
+        CFNumberRef latency = CFDictionaryGetValue(properties,kRFC3720_Key_Latency);
         
         portalStatus = CFStringCreateWithFormat(
             kCFAllocatorDefault,NULL,
-            CFSTR("\t%@ <active, cid %@, port %@, interface %@>\n"),
+            CFSTR("\t%@ <active, cid %@, port %@, interface %@, %@ B/s, %@ us>\n"),
             portalAddress,
             connectionId,
             iSCSIPortalGetPort(portal),
-            iSCSIPortalGetHostInterface(portal));
+            iSCSIPortalGetHostInterface(portal),
+            bytesPerSecond,
+            latency);
     }
     
     iSCSICtlDisplayString(portalStatus);
@@ -1688,6 +1798,7 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
     // Get configured parameter values
     int maxConnectionsCfg = iSCSIPreferencesGetMaxConnectionsForTarget(preferences,targetIQN);
     enum iSCSIErrorRecoveryLevels errorRecoveryLevelCfg = iSCSIPreferencesGetErrorRecoveryLevelForTarget(preferences,targetIQN);
+    int busyPollBudgetCfg = iSCSIPreferencesGetBusyPollBudgetForTarget(preferences,targetIQN);
     CFStringRef headerDigestStr = iSCSICtlGetStringForDigestType(iSCSIPreferencesGetHeaderDigestForTarget(preferences,targetIQN));
     CFStringRef dataDigestStr = iSCSICtlGetStringForDigestType(iSCSIPreferencesGetDataDigestForTarget(preferences,targetIQN));
 
@@ -1695,6 +1806,7 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
         format = CFSTR("\tConfiguration:"
                        "\n\t\t%@ %@ (%d)"       // MaxConnections
                        "\n\t\t%@ %@ (%d)"       // ErrorRecoveryLevel
+                       "\n\t\t%@ (%d)"          // BusyPollBudget
                        "\n\t\t%@ (%@)"          // HeaderDigest
                        "\n\t\t%@ (%@)");        // DataDigest
 
@@ -1705,18 +1817,21 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
         targetParams = CFStringCreateWithFormat(kCFAllocatorDefault,0,format,
                         kOptKeyMaxConnections,maxConnections,maxConnectionsCfg,
                         kOptKeyErrorRecoveryLevel,errorRecoveryLevel,errorRecoveryLevelCfg,
+                        kOptKeyBusyPollBudget,busyPollBudgetCfg,
                         kOptKeyHeaderDigest,headerDigestStr,
                         kOptKeyDataDigest,dataDigestStr);
     } else {
         format = CFSTR("\tConfiguration:"
                        "\n\t\t%@ (%d)"      // MaxConnections
                        "\n\t\t%@ (%d)"      // ErrorRecoveryLevel
+                       "\n\t\t%@ (%d)"      // BusyPollBudget
                        "\n\t\t%@ (%@)"      // HeaderDigest
                        "\n\t\t%@ (%@)");    // DataDigest
 
         targetParams = CFStringCreateWithFormat(kCFAllocatorDefault,0,format,
                         kOptKeyMaxConnections,maxConnectionsCfg,
                         kOptKeyErrorRecoveryLevel,errorRecoveryLevelCfg,
+                        kOptKeyBusyPollBudget,busyPollBudgetCfg,
                         kOptKeyHeaderDigest,headerDigestStr,
                         kOptKeyDataDigest,dataDigestStr);
     }
@@ -1748,6 +1863,22 @@ errno_t iSCSICtlListTarget(CFDictionaryRef options)
     CFRelease(CHAPName);
 
     iSCSICtlDisplayString(targetParams);
+    
+    // Display PDU capture settings only if capture is enabled
+    CFStringRef captureFile = iSCSIPreferencesGetPDUCaptureFileForTarget(preferences,targetIQN);
+    
+    if(captureFile) {
+        CFStringRef captureCfg = CFStringCreateWithFormat(kCFAllocatorDefault,0,
+                        CFSTR("\n\t\t%@ (%@)"          // CaptureFile
+                              "\n\t\t%@ (%u)"          // CaptureSnapLength
+                              "\n\t\t%@ (%u)"),        // CaptureSampleRate
+                        kOptKeyCaptureFile,captureFile,
+                        kOptKeyCaptureSnapLength,iSCSIPreferencesGetPDUCaptureSnapLengthForTarget(preferences,targetIQN),
+                        kOptKeyCaptureSampleRate,iSCSIPreferencesGetPDUCaptureSampleRateForTarget(preferences,targetIQN));
+        iSCSICtlDisplayString(captureCfg);
+        CFRelease(captureCfg);
+    }
+    
     iSCSICtlDisplayString(targetAuth);
 
     CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN);
@@ -1805,18 +1936,25 @@ errno_t iSCSICtlListDiscoveryConfig()
 
     Boolean enabled = iSCSIPreferencesGetSendTargetsDiscoveryEnable(preferences);
     CFIndex interval = iSCSIPreferencesGetSendTargetsDiscoveryInterval(preferences);
+    Boolean persistent = iSCSIPreferencesGetSendTargetsDiscoveryPersistentSessions(preferences);
 
     CFStringRef enableString = CFSTR("disabled");
     if(enabled)
         enableString = CFSTR("enabled");
 
+    CFStringRef persistentString = CFSTR("disabled");
+    if(persistent)
+        persistentString = CFSTR("enabled");
+
     CFStringRef format = CFSTR("\%@: %@"
-                               "\n\tinterval: %ld seconds");
+                               "\n\tinterval: %ld seconds"
+                               "\n\tpersistent sessions: %@");
     CFStringRef discoveryConfig = CFStringCreateWithFormat(kCFAllocatorDefault,0,
                                                            format,
                                                            kOptKeySendTargetsEnable,
                                                            enableString,
-                                                           interval);
+                                                           interval,
+                                                           persistentString);
     iSCSICtlDisplayString(discoveryConfig);
     CFRelease(discoveryConfig);
 
@@ -2041,6 +2179,23 @@ errno_t iSCSICtlModifyDiscovery(AuthorizationRef authorization,CFDictionaryRef o
         
         validOption = true;
     }
+    // Check if user enabled or disabled persistent discovery sessions
+    if(!error && CFDictionaryGetValueIfPresent(optDictionary,kOptKeyDiscoveryPersistent,(const void **)&value))
+    {
+        if(CFStringCompare(value,kOptValueDiscoveryEnable,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetSendTargetsDiscoveryPersistentSessions(preferences,true);
+        else if(CFStringCompare(value,kOptValueDiscoveryDisable,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
+            iSCSIPreferencesSetSendTargetsDiscoveryPersistentSessions(preferences,false);
+        else {
+            CFStringRef errorString = CFStringCreateWithFormat(
+                                                               kCFAllocatorDefault,0,CFSTR("Invalid argument for %@"),kOptKeyDiscoveryPersistent);
+            iSCSICtlDisplayError(errorString);
+            CFRelease(errorString);
+            error = EINVAL;
+        }
+        
+        validOption = true;
+    }
     
     if(!error) {
         iSCSIDaemonPreferencesIOUnlockAndSync(handle,preferences);
@@ -36,9 +36,6 @@
 /*! Defined by the session layer and used during authentication here. */
 extern unsigned int kiSCSISessionMaxTextKeyValuePairs;
 
-extern CFStringRef kiSCSIInitiatorIQN;
-extern CFStringRef kiSCSIInitiatorAlias;
-
 /*! Helper function.  Create a byte array (CFDataRef object) that holds the
  *  value represented by the hexidecimal string. Handles strings with or
  *  without a 0x prefix. */
@@ -330,7 +327,8 @@ errno_t iSCSIAuthNegotiateCHAP(iSCSISessionManagerRef managerRef,
     return error;
 }
 
-void iSCSIAuthNegotiateBuildDict(iSCSITargetRef target,
+void iSCSIAuthNegotiateBuildDict(iSCSISessionManagerRef managerRef,
+                                 iSCSITargetRef target,
                                  iSCSIAuthRef initiatorAuth,
                                  iSCSIAuthRef targetAuth,
                                  CFMutableDictionaryRef authCmd)
@@ -344,9 +342,9 @@ void iSCSIAuthNegotiateBuildDict(iSCSITargetRef target,
         CFDictionaryAddValue(authCmd,kRFC3720_Key_TargetName,iSCSITargetGetIQN(target));
     }
 
-    // Read global variables for initiator name & alias and add them to dict.
-    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorName,kiSCSIInitiatorIQN);
-    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorAlias,kiSCSIInitiatorAlias);
+    // Add the initiator name & alias configured for the session manager
+    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorName,iSCSISessionManagerGetInitiatorName(managerRef));
+    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorAlias,iSCSISessionManagerGetInitiatorAlias(managerRef));
 
     // Determine authentication method used and add to dictionary
     enum iSCSIAuthMethods initiatorAuthMethod = iSCSIAuthGetMethod(initiatorAuth);
@@ -409,7 +407,7 @@ errno_t iSCSIAuthNegotiate(iSCSISessionManagerRef managerRef,
         kCFAllocatorDefault,kiSCSISessionMaxTextKeyValuePairs,
         &kCFTypeDictionaryKeyCallBacks,&kCFTypeDictionaryValueCallBacks);
     
-    iSCSIAuthNegotiateBuildDict(target,initiatorAuth,targetAuth,authCmd);
+    iSCSIAuthNegotiateBuildDict(managerRef,target,initiatorAuth,targetAuth,authCmd);
     
     struct iSCSILoginQueryContext context;
     context.interface    = hbaInterface;
@@ -578,8 +576,8 @@ errno_t iSCSIAuthInterrogate(iSCSISessionManagerRef managerRef,
     CFDictionaryAddValue(authCmd,kRFC3720_Key_SessionType,kRFC3720_Value_SessionTypeNormal);
     CFDictionaryAddValue(authCmd,kRFC3720_Key_TargetName,iSCSITargetGetIQN(target));
     
-    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorName,kiSCSIInitiatorIQN);
-    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorAlias,kiSCSIInitiatorAlias);
+    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorName,iSCSISessionManagerGetInitiatorName(managerRef));
+    CFDictionaryAddValue(authCmd,kRFC3720_Key_InitiatorAlias,iSCSISessionManagerGetInitiatorAlias(managerRef));
     CFDictionaryAddValue(authCmd,kRFC3720_Key_AuthMethod,kRFC3720_Value_AuthMethodAll);
 
     // Setup dictionary to receive authentication response
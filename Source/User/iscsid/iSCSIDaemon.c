@@ -66,6 +66,7 @@
 #include "iSCSIDA.h"
 #include "iSCSIAuthRights.h"
 #include "iSCSIDiscovery.h"
+#include "iSCSIPDUCaptureFile.h"
 
 
 // Used to notify daemon of power state changes
@@ -82,9 +83,38 @@ CFRunLoopSourceRef discoverySource = NULL;
 // Used to point to discovery records
 CFDictionaryRef discoveryRecords = NULL;
 
-// Mutex lock when discovery is running
+// Discovery records last applied to preferences, keyed by discovery portal
+CFMutableDictionaryRef discoverySnapshots = NULL;
+
+// Protects discoveryRecords, discoveryRunning and discoveryCloseSessions
 pthread_mutex_t discoveryMutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Signaled when the discovery thread finishes
+pthread_cond_t discoveryCond = PTHREAD_COND_INITIALIZER;
+
+// Set by the main thread when it launches the discovery thread, and cleared
+// by the discovery thread when it finishes
+Boolean discoveryRunning = false;
+
+// Set when discovery sessions should be closed once discovery finishes
+Boolean discoveryCloseSessions = false;
+
+// Used to keep discovery sessions alive between discovery intervals
+CFRunLoopTimerRef discoveryKeepaliveTimer = NULL;
+
+/*! Interval (in seconds) at which NOPs are sent over discovery sessions that
+ *  are kept open between discovery intervals. */
+static const CFTimeInterval kiSCSIDDiscoveryKeepaliveInterval = 15;
+
+// Used to periodically write captured PDUs to capture files
+CFRunLoopTimerRef captureTimer = NULL;
+
+/*! Capture files of sessions for which PDU capture is enabled. */
+iSCSIPDUCaptureFileRef captureFiles[kiSCSIMaxSessions];
+
+/*! Interval (in seconds) at which captured PDUs are written to files. */
+static const CFTimeInterval kiSCSIDPDUCaptureInterval = 1;
+
 /*! Server-side timeouts (in milliseconds) for send()/recv(). */
 static const int kiSCSIDaemonTimeoutMilliSec = 250;
 
@@ -110,11 +140,52 @@ struct iSCSIDIncomingRequestInfo {
     int fd;
 };
 
-struct iSCSIDQueueLoginForTargetPortal {
+/*! A login that is waiting to be performed by the login scheduler. */
+struct iSCSIDQueuedLogin {
+    
+    /*! The target to log in to. */
     iSCSITargetRef target;
+    
+    /*! The portal to use for the login. */
     iSCSIPortalRef portal;
+    
+    /*! Set for logins that are performed ahead of others (persistent
+     *  targets and targets that were active before the system slept). */
+    Boolean priority;
+    
+    /*! The number of attempts made so far. */
+    unsigned int attempts;
+    
+    /*! The login is not attempted before this time. */
+    CFAbsoluteTime notBefore;
+    
+    /*! The next login in the queue. */
+    struct iSCSIDQueuedLogin * next;
 };
 
+/*! Logins waiting to be performed; priority logins come first and logins
+ *  of equal priority are kept in the order they were queued. */
+struct iSCSIDQueuedLogin * loginQueue = NULL;
+
+/*! Used to perform queued logins when they become due. */
+CFRunLoopTimerRef loginTimer = NULL;
+
+/*! Delay (in seconds) before the first retry of a failed login; the delay
+ *  doubles with each attempt up to kiSCSIDLoginRetryMaxDelay. */
+static const CFTimeInterval kiSCSIDLoginRetryDelay = 1;
+
+/*! Maximum delay (in seconds) before a failed login is retried. */
+static const CFTimeInterval kiSCSIDLoginRetryMaxDelay = 60;
+
+/*! Number of attempts after which a login is dropped, unless the target
+ *  is persistent (logins to persistent targets are retried indefinitely).
+ *  Logins deferred while the portal is unreachable are not attempts. */
+static const unsigned int kiSCSIDLoginMaxAttempts = 8;
+
+/*! Interval (in seconds) at which a login waiting for its portal to become
+ *  reachable checks the reachability of the portal again. */
+static const CFTimeInterval kiSCSIDLoginReachabilityInterval = 10;
+
 const iSCSIDMsgLoginRsp iSCSIDMsgLoginRspInit = {
     .funcCode = kiSCSIDLogin,
     .errorCode = 0,
@@ -218,6 +289,7 @@ iSCSISessionConfigRef iSCSIDCreateSessionConfig(CFStringRef targetIQN)
 
     iSCSISessionConfigSetErrorRecoveryLevel(config,iSCSIPreferencesGetErrorRecoveryLevelForTarget(preferences,targetIQN));
     iSCSISessionConfigSetMaxConnections(config,iSCSIPreferencesGetMaxConnectionsForTarget(preferences,targetIQN));
+    iSCSISessionConfigSetBusyPollBudget(config,iSCSIPreferencesGetBusyPollBudgetForTarget(preferences,targetIQN));
 
     return config;
 }
@@ -314,6 +386,113 @@ iSCSIAuthRef iSCSIDCreateAuthenticationForInitiator()
     return auth;
 }
 
+/*! Called on a timer (timer setup by iSCSIDUpdatePDUCapture()) to write
+ *  the PDUs captured by the kernel to capture files. */
+void iSCSIDDrainPDUCapture(CFRunLoopTimerRef timer,void * context)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(sessionManager);
+    Boolean captureActive = false;
+    
+    for(SessionIdentifier sessionId = 0; sessionId < kiSCSIMaxSessions; sessionId++)
+    {
+        if(!captureFiles[sessionId])
+            continue;
+        
+        // Close the capture file once the session has been logged out, or
+        // if it can no longer be written; stop capturing in the kernel
+        if(iSCSIPDUCaptureFileDrain(captureFiles[sessionId],hbaInterface)) {
+            UInt32 snapLength = 0;
+            iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOCaptureSnapLength,
+                                                 &snapLength,sizeof(snapLength));
+            iSCSIPDUCaptureFileRelease(captureFiles[sessionId]);
+            captureFiles[sessionId] = NULL;
+        }
+        else
+            captureActive = true;
+    }
+    
+    if(!captureActive && captureTimer) {
+        CFRunLoopRemoveTimer(CFRunLoopGetCurrent(),captureTimer,kCFRunLoopDefaultMode);
+        CFRelease(captureTimer);
+        captureTimer = NULL;
+    }
+}
+
+/*! Applies the PDU capture preferences of a target to its session, opening
+ *  or closing the session's capture file as required.
+ *  @param sessionId the session associated with the target.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param newSession true if the session was just logged in. */
+void iSCSIDUpdatePDUCapture(SessionIdentifier sessionId,
+                            CFStringRef targetIQN,
+                            Boolean newSession)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(sessionManager);
+    CFStringRef path = iSCSIPreferencesGetPDUCaptureFileForTarget(preferences,targetIQN);
+    iSCSIPDUCaptureFileRef file = captureFiles[sessionId];
+    
+    // A file left over from an earlier session with the same identifier
+    if(file && newSession) {
+        iSCSIPDUCaptureFileRelease(file);
+        captureFiles[sessionId] = file = NULL;
+    }
+    
+    // Stop capturing to a file that is no longer configured
+    if(file && (!path || CFStringCompare(path,iSCSIPDUCaptureFileGetPath(file),0) != kCFCompareEqualTo))
+    {
+        UInt32 snapLength = 0;
+        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOCaptureSnapLength,
+                                             &snapLength,sizeof(snapLength));
+        iSCSIPDUCaptureFileDrain(file,hbaInterface);
+        iSCSIPDUCaptureFileRelease(file);
+        captureFiles[sessionId] = file = NULL;
+    }
+    
+    if(!path)
+        return;
+    
+    if(!file && !(file = captureFiles[sessionId] = iSCSIPDUCaptureFileCreate(path,sessionId)))
+        return;
+    
+    UInt32 sampleRate = iSCSIPreferencesGetPDUCaptureSampleRateForTarget(preferences,targetIQN);
+    UInt32 snapLength = iSCSIPreferencesGetPDUCaptureSnapLengthForTarget(preferences,targetIQN);
+    
+    iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOCaptureSampleRate,
+                                         &sampleRate,sizeof(sampleRate));
+    iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOCaptureSnapLength,
+                                         &snapLength,sizeof(snapLength));
+    
+    if(!captureTimer) {
+        captureTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                            CFAbsoluteTimeGetCurrent()+kiSCSIDPDUCaptureInterval,
+                                            kiSCSIDPDUCaptureInterval,0,0,
+                                            &iSCSIDDrainPDUCapture,NULL);
+        
+        CFRunLoopAddTimer(CFRunLoopGetCurrent(),captureTimer,kCFRunLoopDefaultMode);
+    }
+}
+
+/*! Applies the PDU capture preferences of every target that is logged in. */
+void iSCSIDUpdatePDUCaptureForAllSessions()
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(sessionManager);
+    SessionIdentifier sessionIds[kiSCSIMaxSessions];
+    UInt16 sessionCount = 0;
+    
+    if(iSCSIHBAInterfaceGetSessionIds(hbaInterface,sessionIds,&sessionCount))
+        return;
+    
+    for(UInt16 idx = 0; idx < sessionCount; idx++)
+    {
+        CFStringRef targetIQN = iSCSIHBAInterfaceCreateTargetIQNForSessionId(hbaInterface,sessionIds[idx]);
+        
+        if(targetIQN) {
+            iSCSIDUpdatePDUCapture(sessionIds[idx],targetIQN,false);
+            CFRelease(targetIQN);
+        }
+    }
+}
+
 errno_t iSCSIDLoginCommon(SessionIdentifier sessionId,
                           iSCSIMutableTargetRef target,
                           iSCSIPortalRef portal,
@@ -375,6 +554,10 @@ errno_t iSCSIDLoginCommon(SessionIdentifier sessionId,
     {
         iSCSIPreferencesSetTargetAlias(preferences,targetIQN,iSCSITargetGetAlias(target));
         iSCSIPreferencesSynchronzeAppValues(preferences);
+        
+        // Start capturing PDUs for new sessions if requested
+        if(sessCfg)
+            iSCSIDUpdatePDUCapture(sessionId,targetIQN,true);
     }
     
     if(sessCfg)
@@ -393,11 +576,40 @@ errno_t iSCSIDLoginCommon(SessionIdentifier sessionId,
 }
 
 
+/*! Helper function.  Gets the number of connections of a session and the
+ *  maximum number of connections negotiated for it (MaxConnections), which
+ *  is limited to the number of connections the kernel supports per session.
+ *  @param sessionId the session identifier.
+ *  @param activeConnections the number of connections of the session.
+ *  @param maxConnections the maximum number of connections of the session. */
+void iSCSIDGetSessionConnectionCounts(SessionIdentifier sessionId,
+                                      UInt32 * activeConnections,
+                                      UInt32 * maxConnections)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(sessionManager);
+    
+    *activeConnections = 0;
+    *maxConnections = 0;
+    
+    iSCSIHBAInterfaceGetNumConnections(hbaInterface,sessionId,activeConnections);
+    iSCSIHBAInterfaceGetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxConnections,
+                                         maxConnections,sizeof(UInt32));
+    
+    if(*maxConnections > kiSCSIMaxConnectionsPerSession)
+        *maxConnections = kiSCSIMaxConnectionsPerSession;
+}
+
+/*! Logs in to a target using the portals defined for the target.  The
+ *  leading login is attempted over each portal in turn until one succeeds,
+ *  after which connections are added over the remaining portals until the
+ *  number of connections negotiated for the session is reached.  The login
+ *  succeeds if any connection could be established; failures to add the
+ *  remaining connections are logged but do not affect the session. */
 errno_t iSCSIDLoginAllPortals(iSCSIMutableTargetRef target,
                               enum iSCSILoginStatusCode * statusCode)
 {
-    CFIndex activeConnections = 0;
-    CFIndex maxConnections = 0;
+    UInt32 activeConnections = 0;
+    UInt32 maxConnections = 0;
 
     // Error code to return to daemon's client
     errno_t errorCode = 0;
@@ -406,72 +618,66 @@ errno_t iSCSIDLoginAllPortals(iSCSIMutableTargetRef target,
     CFStringRef targetIQN = iSCSITargetGetIQN(target);
     SessionIdentifier sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
 
-    // Set initial values for maxConnections and activeConnections
-    if(sessionId == kiSCSIInvalidSessionId)
-//TODO: change to the maximum value that will be supported by this initiator
-        maxConnections = 1;
-    else {
-
-        // If session exists, get the max connections and active connections
-        CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
-
-        if(properties) {
-            // Get max connections from property list
-            CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
-            CFNumberGetValue(number,kCFNumberSInt32Type,&maxConnections);
-            CFRelease(properties);
-
-            CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
-
-            if(connections) {
-                activeConnections = CFArrayGetCount(connections);
-                CFRelease(connections);
-            }
-        }
-    }
-
-    // Add portals to the session until we've run out of portals to add or
-    // reached the maximum connection limit
-    CFStringRef portalAddress = NULL;
+    // If a session exists, get the max connections and active connections
+    if(sessionId != kiSCSIInvalidSessionId)
+        iSCSIDGetSessionConnectionCounts(sessionId,&activeConnections,&maxConnections);
+    
     CFArrayRef portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN);
-    CFIndex portalIdx = 0;
+    
+    if(!portals)
+        return EINVAL;
+    
     CFIndex portalCount = CFArrayGetCount(portals);
+    Boolean loggedIn = false;
 
-    while( (activeConnections < maxConnections) && portalIdx < portalCount )
+    // Add portals to the session until we've run out of portals to add or
+    // reached the maximum connection limit
+    for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
     {
-        portalAddress = CFArrayGetValueAtIndex(portals,portalIdx);
-
-        // Get portal object and login
-        iSCSIPortalRef portal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
-        errorCode = iSCSIDLoginCommon(sessionId,target,portal,statusCode);
-        iSCSIPortalRelease(portal);
-
-        // Quit if there was an error communicating with the daemon
-        if(errorCode)
+        if(sessionId != kiSCSIInvalidSessionId && activeConnections >= maxConnections)
             break;
+        
+        CFStringRef portalAddress = CFArrayGetValueAtIndex(portals,portalIdx);
+        iSCSIPortalRef portal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
+        
+        if(!portal)
+            continue;
+        
+        // Skip portals that the session is already connected to
+        if(sessionId != kiSCSIInvalidSessionId &&
+           iSCSISessionGetConnectionIdForPortal(sessionManager,sessionId,portal) != kiSCSIInvalidConnectionId)
+        {
+            iSCSIPortalRelease(portal);
+            continue;
+        }
 
+        enum iSCSILoginStatusCode portalStatusCode = kiSCSILoginInvalidStatusCode;
+        errno_t portalErrorCode = iSCSIDLoginCommon(sessionId,target,portal,&portalStatusCode);
+        iSCSIPortalRelease(portal);
+        
+        // Report the outcome of the last attempt until a login succeeds
+        if(!loggedIn) {
+            errorCode = portalErrorCode;
+            *statusCode = portalStatusCode;
+        }
+        
+        if(portalErrorCode || portalStatusCode != kiSCSILoginSuccess)
+            continue;
+        
+        loggedIn = true;
         activeConnections++;
-        portalIdx++;
-
-        // Determine how many connections this session supports
-        sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,iSCSITargetGetIQN(target));
-
-        // If this was the first connection of the session, get the number of
-        // allowed maximum connections
-        if(activeConnections == 1) {
-            CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
-            if(properties) {
-                // Get max connections from property list
-                CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
-                CFNumberGetValue(number,kCFNumberSInt32Type,&maxConnections);
-                CFRelease(properties);
-            }
+        
+        // If this was the leading login, get the number of connections
+        // negotiated for the session
+        if(sessionId == kiSCSIInvalidSessionId) {
+            sessionId = iSCSISessionGetSessionIdForTarget(sessionManager,targetIQN);
+            
+            if(sessionId != kiSCSIInvalidSessionId)
+                iSCSIDGetSessionConnectionCounts(sessionId,&activeConnections,&maxConnections);
         }
-    };
-    
-    if(portals)
-        CFRelease(portals);
+    }
     
+    CFRelease(portals);
     return errorCode;
 }
 
@@ -499,25 +705,13 @@ errno_t iSCSIDLoginWithPortal(iSCSIMutableTargetRef target,
         {} //iSCSICtlDisplayError("The specified target has an active session over the specified portal.");
         else {
             // See if the session can support an additional connection
-            CFDictionaryRef properties = iSCSISessionCopyCFPropertiesForTarget(sessionManager,target);
-            if(properties) {
-                // Get max connections from property list
-                UInt32 maxConnections;
-                CFNumberRef number = CFDictionaryGetValue(properties,kRFC3720_Key_MaxConnections);
-                CFNumberGetValue(number,kCFNumberSInt32Type,&maxConnections);
-                CFRelease(properties);
-
-                CFArrayRef connections = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
-                if(connections)
-                {
-                    CFIndex activeConnections = CFArrayGetCount(connections);
-                    if(activeConnections == maxConnections)
-                    {} //iSCSICtlDisplayError("The active session cannot support additional connections.");
-                    else
-                        errorCode = iSCSIDLoginCommon(sessionId,target,portal,statusCode);
-                    CFRelease(connections);
-                }
-            }
+            UInt32 activeConnections, maxConnections;
+            iSCSIDGetSessionConnectionCounts(sessionId,&activeConnections,&maxConnections);
+
+            if(activeConnections >= maxConnections)
+            {} //iSCSICtlDisplayError("The active session cannot support additional connections.");
+            else
+                errorCode = iSCSIDLoginCommon(sessionId,target,portal,statusCode);
         }
 
     }
@@ -814,11 +1008,18 @@ errno_t iSCSIDCreateArrayOfActiveTargets(int fd,iSCSIDMsgCreateArrayOfActiveTarg
                                                            sessionCount,
                                                            &kCFTypeArrayCallBacks);
 
-    // Get target object for each active session and add to array
+    // Get target object for each active session and add to array (discovery
+    // sessions, which have no target name, are skipped)
     for(CFIndex idx = 0; idx < sessionCount; idx++)
     {
         iSCSITargetRef target = iSCSISessionCopyTargetForId(sessionManager,(SessionIdentifier)CFArrayGetValueAtIndex(sessionIds,idx));
-        CFArrayAppendValue(activeTargets,target);
+        
+        if(!target)
+            continue;
+        
+        if(CFStringCompare(iSCSITargetGetIQN(target),kiSCSIUnspecifiedTargetIQN,0) != kCFCompareEqualTo)
+            CFArrayAppendValue(activeTargets,target);
+        
         iSCSITargetRelease(target);
     }
 
@@ -855,11 +1056,18 @@ errno_t iSCSIDCreateArrayofActivePortalsForTarget(int fd,
                                                            sessionCount,
                                                            &kCFTypeArrayCallBacks);
 
-    // Get target object for each active session and add to array
+    // Get target object for each active session and add to array (discovery
+    // sessions, which have no target name, are skipped)
     for(CFIndex idx = 0; idx < sessionCount; idx++)
     {
         iSCSITargetRef target = iSCSISessionCopyTargetForId(sessionManager,(SessionIdentifier)CFArrayGetValueAtIndex(sessionIds,idx));
-        CFArrayAppendValue(activeTargets,target);
+        
+        if(!target)
+            continue;
+        
+        if(CFStringCompare(iSCSITargetGetIQN(target),kiSCSIUnspecifiedTargetIQN,0) != kCFCompareEqualTo)
+            CFArrayAppendValue(activeTargets,target);
+        
         iSCSITargetRelease(target);
     }
 
@@ -1132,73 +1340,209 @@ errno_t iSCSIDAddTargetForSendTargets(iSCSIPreferencesRef preferences,
     return 0;
 }
 
+/*! Called by the discovery thread when it is done with the discovery
+ *  sessions. Closes the sessions if that was requested while the thread ran
+ *  (see iSCSIDCloseDiscoverySessions()), hands discovery results (if any) to
+ *  the main thread and marks discovery as finished.
+ *  @param records discovery records to hand to the main thread, or NULL. */
+void iSCSIDFinishDiscoveryThread(CFDictionaryRef records)
+{
+    Boolean closeSessions;
+    
+    do {
+        pthread_mutex_lock(&discoveryMutex);
+        closeSessions = discoveryCloseSessions;
+        discoveryCloseSessions = false;
+        
+        if(!closeSessions) {
+            if(records) {
+                if(discoveryRecords)
+                    CFRelease(discoveryRecords);
+                discoveryRecords = records;
+                
+                CFRunLoopSourceSignal(discoverySource);
+                CFRunLoopWakeUp(CFRunLoopGetMain());
+            }
+            
+            discoveryRunning = false;
+            pthread_cond_broadcast(&discoveryCond);
+        }
+        pthread_mutex_unlock(&discoveryMutex);
+        
+        if(closeSessions)
+            iSCSIDiscoveryCloseSessions(sessionManager);
+        
+    } while(closeSessions);
+}
+
 void * iSCSIDRunDiscovery(void * context)
 {
-    if(discoveryRecords != NULL)
-        CFRelease(discoveryRecords);
+    iSCSIDFinishDiscoveryThread(iSCSIDiscoveryCreateRecordsWithSendTargets(sessionManager,preferences));
+    return NULL;
+}
 
-    discoveryRecords = iSCSIDiscoveryCreateRecordsWithSendTargets(sessionManager,preferences);
+void * iSCSIDRunDiscoveryKeepalive(void * context)
+{
+    iSCSIDiscoveryKeepaliveSessions(sessionManager);
+    iSCSIDFinishDiscoveryThread(NULL);
+    return NULL;
+}
 
+/*! Closes the discovery sessions that are kept open between intervals.  If
+ *  a discovery thread is running the sessions are closed by that thread when
+ *  it finishes, so that the run loop is not blocked.
+ *  @param wait true to wait for discovery to finish (and the sessions to be
+ *  closed) if it is running. */
+void iSCSIDCloseDiscoverySessions(Boolean wait)
+{
+    pthread_mutex_lock(&discoveryMutex);
+    
+    if(discoveryRunning) {
+        discoveryCloseSessions = true;
+        
+        while(wait && discoveryRunning)
+            pthread_cond_wait(&discoveryCond,&discoveryMutex);
+        
+        pthread_mutex_unlock(&discoveryMutex);
+        return;
+    }
     
-    // Clear mutex created when discovery was launched
     pthread_mutex_unlock(&discoveryMutex);
     
-    CFRunLoopSourceSignal(discoverySource);
-    return NULL;
+    // Only the main thread launches discovery, so it cannot start here
+    iSCSIDiscoveryCloseSessions(sessionManager);
 }
 
+/*! Applies the results of the last discovery operation to preferences.
+ *  Results are compared against those previously applied for each discovery
+ *  portal; portals whose results are unchanged are skipped, and preferences
+ *  are only written when targets or portals were added, changed or removed. */
 void iSCSIDProcessDiscoveryData(void * info)
 {
-    // Process discovery results if any
-    if(discoveryRecords) {
+    // Take the results of the discovery thread, if any
+    pthread_mutex_lock(&discoveryMutex);
+    CFDictionaryRef records = discoveryRecords;
+    discoveryRecords = NULL;
+    pthread_mutex_unlock(&discoveryMutex);
+    
+    if(!records)
+        return;
+    
+    if(!discoverySnapshots)
+        discoverySnapshots = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
+                                                       &kCFTypeDictionaryKeyCallBacks,
+                                                       &kCFTypeDictionaryValueCallBacks);
+    
+    const CFIndex count = CFDictionaryGetCount(records);
+    const void * keys[count];
+    const void * values[count];
+    CFDictionaryGetKeysAndValues(records,keys,values);
+    
+    Boolean locked = false, changed = false;
+    
+    for(CFIndex i = 0; i < count; i++)
+    {
+        iSCSIDiscoveryRecRef previousRec = CFDictionaryGetValue(discoverySnapshots,keys[i]);
         
-        pthread_mutex_lock(&preferencesMutex);
-        iSCSIDUpdatePreferencesFromAppValues();
+        if(previousRec && CFEqual(previousRec,values[i]))
+            continue;
         
-        const CFIndex count = CFDictionaryGetCount(discoveryRecords);
-        const void * keys[count];
-        const void * values[count];
-        CFDictionaryGetKeysAndValues(discoveryRecords,keys,values);
+        if(!locked) {
+            pthread_mutex_lock(&preferencesMutex);
+            iSCSIDUpdatePreferencesFromAppValues();
+            locked = true;
+        }
         
-        for(CFIndex i = 0; i < count; i++)
-            iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(sessionManager,preferences,keys[i],values[i]);
+        Boolean portalChanged = false;
         
-        iSCSIPreferencesSynchronzeAppValues(preferences);
-        pthread_mutex_unlock(&preferencesMutex);
+        if(!iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(sessionManager,preferences,keys[i],values[i],previousRec,&portalChanged))
+            CFDictionarySetValue(discoverySnapshots,keys[i],values[i]);
+        
+        changed = changed || portalChanged;
+    }
+    
+    // Forget results of portals that were not discovered this time (removed
+    // or unreachable) so that they are fully applied when discovered again
+    const CFIndex snapshotCount = CFDictionaryGetCount(discoverySnapshots);
+    const void * snapshotKeys[snapshotCount];
+    CFDictionaryGetKeysAndValues(discoverySnapshots,snapshotKeys,NULL);
+    
+    for(CFIndex i = 0; i < snapshotCount; i++)
+        if(!CFDictionaryContainsKey(records,snapshotKeys[i]))
+            CFDictionaryRemoveValue(discoverySnapshots,snapshotKeys[i]);
+    
+    if(locked) {
+        if(changed)
+            iSCSIPreferencesSynchronzeAppValues(preferences);
         
-        CFRelease(discoveryRecords);
+        pthread_mutex_unlock(&preferencesMutex);
     }
+    
+    CFRelease(records);
 }
 
 
-/*! Called on a timer (timer setup by iSCSIDUpdateDiscovery()) to run
- *  discovery operations on a dedicated POSIX thread. */
-void iSCSIDLaunchDiscoveryThread(CFRunLoopTimerRef timer,void * context)
+/*! Starts a discovery thread (discovery or discovery session keepalive).
+ *  Only one such thread runs at a time, since both use the discovery sessions.
+ *  @param routine the thread entry point.
+ *  @return EBUSY if a discovery thread is already running, or an error code
+ *  indicating why the thread could not be started. */
+errno_t iSCSIDStartDiscoveryThread(void * (*routine)(void *))
 {
     pthread_attr_t  attribute;
     pthread_t thread;
     errno_t error = 0;
     
-    if(pthread_mutex_trylock(&discoveryMutex))
-    {
-        error = pthread_attr_init(&attribute);
-        assert(!error);
-        error = pthread_attr_setdetachstate(&attribute,PTHREAD_CREATE_DETACHED);
-        assert(!error);
-        
-        error = pthread_create(&thread,&attribute,&iSCSIDRunDiscovery,NULL);
-        pthread_attr_destroy(&attribute);
+    pthread_mutex_lock(&discoveryMutex);
+    Boolean running = discoveryRunning;
+    discoveryRunning = true;
+    pthread_mutex_unlock(&discoveryMutex);
+    
+    if(running)
+        return EBUSY;
+    
+    error = pthread_attr_init(&attribute);
+    assert(!error);
+    error = pthread_attr_setdetachstate(&attribute,PTHREAD_CREATE_DETACHED);
+    assert(!error);
+    
+    error = pthread_create(&thread,&attribute,routine,NULL);
+    pthread_attr_destroy(&attribute);
+
+    if(error) {
+        pthread_mutex_lock(&discoveryMutex);
+        discoveryRunning = false;
+        pthread_cond_broadcast(&discoveryCond);
+        pthread_mutex_unlock(&discoveryMutex);
     }
-    else {
+    return error;
+}
+
+/*! Called on a timer (timer setup by iSCSIDUpdateDiscovery()) to run
+ *  discovery operations on a dedicated POSIX thread. */
+void iSCSIDLaunchDiscoveryThread(CFRunLoopTimerRef timer,void * context)
+{
+    errno_t error = iSCSIDStartDiscoveryThread(&iSCSIDRunDiscovery);
+    
+    if(error == EBUSY)
         asl_log(NULL,NULL,ASL_LEVEL_CRIT,"discovery is taking longer than the specified"
                 " discovery interval. Consider increasing discovery interval");
-    }
-
-    // Log error if thread could not start
-    if(error)
+    else if(error)
         asl_log(NULL,NULL,ASL_LEVEL_ALERT,"failed to start target discovery");
 }
 
+/*! Called on a timer (timer setup by iSCSIDUpdateDiscovery()) to keep open
+ *  discovery sessions alive. The NOP exchanges block, so they run on a
+ *  discovery thread; skipped while discovery is running, since discovery
+ *  itself exercises the sessions. */
+void iSCSIDDiscoveryKeepalive(CFRunLoopTimerRef timer,void * context)
+{
+    errno_t error = iSCSIDStartDiscoveryThread(&iSCSIDRunDiscoveryKeepalive);
+    
+    if(error && error != EBUSY)
+        asl_log(NULL,NULL,ASL_LEVEL_ALERT,"failed to start discovery session keepalive");
+}
+
 /*! Synchronizes the daemon with the property list. This function may be called
  *  anytime changes are made to the property list (e.g., by an external
  *  application) that require immediate action on the daemon's part. This
@@ -1216,14 +1560,26 @@ errno_t iSCSIDUpdateDiscovery(int fd,
     // Check whether SendTargets discovery is enabled, and get interval (sec)
     Boolean discoveryEnabled = iSCSIPreferencesGetSendTargetsDiscoveryEnable(preferences);
     CFTimeInterval interval = iSCSIPreferencesGetSendTargetsDiscoveryInterval(preferences);
+    Boolean persistent = iSCSIPreferencesGetSendTargetsDiscoveryPersistentSessions(preferences);
     CFRunLoopTimerCallBack callout = &iSCSIDLaunchDiscoveryThread;
 
-    // Remove existing timer if one exists
+    // Remove existing timers if they exist
     if(discoveryTimer) {
         CFRunLoopRemoveTimer(CFRunLoopGetCurrent(),discoveryTimer,kCFRunLoopDefaultMode);
         CFRelease(discoveryTimer);
         discoveryTimer = NULL;
     }
+    
+    if(discoveryKeepaliveTimer) {
+        CFRunLoopRemoveTimer(CFRunLoopGetCurrent(),discoveryKeepaliveTimer,kCFRunLoopDefaultMode);
+        CFRelease(discoveryKeepaliveTimer);
+        discoveryKeepaliveTimer = NULL;
+    }
+    
+    // Close discovery sessions that are no longer used (deferred until
+    // discovery finishes if it is running)
+    if(!discoveryEnabled || !persistent)
+        iSCSIDCloseDiscoverySessions(false);
 
     // Add new timer with updated interval, if discovery is enabled
     if(discoveryEnabled)
@@ -1234,6 +1590,15 @@ errno_t iSCSIDUpdateDiscovery(int fd,
                                               interval,0,0,callout,NULL);
 
         CFRunLoopAddTimer(CFRunLoopGetCurrent(),discoveryTimer,kCFRunLoopDefaultMode);
+        
+        if(persistent) {
+            discoveryKeepaliveTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,
+                                                           CFAbsoluteTimeGetCurrent()+kiSCSIDDiscoveryKeepaliveInterval,
+                                                           kiSCSIDDiscoveryKeepaliveInterval,0,0,
+                                                           &iSCSIDDiscoveryKeepalive,NULL);
+            
+            CFRunLoopAddTimer(CFRunLoopGetCurrent(),discoveryKeepaliveTimer,kCFRunLoopDefaultMode);
+        }
     }
 
     // Send back response
@@ -1309,6 +1674,12 @@ errno_t iSCSIDPreferencesIOUnlockAndSync(int fd,iSCSIDMsgPreferencesIOUnlockAndS
     {
         iSCSIPreferencesSynchronzeAppValues(preferencesToSync);
         iSCSIPreferencesUpdateWithAppValues(preferences);
+        iSCSIDUpdatePDUCaptureForAllSessions();
+        
+        // Dynamic targets may have been edited or removed; forget what
+        // discovery last applied so the next results are applied in full
+        if(discoverySnapshots)
+            CFDictionaryRemoveAllValues(discoverySnapshots);
     }
     
     pthread_mutex_unlock(&preferencesMutex);
@@ -1445,88 +1816,222 @@ errno_t iSCSIDRemoveSharedSecret(int fd,iSCSIDMsgRemoveSharedSecretCmd *cmd)
     return 0;
 }
 
-/*! Callback function used to process a queued login once
- *  the network becomes available. */
-void iSCSIDProcessQueuedLogin(SCNetworkReachabilityRef reachabilityTarget,
-                              SCNetworkReachabilityFlags flags,
-                              void * info)
+/*! Helper function.  Determines whether the portal is reachable using the
+ *  current network configuration (and the host interface of the portal,
+ *  if one was specified). */
+Boolean iSCSIDIsPortalReachable(iSCSIPortalRef portal)
 {
-    struct iSCSIDQueueLoginForTargetPortal * loginRef = info;
+    SCNetworkReachabilityRef reachabilityTarget = NULL;
+    char portalAddressBuffer[NI_MAXHOST];
     
-    iSCSIMutableTargetRef target = iSCSITargetCreateMutableCopy(loginRef->target);
-    iSCSIPortalRef portal = loginRef->portal;
+    if(!CFStringGetCString(iSCSIPortalGetAddress(portal),portalAddressBuffer,NI_MAXHOST,kCFStringEncodingASCII))
+        return false;
     
-    enum iSCSILoginStatusCode statusCode;
-    iSCSIDLoginWithPortal(target,portal,&statusCode);
+    // If a specific host interface was specified, create with pair...
+    if(CFStringCompare(iSCSIPortalGetHostInterface(portal),kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo)
+        reachabilityTarget = SCNetworkReachabilityCreateWithName(kCFAllocatorDefault,portalAddressBuffer);
+    else {
+        
+        struct sockaddr_storage remoteAddress, localAddress;
+        
+        if(iSCSIUtilsGetAddressForPortal(portal,&remoteAddress,&localAddress))
+            return false;
+        
+        reachabilityTarget = SCNetworkReachabilityCreateWithAddressPair(kCFAllocatorDefault,
+                                                                        (const struct sockaddr *)&localAddress,
+                                                                        (const struct sockaddr *)&remoteAddress);
+    }
     
-    iSCSITargetRelease(target);
-    iSCSITargetRelease(loginRef->target);
-    iSCSIPortalRelease(portal);
+    if(!reachabilityTarget)
+        return false;
+    
+    SCNetworkReachabilityFlags reachabilityFlags = 0;
+    SCNetworkReachabilityGetFlags(reachabilityTarget,&reachabilityFlags);
+    CFRelease(reachabilityTarget);
     
-    free(loginRef);
+    return (reachabilityFlags & kSCNetworkReachabilityFlagsReachable) != 0;
 }
 
-/*! Helper function used by auto-login, sleep-mode and persistent
- *  functions to login to the specified target using the specified
- *  portal when the network becomes available. */
-void iSCSIDQueueLogin(iSCSITargetRef target,iSCSIPortalRef portal)
+/*! Helper function.  Inserts a login into the login queue behind logins of
+ *  the same or higher priority. */
+void iSCSIDInsertQueuedLogin(struct iSCSIDQueuedLogin * login)
 {
-    if(!target || !portal)
-        return;
+    struct iSCSIDQueuedLogin ** position = &loginQueue;
     
-    iSCSITargetRetain(target);
-    iSCSIPortalRetain(portal);
-        
-    SCNetworkReachabilityRef reachabilityTarget;
-    SCNetworkReachabilityContext reachabilityContext;
+    while(*position && ((*position)->priority || !login->priority))
+        position = &(*position)->next;
     
-    struct iSCSIDQueueLoginForTargetPortal * loginRef = malloc(sizeof(struct iSCSIDQueueLoginForTargetPortal));
-    loginRef->target = target;
-    loginRef->portal = portal;
+    login->next = *position;
+    *position = login;
+}
+
+/*! Helper function.  Releases a login that was removed from the queue. */
+void iSCSIDReleaseQueuedLogin(struct iSCSIDQueuedLogin * login)
+{
+    iSCSITargetRelease(login->target);
+    iSCSIPortalRelease(login->portal);
+    free(login);
+}
+
+/*! Helper function.  Returns the delay before a failed login is retried.
+ *  The delay grows exponentially with the number of attempts and is
+ *  spread over [delay/2,delay) so that logins that failed together (for
+ *  instance, when a portal went down) are not retried in lockstep. */
+CFTimeInterval iSCSIDGetLoginRetryDelay(unsigned int attempts)
+{
+    CFTimeInterval delay = kiSCSIDLoginRetryDelay;
     
-    reachabilityContext.info = loginRef;
-    reachabilityContext.copyDescription = 0;
-    reachabilityContext.retain = 0;
-    reachabilityContext.release = 0;
+    for(unsigned int attempt = 1; attempt < attempts && delay < kiSCSIDLoginRetryMaxDelay; attempt++)
+        delay *= 2;
     
-    char portalAddressBuffer[NI_MAXHOST];
+    if(delay > kiSCSIDLoginRetryMaxDelay)
+        delay = kiSCSIDLoginRetryMaxDelay;
     
-    if(!CFStringGetCString(iSCSIPortalGetAddress(portal),portalAddressBuffer,NI_MAXHOST,kCFStringEncodingASCII))
-        return;
+    return delay / 2 + (delay / 2) * (arc4random_uniform(1024) / 1024.0);
+}
+
+/*! Helper function.  Determines whether a failed login should be retried.
+ *  Communication errors and target errors (status class 3) are transient;
+ *  other login failures (e.g., authentication) are not retried. */
+Boolean iSCSIDShouldRetryQueuedLogin(struct iSCSIDQueuedLogin * login,
+                                     errno_t error,
+                                     enum iSCSILoginStatusCode statusCode)
+{
+    if(!error && (statusCode == kiSCSILoginSuccess || statusCode == kiSCSILoginInvalidStatusCode))
+        return false;
     
-    // If a specific host interface was specified, create with pair...
-    if(CFStringCompare(iSCSIPortalGetHostInterface(portal),kiSCSIDefaultHostInterface,0) == kCFCompareEqualTo)
-        reachabilityTarget = SCNetworkReachabilityCreateWithName(kCFAllocatorDefault,portalAddressBuffer);
-    else {
+    if(!error && (statusCode >> 8) != 0x03)
+        return false;
+    
+    return login->attempts < kiSCSIDLoginMaxAttempts ||
+           iSCSIPreferencesGetPersistenceForTarget(preferences,iSCSITargetGetIQN(login->target));
+}
 
-        struct sockaddr_storage remoteAddress, localAddress;
-        iSCSIUtilsGetAddressForPortal(portal,&remoteAddress,&localAddress);
+void iSCSIDProcessQueuedLogins(CFRunLoopTimerRef timer,void * context);
+
+/*! Helper function.  Arms the login timer to fire when the next queued login
+ *  is due, or removes the timer if the queue is empty. */
+void iSCSIDScheduleQueuedLogins()
+{
+    if(!loginQueue) {
+        if(loginTimer) {
+            CFRunLoopTimerInvalidate(loginTimer);
+            CFRelease(loginTimer);
+            loginTimer = NULL;
+        }
+        return;
+    }
+    
+    CFAbsoluteTime fireDate = loginQueue->notBefore;
+    
+    for(struct iSCSIDQueuedLogin * login = loginQueue->next; login; login = login->next)
+        if(login->notBefore < fireDate)
+            fireDate = login->notBefore;
+    
+    if(!loginTimer) {
+        loginTimer = CFRunLoopTimerCreate(kCFAllocatorDefault,fireDate,kiSCSIDLoginRetryMaxDelay,0,0,
+                                          &iSCSIDProcessQueuedLogins,NULL);
         
-        reachabilityTarget = SCNetworkReachabilityCreateWithAddressPair(kCFAllocatorDefault,
-                                                                        (const struct sockaddr *)&localAddress,
-                                                                        (const struct sockaddr *)&remoteAddress);
+        CFRunLoopAddTimer(CFRunLoopGetMain(),loginTimer,kCFRunLoopDefaultMode);
     }
+    else
+        CFRunLoopTimerSetNextFireDate(loginTimer,fireDate);
+}
+
+/*! Called on a timer (timer setup by iSCSIDScheduleQueuedLogins()) to
+ *  perform the first queued login that is due.  One login is performed
+ *  each time the timer fires so that client requests are serviced between
+ *  logins; failed logins are queued again to be retried later. */
+void iSCSIDProcessQueuedLogins(CFRunLoopTimerRef timer,void * context)
+{
+    CFAbsoluteTime currentTime = CFAbsoluteTimeGetCurrent();
+    struct iSCSIDQueuedLogin ** position = &loginQueue;
     
-    // If the target is reachable just login; otherwise queue the login ...
-    SCNetworkReachabilityFlags reachabilityFlags;
-    SCNetworkReachabilityGetFlags(reachabilityTarget,&reachabilityFlags);
+    while(*position && (*position)->notBefore > currentTime)
+        position = &(*position)->next;
+    
+    struct iSCSIDQueuedLogin * login = *position;
     
-    if(reachabilityFlags & kSCNetworkReachabilityFlagsReachable) {
-        enum iSCSILoginStatusCode statusCode;
-        iSCSIMutableTargetRef mutableTarget = iSCSITargetCreateMutableCopy(target);
+    if(login) {
+        *position = login->next;
+        login->next = NULL;
+        
+        enum iSCSILoginStatusCode statusCode = kiSCSILoginInvalidStatusCode;
+        errno_t error = 0;
+        
+        // Wait for the network to reach the portal before logging in; this
+        // does not count as an attempt, so that logins are not dropped
+        // while the host is offline
+        if(!iSCSIDIsPortalReachable(login->portal)) {
+            login->notBefore = CFAbsoluteTimeGetCurrent() + kiSCSIDLoginReachabilityInterval;
+            iSCSIDInsertQueuedLogin(login);
+            iSCSIDScheduleQueuedLogins();
+            return;
+        }
+        
+        iSCSIMutableTargetRef target = iSCSITargetCreateMutableCopy(login->target);
+        login->attempts++;
+        error = iSCSIDLoginWithPortal(target,login->portal,&statusCode);
         iSCSITargetRelease(target);
-        iSCSIDLoginWithPortal(mutableTarget,portal,&statusCode);
         
-        iSCSITargetRelease(mutableTarget);
-        iSCSIPortalRelease(portal);
-        CFRelease(reachabilityTarget);
-        free(loginRef);
-    
+        if(iSCSIDShouldRetryQueuedLogin(login,error,statusCode)) {
+            login->notBefore = CFAbsoluteTimeGetCurrent() + iSCSIDGetLoginRetryDelay(login->attempts);
+            iSCSIDInsertQueuedLogin(login);
+        }
+        else
+            iSCSIDReleaseQueuedLogin(login);
     }
-    else {
-        SCNetworkReachabilitySetCallback(reachabilityTarget,iSCSIDProcessQueuedLogin,&reachabilityContext);
-        SCNetworkReachabilityScheduleWithRunLoop(reachabilityTarget,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
+    
+    iSCSIDScheduleQueuedLogins();
+}
+
+/*! Helper function used by auto-login, sleep-mode and persistent
+ *  functions to login to the specified target using the specified
+ *  portal.  The login is queued and performed by the login scheduler
+ *  once the portal is reachable; priority logins are performed first.
+ *  Logins that are already queued are not queued again. */
+void iSCSIDQueueLoginWithPriority(iSCSITargetRef target,iSCSIPortalRef portal,Boolean priority)
+{
+    if(!target || !portal)
+        return;
+    
+    for(struct iSCSIDQueuedLogin * login = loginQueue; login; login = login->next)
+    {
+        if(CFStringCompare(iSCSITargetGetIQN(login->target),iSCSITargetGetIQN(target),0) == kCFCompareEqualTo &&
+           CFStringCompare(iSCSIPortalGetAddress(login->portal),iSCSIPortalGetAddress(portal),0) == kCFCompareEqualTo &&
+           CFStringCompare(iSCSIPortalGetPort(login->portal),iSCSIPortalGetPort(portal),0) == kCFCompareEqualTo &&
+           CFStringCompare(iSCSIPortalGetHostInterface(login->portal),iSCSIPortalGetHostInterface(portal),0) == kCFCompareEqualTo)
+            return;
     }
+    
+    struct iSCSIDQueuedLogin * login = malloc(sizeof(struct iSCSIDQueuedLogin));
+    
+    if(!login)
+        return;
+    
+    iSCSITargetRetain(target);
+    iSCSIPortalRetain(portal);
+    
+    login->target = target;
+    login->portal = portal;
+    login->priority = priority;
+    login->attempts = 0;
+    login->notBefore = CFAbsoluteTimeGetCurrent();
+    login->next = NULL;
+    
+    iSCSIDInsertQueuedLogin(login);
+    iSCSIDScheduleQueuedLogins();
+}
+
+/*! Queues a login to the specified target using the specified portal;
+ *  logins to persistent targets are given priority. */
+void iSCSIDQueueLogin(iSCSITargetRef target,iSCSIPortalRef portal)
+{
+    if(!target || !portal)
+        return;
+    
+    Boolean persistent = iSCSIPreferencesGetPersistenceForTarget(preferences,iSCSITargetGetIQN(target));
+    iSCSIDQueueLoginWithPriority(target,portal,persistent);
 }
 
 void iSCSIDSessionTimeoutHandler(iSCSITargetRef target,iSCSIPortalRef portal)
@@ -1573,8 +2078,10 @@ void iSCSIDAutoLogin()
             
             CFArrayRef portals = NULL;
             
-            if(!(portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN)))
+            if(!(portals = iSCSIPreferencesCreateArrayOfPortalsForTarget(preferences,targetIQN))) {
+                iSCSITargetRelease(target);
                 continue;
+            }
             
             CFIndex portalsCount = CFArrayGetCount(portals);
             
@@ -1617,17 +2124,17 @@ void iSCSIDRestoreFromSystemSleep()
         CFArrayRef portalArray = portalArrays[idx];
         CFIndex portalCount = CFArrayGetCount(portalArray);
         
+        iSCSIMutableTargetRef target = iSCSITargetCreateMutable();
+        iSCSITargetSetIQN(target,targetIQN);
+        
+        // Targets that were active are restored ahead of other queued logins
         for(CFIndex portalIdx = 0; portalIdx < portalCount; portalIdx++)
         {
-            enum iSCSILoginStatusCode statusCode;
             iSCSIPortalRef portal = CFArrayGetValueAtIndex(portalArray,portalIdx);
-            
-            iSCSIMutableTargetRef target = iSCSITargetCreateMutable();
-            iSCSITargetSetIQN(target,targetIQN);
-            
-            iSCSIDLoginWithPortal(target,portal,&statusCode);
-            iSCSITargetRelease(target);
+            iSCSIDQueueLoginWithPriority(target,portal,true);
         }
+        
+        iSCSITargetRelease(target);
     }
     
     CFRelease(activeTargets);
@@ -1648,6 +2155,9 @@ void iSCSIDPrepareForSystemSleepComplete(iSCSITargetRef target,
  *  is used to restore active sessions upon wakeup. */
 void iSCSIDPrepareForSystemSleep()
 {
+    // Discovery sessions are not restored; discovery re-opens them as needed
+    iSCSIDCloseDiscoverySessions(false);
+    
     CFArrayRef sessionIds = iSCSISessionCopyArrayOfSessionIds(sessionManager);
     
     if(!sessionIds)
@@ -1676,6 +2186,14 @@ void iSCSIDPrepareForSystemSleep()
             continue;
     
         CFStringRef targetIQN = iSCSITargetGetIQN(target);
+        
+        // Skip discovery sessions (no target name) that are still open
+        // because discovery is running; they are closed when it finishes
+        if(CFStringCompare(targetIQN,kiSCSIUnspecifiedTargetIQN,0) == kCFCompareEqualTo) {
+            iSCSITargetRelease(target);
+            continue;
+        }
+        
         CFArrayRef connectionIds = iSCSISessionCopyArrayOfConnectionIds(sessionManager,sessionId);
         CFIndex connectionCount = CFArrayGetCount(connectionIds);
         
@@ -1889,7 +2407,7 @@ int main(void)
     CFStringRef initiatorAlias = iSCSIPreferencesCopyInitiatorAlias(preferences);
 
     if(initiatorAlias) {
-        iSCSISessionManagerSetInitiatorName(sessionManager,initiatorAlias);
+        iSCSISessionManagerSetInitiatorAlias(sessionManager,initiatorAlias);
         CFRelease(initiatorAlias);
     }
     else {
@@ -1994,6 +2512,9 @@ int main(void)
     
     CFRunLoopRun();
     
+    // Wait for discovery to finish before the session manager is released
+    iSCSIDCloseDiscoverySessions(true);
+    
     iSCSISessionManagerUnscheduleWithRunloop(sessionManager,CFRunLoopGetMain(),kCFRunLoopDefaultMode);
     iSCSISessionManagerRelease(sessionManager);
     sessionManager = NULL;
@@ -27,15 +27,322 @@
  */
 
 #include "iSCSIDiscovery.h"
+#include "iSCSIQueryTarget.h"
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+/*! Time (in milliseconds) a discovery portal is given to accept a TCP
+ *  connection before it is skipped during SendTargets discovery.  This
+ *  matches the connection timeout used by the kernel for logins. */
+static const int kiSCSIDiscoveryProbeTimeoutMilliSec = 1000;
+
+/*! Helper function.  Probes discovery portals concurrently by starting a
+ *  non-blocking TCP connection to each portal and waiting (up to a common
+ *  deadline) for the connections to complete.  Discovery logins are
+ *  performed one at a time by the kernel, so probing first ensures that
+ *  portals that are down do not each delay discovery of the others by a
+ *  connection timeout.  Portals that could not be probed are assumed to
+ *  be reachable (the discovery login determines the outcome).
+ *  @param portals the portals to probe.
+ *  @param portalCount the number of portals.
+ *  @param reachable set for each portal that accepted a connection. */
+static void iSCSIDiscoveryProbePortals(iSCSIPortalRef portals[],
+                                       CFIndex portalCount,
+                                       Boolean reachable[])
+{
+    struct pollfd probes[portalCount];
+    
+    for(CFIndex idx = 0; idx < portalCount; idx++)
+    {
+        probes[idx].fd = -1;
+        probes[idx].events = POLLOUT;
+        probes[idx].revents = 0;
+        reachable[idx] = true;
+        
+        struct sockaddr_storage ssTarget, ssHost;
+        
+        if(!portals[idx] || iSCSIUtilsGetAddressForPortal(portals[idx],&ssTarget,&ssHost))
+            continue;
+        
+        int fd = socket(ssTarget.ss_family,SOCK_STREAM,IPPROTO_TCP);
+        
+        if(fd < 0)
+            continue;
+        
+        // Bind to the host interface of the portal, if one was specified
+        Boolean bound = true;
+        
+        if(CFStringCompare(iSCSIPortalGetHostInterface(portals[idx]),kiSCSIDefaultHostInterface,0) != kCFCompareEqualTo)
+            bound = (bind(fd,(struct sockaddr *)&ssHost,ssHost.ss_len) == 0);
+        
+        if(!bound || fcntl(fd,F_SETFL,fcntl(fd,F_GETFL,0) | O_NONBLOCK) < 0) {
+            close(fd);
+            continue;
+        }
+        
+        if(connect(fd,(struct sockaddr *)&ssTarget,ssTarget.ss_len) == 0)
+            close(fd);
+        
+        // The connection is in progress; wait for it below
+        else if(errno == EINPROGRESS)
+            probes[idx].fd = fd;
+        
+        // The connection was refused or the host cannot be reached
+        else {
+            reachable[idx] = false;
+            close(fd);
+        }
+    }
+    
+    CFAbsoluteTime deadline = CFAbsoluteTimeGetCurrent() + kiSCSIDiscoveryProbeTimeoutMilliSec / 1000.0;
+    CFIndex pending = 0;
+    
+    for(CFIndex idx = 0; idx < portalCount; idx++)
+        if(probes[idx].fd >= 0)
+            pending++;
+    
+    while(pending > 0)
+    {
+        int timeout = (int)((deadline - CFAbsoluteTimeGetCurrent()) * 1000);
+        
+        if(timeout <= 0)
+            break;
+        
+        // Wait again for the remainder of the timeout if interrupted
+        int result = poll(probes,(nfds_t)portalCount,timeout);
+        
+        if(result < 0 && errno == EINTR)
+            continue;
+        
+        if(result <= 0)
+            break;
+        
+        for(CFIndex idx = 0; idx < portalCount; idx++)
+        {
+            if(probes[idx].fd < 0 || !probes[idx].revents)
+                continue;
+            
+            int error = 0;
+            socklen_t errorLength = sizeof(error);
+            getsockopt(probes[idx].fd,SOL_SOCKET,SO_ERROR,&error,&errorLength);
+            
+            reachable[idx] = (error == 0);
+            close(probes[idx].fd);
+            
+            // Negative descriptors are ignored by poll()
+            probes[idx].fd = -1;
+            pending--;
+        }
+    }
+    
+    // Connections that did not complete before the deadline
+    for(CFIndex idx = 0; idx < portalCount; idx++)
+    {
+        if(probes[idx].fd >= 0) {
+            reachable[idx] = false;
+            close(probes[idx].fd);
+        }
+    }
+}
+
+/*! A discovery session that is kept open between discovery intervals. */
+struct iSCSIDiscoverySession {
+    
+    /*! The discovery portal name (address), or NULL if the entry is unused. */
+    CFStringRef discoveryPortal;
+    
+    /*! The discovery portal the session was opened with. */
+    iSCSIPortalRef portal;
+    
+    /*! The session identifier. */
+    SessionIdentifier sessionId;
+    
+    /*! The connection identifier. */
+    ConnectionIdentifier connectionId;
+};
+
+/*! Maximum number of discovery sessions kept open between intervals, out of
+ *  the kiSCSIMaxSessions sessions supported by the kernel; other portals are
+ *  queried using a session per query. */
+#define kiSCSIDiscoveryMaxSessions 4
+
+/*! Discovery sessions kept open when persistent discovery sessions are
+ *  enabled; accessed only while discovery is not running concurrently. */
+static struct iSCSIDiscoverySession discoverySessions[kiSCSIDiscoveryMaxSessions];
+
+/*! Helper function.  Gets the open discovery session for a discovery portal.
+ *  @param discoveryPortal the discovery portal name (address).
+ *  @return the discovery session, or NULL if none is open. */
+static struct iSCSIDiscoverySession * iSCSIDiscoveryGetSession(CFStringRef discoveryPortal)
+{
+    for(CFIndex idx = 0; idx < kiSCSIDiscoveryMaxSessions; idx++)
+    {
+        if(discoverySessions[idx].discoveryPortal &&
+           CFStringCompare(discoverySessions[idx].discoveryPortal,discoveryPortal,0) == kCFCompareEqualTo)
+            return &discoverySessions[idx];
+    }
+    return NULL;
+}
+
+/*! Helper function.  Logs out of a discovery session and frees its entry.
+ *  @param managerRef the session manager.
+ *  @param session the discovery session to close. */
+static void iSCSIDiscoveryCloseSession(iSCSISessionManagerRef managerRef,
+                                       struct iSCSIDiscoverySession * session)
+{
+    enum iSCSILogoutStatusCode statusCode;
+    iSCSISessionLogout(managerRef,session->sessionId,&statusCode);
+    
+    CFRelease(session->discoveryPortal);
+    iSCSIPortalRelease(session->portal);
+    
+    session->discoveryPortal = NULL;
+    session->portal = NULL;
+}
+
+/*! Helper function.  Closes open discovery sessions whose discovery portal
+ *  is no longer defined.
+ *  @param managerRef the session manager.
+ *  @param portals the discovery portal names (addresses) that are defined;
+ *  if NULL, all discovery sessions are closed. */
+static void iSCSIDiscoveryCloseStaleSessions(iSCSISessionManagerRef managerRef,
+                                             CFArrayRef portals)
+{
+    for(CFIndex idx = 0; idx < kiSCSIDiscoveryMaxSessions; idx++)
+    {
+        CFStringRef discoveryPortal = discoverySessions[idx].discoveryPortal;
+        
+        if(!discoveryPortal)
+            continue;
+        
+        if(portals && CFArrayContainsValue(portals,CFRangeMake(0,CFArrayGetCount(portals)),discoveryPortal))
+            continue;
+        
+        iSCSIDiscoveryCloseSession(managerRef,&discoverySessions[idx]);
+    }
+}
+
+/*! Helper function.  Queries a discovery portal for targets using the
+ *  discovery session kept open for the portal.  A session is opened if none
+ *  is open, and re-opened (once) if the open session fails or if the portal
+ *  settings have changed; the session is left open for the next interval.
+ *  @param managerRef the session manager.
+ *  @param discoveryPortal the discovery portal name (address).
+ *  @param portal the discovery portal.
+ *  @param auth specifies the authentication parameters to use.
+ *  @param discoveryRec a discovery record, containing the query results.
+ *  @param statusCode iSCSI response code indicating operation status.
+ *  @return an error code indicating whether the operation was successful. */
+static errno_t iSCSIDiscoveryQueryPersistentSession(iSCSISessionManagerRef managerRef,
+                                                    CFStringRef discoveryPortal,
+                                                    iSCSIPortalRef portal,
+                                                    iSCSIAuthRef auth,
+                                                    iSCSIMutableDiscoveryRecRef * discoveryRec,
+                                                    enum iSCSILoginStatusCode * statusCode)
+{
+    struct iSCSIDiscoverySession * session = iSCSIDiscoveryGetSession(discoveryPortal);
+    errno_t error = 0;
+    
+    if(session && !CFEqual(session->portal,portal)) {
+        iSCSIDiscoveryCloseSession(managerRef,session);
+        session = NULL;
+    }
+    
+    // Re-query the open session; reconnect only if that fails
+    if(session) {
+        if(!(error = iSCSIQueryDiscoverySessionForTargets(managerRef,session->sessionId,
+                                                          session->connectionId,portal,discoveryRec)))
+        {
+            *statusCode = kiSCSILoginSuccess;
+            return 0;
+        }
+        
+        asl_log(NULL,NULL,ASL_LEVEL_INFO,"discovery session failed (code %d); reconnecting.",error);
+        iSCSIDiscoveryCloseSession(managerRef,session);
+    }
+    
+    // Fall back to a session per query if no entry is available
+    for(CFIndex idx = 0; idx < kiSCSIDiscoveryMaxSessions && !session; idx++)
+        if(!discoverySessions[idx].discoveryPortal)
+            session = &discoverySessions[idx];
+    
+    if(!session)
+        return iSCSIQueryPortalForTargets(managerRef,portal,auth,discoveryRec,statusCode);
+    
+    SessionIdentifier sessionId;
+    ConnectionIdentifier connectionId;
+    
+    if((error = iSCSISessionLoginForDiscovery(managerRef,portal,auth,&sessionId,&connectionId,statusCode)) ||
+       *statusCode != kiSCSILoginSuccess)
+        return error;
+    
+    session->discoveryPortal = CFStringCreateCopy(kCFAllocatorDefault,discoveryPortal);
+    session->portal = portal;
+    iSCSIPortalRetain(portal);
+    session->sessionId = sessionId;
+    session->connectionId = connectionId;
+    
+    if((error = iSCSIQueryDiscoverySessionForTargets(managerRef,sessionId,connectionId,portal,discoveryRec)))
+        iSCSIDiscoveryCloseSession(managerRef,session);
+    
+    return error;
+}
+
+/*! Sends a NOP to each open discovery session so that idle sessions are
+ *  kept alive between discovery intervals.  Sessions that fail are closed
+ *  and re-opened by the next discovery operation.
+ *  @param managerRef the session manager. */
+void iSCSIDiscoveryKeepaliveSessions(iSCSISessionManagerRef managerRef)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    
+    for(CFIndex idx = 0; idx < kiSCSIDiscoveryMaxSessions; idx++)
+    {
+        struct iSCSIDiscoverySession * session = &discoverySessions[idx];
+        
+        if(!session->discoveryPortal)
+            continue;
+        
+        if(iSCSISessionNOPExchange(hbaInterface,session->sessionId,session->connectionId))
+            iSCSIDiscoveryCloseSession(managerRef,session);
+    }
+}
+
+/*! Closes all discovery sessions that are kept open between intervals.
+ *  @param managerRef the session manager. */
+void iSCSIDiscoveryCloseSessions(iSCSISessionManagerRef managerRef)
+{
+    iSCSIDiscoveryCloseStaleSessions(managerRef,NULL);
+}
+
+/*! Adds or updates the portals of a dynamic (SendTargets) target.
+ *  @param preferences an iSCSI preferences object.
+ *  @param targetIQN the target iSCSI qualified name (IQN).
+ *  @param discoveryRec the discovery record containing the target.
+ *  @param previousRec the discovery record produced by the previous discovery
+ *  of the same portal, or NULL. Portals of the target that are no longer
+ *  reported are removed.
+ *  @param discoveryPortal the portal (address) that was used to perform discovery.
+ *  @param changed set to true if the preferences were modified.
+ *  @return an error code indicating the result of the operation. */
 errno_t iSCSIDiscoveryAddTargetForSendTargets(iSCSIPreferencesRef preferences,
                                               CFStringRef targetIQN,
                                               iSCSIDiscoveryRecRef discoveryRec,
-                                              CFStringRef discoveryPortal)
+                                              iSCSIDiscoveryRecRef previousRec,
+                                              CFStringRef discoveryPortal,
+                                              Boolean * changed)
 {
     CFArrayRef portalGroups = iSCSIDiscoveryRecCreateArrayOfPortalGroupTags(discoveryRec,targetIQN);
     CFIndex portalGroupCount = CFArrayGetCount(portalGroups);
 
+    // Addresses of all portals reported for this target
+    CFMutableSetRef portalAddresses = CFSetCreateMutable(kCFAllocatorDefault,0,&kCFTypeSetCallBacks);
+
     // Iterate over portal groups for this target
     for(CFIndex portalGroupIdx = 0; portalGroupIdx < portalGroupCount; portalGroupIdx++)
     {
@@ -51,35 +358,98 @@ errno_t iSCSIDiscoveryAddTargetForSendTargets(iSCSIPreferencesRef preferences,
             if(!(portal = CFArrayGetValueAtIndex(portals,portalIdx)))
                continue;
 
+            CFStringRef portalAddress = iSCSIPortalGetAddress(portal);
+            CFSetAddValue(portalAddresses,portalAddress);
+
             // Add portal to target, or add target as necessary
-            if(iSCSIPreferencesContainsTarget(preferences,targetIQN))
-                iSCSIPreferencesSetPortalForTarget(preferences,targetIQN,portal);
-            else
+            if(iSCSIPreferencesContainsTarget(preferences,targetIQN)) {
+
+                // Leave portals that are already up to date untouched
+                iSCSIPortalRef existingPortal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
+                Boolean portalChanged = !existingPortal || !CFEqual(existingPortal,portal);
+
+                if(existingPortal)
+                    iSCSIPortalRelease(existingPortal);
+
+                if(portalChanged) {
+                    iSCSIPreferencesSetPortalForTarget(preferences,targetIQN,portal);
+                    *changed = true;
+                }
+            }
+            else {
                 iSCSIPreferencesAddDynamicTargetForSendTargets(preferences,targetIQN,portal,discoveryPortal);
+                *changed = true;
+            }
         }
     }
-    
+
     CFRelease(portalGroups);
 
+    // Remove portals that were reported by the previous discovery only
+    CFArrayRef previousPortalGroups = NULL;
+
+    if(previousRec)
+        previousPortalGroups = iSCSIDiscoveryRecCreateArrayOfPortalGroupTags(previousRec,targetIQN);
+
+    if(previousPortalGroups) {
+        portalGroupCount = CFArrayGetCount(previousPortalGroups);
+
+        for(CFIndex portalGroupIdx = 0; portalGroupIdx < portalGroupCount; portalGroupIdx++)
+        {
+            CFStringRef portalGroupTag = CFArrayGetValueAtIndex(previousPortalGroups,portalGroupIdx);
+            CFArrayRef portals = iSCSIDiscoveryRecGetPortals(previousRec,targetIQN,portalGroupTag);
+            CFIndex portalsCount = CFArrayGetCount(portals);
+
+            for(CFIndex portalIdx = 0; portalIdx < portalsCount; portalIdx++)
+            {
+                iSCSIPortalRef portal = CFArrayGetValueAtIndex(portals,portalIdx);
+                CFStringRef portalAddress = portal ? iSCSIPortalGetAddress(portal) : NULL;
+
+                if(!portalAddress || CFSetContainsValue(portalAddresses,portalAddress))
+                    continue;
+
+                iSCSIPortalRef existingPortal = iSCSIPreferencesCopyPortalForTarget(preferences,targetIQN,portalAddress);
+
+                if(existingPortal) {
+                    iSCSIPreferencesRemovePortalForTarget(preferences,targetIQN,portalAddress);
+                    iSCSIPortalRelease(existingPortal);
+                    *changed = true;
+                }
+            }
+        }
+        CFRelease(previousPortalGroups);
+    }
+
+    CFRelease(portalAddresses);
+
     return 0;
 }
 
 /*! Updates an iSCSI preference sobject with information about targets as
- *  contained in the provided discovery record.
+ *  contained in the provided discovery record.  When the record of the
+ *  previous discovery of the same portal is provided, targets whose portal
+ *  groups are unchanged are not touched.
  *  @param preferences an iSCSI preferences object.
  *  @param discoveryPortal the portal (address) that was used to perform discovery.
  *  @param discoveryRec the discovery record resulting from the discovery operation.
+ *  @param previousRec the discovery record resulting from the previous
+ *  discovery operation of the same portal, or NULL.
+ *  @param changed set to true if the preferences were modified.
  *  @return an error code indicating the result of the operation. */
 errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManagerRef managerRef,
                                                              iSCSIPreferencesRef preferences,
                                                              CFStringRef discoveryPortal,
-                                                             iSCSIDiscoveryRecRef discoveryRec)
+                                                             iSCSIDiscoveryRecRef discoveryRec,
+                                                             iSCSIDiscoveryRecRef previousRec,
+                                                             Boolean * changed)
 {
     CFArrayRef targets = iSCSIDiscoveryRecCreateArrayOfTargets(discoveryRec);
     
     if(!targets)
         return EINVAL;
     
+    *changed = false;
+    
     CFIndex targetCount = CFArrayGetCount(targets);
 
     CFMutableDictionaryRef discTargets = CFDictionaryCreateMutable(
@@ -89,6 +459,16 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
     {
         CFStringRef targetIQN = CFArrayGetValueAtIndex(targets,targetIdx);
 
+        // As we process each target we'll add it to a temporary dictionary
+        // for cross-checking against targets that exist in our database
+        // which have been removed.
+        CFDictionaryAddValue(discTargets,targetIQN,0);
+        
+        // Target was reported with the same portals by the previous discovery
+        if(previousRec && iSCSIPreferencesContainsTarget(preferences,targetIQN) &&
+           iSCSIDiscoveryRecTargetIsEqual(discoveryRec,previousRec,targetIQN))
+            continue;
+
         // Target exists with static (or other configuration).  In
         // this case we do nothing, log a message and move on.
         if(iSCSIPreferencesContainsTarget(preferences,targetIQN) &&
@@ -110,7 +490,14 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
         // Target doesn't exist, or target exists with SendTargets
         // configuration (add or update as necessary)
         else {
-            iSCSIDiscoveryAddTargetForSendTargets(preferences,targetIQN,discoveryRec,discoveryPortal);
+            Boolean targetChanged = false;
+            iSCSIDiscoveryAddTargetForSendTargets(preferences,targetIQN,discoveryRec,previousRec,discoveryPortal,&targetChanged);
+            
+            if(!targetChanged)
+                continue;
+            
+            *changed = true;
+            
             CFStringRef statusString = CFStringCreateWithFormat(
                 kCFAllocatorDefault,0,
                 CFSTR("discovered target %@ over discovery portal %@."),
@@ -124,11 +511,6 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
             
             CFRelease(statusString);
         }
-
-        // As we process each target we'll add it to a temporary dictionary
-        // for cross-checking against targets that exist in our database
-        // which have been removed.
-        CFDictionaryAddValue(discTargets,targetIQN,0);
     }
 
     // Are there any targets that must be removed?  Cross-check existing
@@ -151,6 +533,7 @@ errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManager
                 iSCSISessionLogout(managerRef,sessionId,&statusCode);
 
             iSCSIPreferencesRemoveTarget(preferences,targetIQN);
+            *changed = true;
         }
     }
 
@@ -183,24 +566,69 @@ CFDictionaryRef iSCSIDiscoveryCreateRecordsWithSendTargets(iSCSISessionManagerRe
     
     CFIndex portalCount = CFArrayGetCount(portals);
 
+    // Discovery sessions may be kept open between intervals; close those
+    // of portals that were removed (or all of them, if disabled)
+    Boolean persistent = iSCSIPreferencesGetSendTargetsDiscoveryPersistentSessions(preferences);
+    iSCSIDiscoveryCloseStaleSessions(managerRef,persistent ? portals : NULL);
+
     CFStringRef discoveryPortal = NULL;
     iSCSIPortalRef portal = NULL;
 
     CFMutableDictionaryRef discoveryRecords = CFDictionaryCreateMutable(kCFAllocatorDefault,0,
                                                                         &kiSCSITypeDictionaryKeyCallbacks,
                                                                         &kiSCSITypeDictionaryValueCallbacks);
+    
+    if(portalCount == 0) {
+        CFRelease(portals);
+        return discoveryRecords;
+    }
+    
+    iSCSIPortalRef discoveryPortals[portalCount];
+    iSCSIPortalRef probePortals[portalCount];
+    Boolean reachable[portalCount];
+    
+    for(CFIndex idx = 0; idx < portalCount; idx++)
+    {
+        discoveryPortal = CFArrayGetValueAtIndex(portals,idx);
+        discoveryPortals[idx] = NULL;
+        
+        if(discoveryPortal)
+            discoveryPortals[idx] = iSCSIPreferencesCopySendTargetsDiscoveryPortal(preferences,discoveryPortal);
+        
+        // Portals with an open discovery session need not be probed
+        probePortals[idx] = discoveryPortals[idx];
+        
+        if(discoveryPortal && iSCSIDiscoveryGetSession(discoveryPortal))
+            probePortals[idx] = NULL;
+    }
+    
+    // Skip portals that do not accept connections (see iSCSIDiscoveryProbePortals)
+    iSCSIDiscoveryProbePortals(probePortals,portalCount,reachable);
 
     for(CFIndex idx = 0; idx < portalCount; idx++)
     {
         discoveryPortal = CFArrayGetValueAtIndex(portals,idx);
+        portal = discoveryPortals[idx];
         
-        if(!discoveryPortal)
+        if(!discoveryPortal || !portal)
             continue;
         
-        portal = iSCSIPreferencesCopySendTargetsDiscoveryPortal(preferences,discoveryPortal);
-        
-        if(!portal)
+        if(!reachable[idx]) {
+            CFStringRef errorString = CFStringCreateWithFormat(
+                kCFAllocatorDefault,0,
+                CFSTR("discovery portal %@ is unreachable; skipping SendTargets discovery."),
+                discoveryPortal);
+            
+            CFIndex errorStringLength = CFStringGetMaximumSizeForEncoding(CFStringGetLength(errorString),kCFStringEncodingASCII) + sizeof('\0');
+            char errorStringBuffer[errorStringLength];
+            CFStringGetCString(errorString,errorStringBuffer,errorStringLength,kCFStringEncodingASCII);
+            
+            asl_log(NULL, NULL, ASL_LEVEL_ERR, "%s", errorStringBuffer);
+            
+            CFRelease(errorString);
+            iSCSIPortalRelease(portal);
             continue;
+        }
         
         enum iSCSILoginStatusCode statusCode;
         iSCSIMutableDiscoveryRecRef discoveryRec;
@@ -208,7 +636,13 @@ CFDictionaryRef iSCSIDiscoveryCreateRecordsWithSendTargets(iSCSISessionManagerRe
         // If there was an error, log it and move on to the next portal
         errno_t error = 0;
         iSCSIAuthRef auth = iSCSIAuthCreateNone();
-        if((error = iSCSIQueryPortalForTargets(managerRef,portal,auth,&discoveryRec,&statusCode)))
+        
+        if(persistent)
+            error = iSCSIDiscoveryQueryPersistentSession(managerRef,discoveryPortal,portal,auth,&discoveryRec,&statusCode);
+        else
+            error = iSCSIQueryPortalForTargets(managerRef,portal,auth,&discoveryRec,&statusCode);
+        
+        if(error)
         {
             CFStringRef errorString = CFStringCreateWithFormat(
                 kCFAllocatorDefault,0,
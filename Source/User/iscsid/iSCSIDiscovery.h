@@ -49,14 +49,34 @@ CFDictionaryRef iSCSIDiscoveryCreateRecordsWithSendTargets(iSCSISessionManagerRe
                                                            iSCSIPreferencesRef preferences);
 
 /*! Updates an iSCSI preference sobject with information about targets as
- *  contained in the provided discovery record.
+ *  contained in the provided discovery record.  When the record of the
+ *  previous discovery of the same portal is provided, targets whose portal
+ *  groups are unchanged are not touched.
  *  @param preferences an iSCSI preferences object.
  *  @param discoveryPortal the portal (address) that was used to perform discovery.
  *  @param discoveryRec the discovery record resulting from the discovery operation.
+ *  @param previousRec the discovery record resulting from the previous
+ *  discovery operation of the same portal, or NULL.
+ *  @param changed set to true if the preferences were modified.
  *  @return an error code indicating the result of the operation. */
 errno_t iSCSIDiscoveryUpdatePreferencesWithDiscoveredTargets(iSCSISessionManagerRef managerRef,
                                                              iSCSIPreferencesRef preferences,
                                                              CFStringRef discoveryPortal,
-                                                             iSCSIDiscoveryRecRef discoveryRec);
+                                                             iSCSIDiscoveryRecRef discoveryRec,
+                                                             iSCSIDiscoveryRecRef previousRec,
+                                                             Boolean * changed);
+
+/*! Sends a NOP to each discovery session that is kept open between
+ *  discovery intervals (see iSCSIPreferencesSetSendTargetsDiscoveryPersistentSessions),
+ *  so that idle sessions stay alive.  Sessions that fail are closed and
+ *  re-opened by the next discovery operation.  Must not be called while
+ *  discovery is running.
+ *  @param managerRef the session manager. */
+void iSCSIDiscoveryKeepaliveSessions(iSCSISessionManagerRef managerRef);
+
+/*! Closes all discovery sessions that are kept open between discovery
+ *  intervals.  Must not be called while discovery is running.
+ *  @param managerRef the session manager. */
+void iSCSIDiscoveryCloseSessions(iSCSISessionManagerRef managerRef);
 
 #endif /* defined(__ISCSI_DISCOVERY_H__) */
@@ -220,6 +220,8 @@ void iSCSIHBAInterfaceRelease(iSCSIHBAInterfaceRef interface)
  *  @param portalSockaddr the BSD socket structure used to identify the target.
  *  @param hostSockaddr the BSD socket structure used to identify the host. This
  *  specifies the interface that the connection will be bound to.
+ *  @param socketBufferSize the socket buffer size to use (applied before
+ *  the connection is established), or 0 to size the buffers automatically.
  *  @param sessionId the session identifier for the new session (returned).
  *  @param connectionId the identifier of the new connection (returned).
  *  @return An error code if a valid session could not be created. */
@@ -230,6 +232,7 @@ IOReturn iSCSIHBAInterfaceCreateSession(iSCSIHBAInterfaceRef interface,
                                         CFStringRef hostInterface,
                                         const struct sockaddr_storage * remoteAddress,
                                         const struct sockaddr_storage * localAddress,
+                                        UInt32 socketBufferSize,
                                         SessionIdentifier * sessionId,
                                         ConnectionIdentifier * connectionId)
 {
@@ -239,7 +242,7 @@ IOReturn iSCSIHBAInterfaceCreateSession(iSCSIHBAInterfaceRef interface,
         return kIOReturnBadArgument;
     
     // Pack the input parameters into a single buffer to send to the kernel
-    const int kNumParams = 6;
+    const int kNumParams = 7;
     void * params[kNumParams];
     size_t paramSize[kNumParams];
     
@@ -251,6 +254,7 @@ IOReturn iSCSIHBAInterfaceCreateSession(iSCSIHBAInterfaceRef interface,
     paramSize[3] = CFStringGetLength(hostInterface) + 1;
     paramSize[4] = sizeof(struct sockaddr_storage);
     paramSize[5] = sizeof(struct sockaddr_storage);
+    paramSize[6] = sizeof(socketBufferSize);
     
     // Populate parameters
     params[0] = malloc(paramSize[0]);
@@ -259,6 +263,7 @@ IOReturn iSCSIHBAInterfaceCreateSession(iSCSIHBAInterfaceRef interface,
     params[3] = malloc(paramSize[3]);
     params[4] = (void*)remoteAddress;
     params[5] = (void*)localAddress;
+    params[6] = &socketBufferSize;
     
     CFStringGetCString(targetIQN,params[0],paramSize[0],kCFStringEncodingASCII);
     CFStringGetCString(portalAddress,params[1],paramSize[1],kCFStringEncodingASCII);
@@ -406,6 +411,8 @@ IOReturn iSCSIHBAInterfaceGetSessionParameter(iSCSIHBAInterfaceRef interface,
  *  @param portalSockaddr the BSD socket structure used to identify the target.
  *  @param hostSockaddr the BSD socket structure used to identify the host. This
  *  specifies the interface that the connection will be bound to.
+ *  @param socketBufferSize the socket buffer size to use (applied before
+ *  the connection is established), or 0 to size the buffers automatically.
  *  @param connectionId the identifier of the new connection.
  *  @return error code indicating result of operation. */
 IOReturn iSCSIHBAInterfaceCreateConnection(iSCSIHBAInterfaceRef interface,
@@ -415,6 +422,7 @@ IOReturn iSCSIHBAInterfaceCreateConnection(iSCSIHBAInterfaceRef interface,
                                            CFStringRef hostInterface,
                                            const struct sockaddr_storage * remoteAddress,
                                            const struct sockaddr_storage * localAddress,
+                                           UInt32 socketBufferSize,
                                            ConnectionIdentifier * connectionId)
 {
     // Check parameters
@@ -422,7 +430,7 @@ IOReturn iSCSIHBAInterfaceCreateConnection(iSCSIHBAInterfaceRef interface,
         return kIOReturnBadArgument;
     
     // Pack the input parameters into a single buffer to send to the kernel
-    const int kNumParams = 5;
+    const int kNumParams = 6;
 
     void * params[kNumParams];
     size_t paramSize[kNumParams];
@@ -434,12 +442,14 @@ IOReturn iSCSIHBAInterfaceCreateConnection(iSCSIHBAInterfaceRef interface,
     paramSize[2] = CFStringGetLength(hostInterface) + 1;
     paramSize[3] = sizeof(struct sockaddr_storage);
     paramSize[4] = sizeof(struct sockaddr_storage);
+    paramSize[5] = sizeof(socketBufferSize);
     
     params[0] = malloc(paramSize[0]);
     params[1] = malloc(paramSize[1]);
     params[2] = malloc(paramSize[2]);
     params[3] = (void*)remoteAddress;
     params[4] = (void*)localAddress;
+    params[5] = &socketBufferSize;
     
     CFStringGetCString(portalAddress,params[0],paramSize[0],kCFStringEncodingASCII);
     CFStringGetCString(portalPort,params[1],paramSize[1],kCFStringEncodingASCII);
@@ -1066,3 +1076,41 @@ CFStringRef iSCSIHBAInterfaceCreateHostInterfaceForConnectionId(iSCSIHBAInterfac
     
     return CFStringCreateWithCString(kCFAllocatorDefault,hostInterface,kCFStringEncodingASCII);
 }
+
+/*! Retrieves the PDUs that were captured for a session since the last call.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier.
+ *  @param records buffer that receives the capture records.
+ *  @param recordCount on input, the number of records the buffer can hold;
+ *  on output, the number of records that were retrieved.
+ *  @param lostRecords the number of records that were overwritten in the
+ *  kernel before they could be retrieved.
+ *  @return error code indicating result of operation. */
+IOReturn iSCSIHBAInterfaceReadPDUCaptureRecords(iSCSIHBAInterfaceRef interface,
+                                                SessionIdentifier sessionId,
+                                                iSCSIPDUCaptureRecord * records,
+                                                UInt32 * recordCount,
+                                                UInt32 * lostRecords)
+{
+    if(!interface || sessionId == kiSCSIInvalidSessionId || !records || !recordCount || !lostRecords)
+        return kIOReturnBadArgument;
+    
+    const UInt32 inputCnt = 1;
+    UInt64 input = sessionId;
+    
+    UInt32 outputCnt = 1;
+    UInt64 output;
+    
+    size_t recordsSize = *recordCount*sizeof(iSCSIPDUCaptureRecord);
+    
+    IOReturn result = IOConnectCallMethod(interface->connect,kiSCSIReadPDUCaptureRecords,
+                                          &input,inputCnt,0,0,&output,&outputCnt,
+                                          records,&recordsSize);
+    if(result == kIOReturnSuccess) {
+        *recordCount = (UInt32)(recordsSize/sizeof(iSCSIPDUCaptureRecord));
+        *lostRecords = (UInt32)output;
+    }
+    
+    return result;
+}
+
@@ -117,6 +117,8 @@ void iSCSIHBAInterfaceUnscheduleWithRunloop(iSCSIHBAInterfaceRef interface,
  *  @param portalSockaddr the BSD socket structure used to identify the target.
  *  @param hostSockaddr the BSD socket structure used to identify the host. This
  *  specifies the interface that the connection will be bound to.
+ *  @param socketBufferSize the socket buffer size to use (applied before
+ *  the connection is established), or 0 to size the buffers automatically.
  *  @param sessionId the session identifier for the new session (returned).
  *  @param connectionId the identifier of the new connection (returned).
  *  @return error code indicating the result of the operation. */
@@ -127,6 +129,7 @@ IOReturn iSCSIHBAInterfaceCreateSession(iSCSIHBAInterfaceRef interface,
                                         CFStringRef hostInterface,
                                         const struct sockaddr_storage * remoteAddress,
                                         const struct sockaddr_storage * localAddress,
+                                        UInt32 socketBufferSize,
                                         SessionIdentifier * sessionId,
                                         ConnectionIdentifier * connectionId);
 
@@ -172,6 +175,8 @@ IOReturn iSCSIHBAInterfaceGetSessionParameter(iSCSIHBAInterfaceRef interface,
  *  @param portalSockaddr the BSD socket structure used to identify the target.
  *  @param hostSockaddr the BSD socket structure used to identify the host. This
  *  specifies the interface that the connection will be bound to.
+ *  @param socketBufferSize the socket buffer size to use (applied before
+ *  the connection is established), or 0 to size the buffers automatically.
  *  @param connectionId the identifier of the new connection.
  *  @return error code indicating result of operation. */
 IOReturn iSCSIHBAInterfaceCreateConnection(iSCSIHBAInterfaceRef interface,
@@ -181,6 +186,7 @@ IOReturn iSCSIHBAInterfaceCreateConnection(iSCSIHBAInterfaceRef interface,
                                            CFStringRef hostInterface,
                                            const struct sockaddr_storage * remoteAddress,
                                            const struct sockaddr_storage * localAddress,
+                                           UInt32 socketBufferSize,
                                            ConnectionIdentifier * connectionId);
 
 /*! Frees a given iSCSI connection associated with a given session.
@@ -386,5 +392,21 @@ CFStringRef iSCSIHBAInterfaceCreateHostInterfaceForConnectionId(iSCSIHBAInterfac
                                                                 SessionIdentifier sessionId,
                                                                 ConnectionIdentifier connectionId);
 
+/*! Retrieves the PDUs that were captured for a session since the last call.
+ *  At most kiSCSIPDUCaptureMaxRecordsPerRead records are returned per call.
+ *  @param interface an instance of an iSCSIHBAInterface.
+ *  @param sessionId session identifier.
+ *  @param records buffer that receives the capture records.
+ *  @param recordCount on input, the number of records the buffer can hold;
+ *  on output, the number of records that were retrieved.
+ *  @param lostRecords the number of records that were overwritten in the
+ *  kernel before they could be retrieved.
+ *  @return error code indicating result of operation. */
+IOReturn iSCSIHBAInterfaceReadPDUCaptureRecords(iSCSIHBAInterfaceRef interface,
+                                                SessionIdentifier sessionId,
+                                                iSCSIPDUCaptureRecord * records,
+                                                UInt32 * recordCount,
+                                                UInt32 * lostRecords);
+
 
 #endif /* defined(__ISCSI_HBA_INTERFACE_H__) */
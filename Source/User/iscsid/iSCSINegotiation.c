@@ -0,0 +1,527 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "iSCSINegotiation.h"
+
+#include <pthread.h>
+#include <strings.h>
+
+/*! The sessions and logins to which a key applies. */
+enum iSCSINegotiationKeyScope {
+    
+    /*! Connection-wide key, negotiated on every login. */
+    kiSCSINegotiationScopeConnection,
+    
+    /*! Session-wide key, negotiated on the leading login of any session. */
+    kiSCSINegotiationScopeSession,
+    
+    /*! Session-wide key, negotiated on the leading login of normal
+     *  (non-discovery) sessions only. */
+    kiSCSINegotiationScopeSessionNormal
+};
+
+/*! The type of value associated with a key. */
+enum iSCSINegotiationKeyType {
+    
+    /*! A decimal or hexadecimal number within a range. */
+    kiSCSINegotiationTypeNumeric,
+    
+    /*! "Yes" or "No". */
+    kiSCSINegotiationTypeBoolean,
+    
+    /*! "None" or "CRC32C". */
+    kiSCSINegotiationTypeDigest
+};
+
+/*! The function used to compute the outcome of a key (RFC3720 section 5.2). */
+enum iSCSINegotiationFunction {
+    
+    /*! The outcome is the lesser of the offer and the response. */
+    kiSCSINegotiationFunctionMin,
+    
+    /*! The outcome is the greater of the offer and the response. */
+    kiSCSINegotiationFunctionMax,
+    
+    /*! The outcome is "Yes" if both the offer and the response are "Yes". */
+    kiSCSINegotiationFunctionAnd,
+    
+    /*! The outcome is "Yes" if either the offer or the response is "Yes". */
+    kiSCSINegotiationFunctionOr,
+    
+    /*! The outcome is the response if it matches the offer; otherwise the
+     *  default value applies. */
+    kiSCSINegotiationFunctionEqual,
+    
+    /*! Each side declares its own value; the outcome is the response. */
+    kiSCSINegotiationFunctionDeclarative
+};
+
+/*! Used in place of a kernel parameter when none applies. */
+static const int kiSCSINegotiationNoParameter = -1;
+
+/*! Describes how a key is negotiated. */
+struct iSCSINegotiationKeyDescriptor {
+    
+    /*! The key, as it appears on the wire. */
+    const char * name;
+    
+    /*! The sessions and logins to which the key applies. */
+    enum iSCSINegotiationKeyScope scope;
+    
+    /*! The type of value associated with the key. */
+    enum iSCSINegotiationKeyType type;
+    
+    /*! The function used to compute the outcome. */
+    enum iSCSINegotiationFunction function;
+    
+    /*! The minimum value permitted (numeric keys). */
+    UInt32 min;
+    
+    /*! The maximum value permitted (numeric keys). */
+    UInt32 max;
+    
+    /*! The default value defined by RFC3720. */
+    UInt32 defaultValue;
+    
+    /*! Whether the target must respond to the key. */
+    Boolean required;
+    
+    /*! The kernel session or connection parameter that receives the
+     *  outcome, depending on the scope of the key. */
+    int parameter;
+    
+    /*! For declarative keys, the kernel connection parameter that receives
+     *  the value declared by the initiator. */
+    int declaredParameter;
+};
+
+/*! Negotiation metadata for each key, indexed by enum iSCSINegotiationKey
+ *  (populated by iSCSINegotiationInitKeys). */
+static struct iSCSINegotiationKeyDescriptor iSCSINegotiationKeys[kiSCSINegotiationNumKeys];
+
+/*! Number of slots in the hash index of wire keys (a power of two, at least
+ *  twice the number of keys so that probe sequences stay short). */
+#define kiSCSINegotiationIndexSize 32
+
+/*! Hash index mapping wire keys to descriptors.  Each slot holds one plus
+ *  the index of a descriptor, or zero if the slot is empty. */
+static UInt8 iSCSINegotiationIndex[kiSCSINegotiationIndexSize];
+
+/*! The length of each key, computed when the hash index is built. */
+static size_t iSCSINegotiationKeyLengths[kiSCSINegotiationNumKeys];
+
+/*! Used to populate the descriptor table once. */
+static pthread_once_t iSCSINegotiationKeysOnce = PTHREAD_ONCE_INIT;
+
+/*! Hashes a wire key (FNV-1a).
+ *  @param key the key.
+ *  @param keyLength the length of the key.
+ *  @return the hash of the key. */
+static UInt32 iSCSINegotiationHashKey(const UInt8 * key,size_t keyLength)
+{
+    UInt32 hash = 2166136261u;
+    
+    for(size_t idx = 0; idx < keyLength; idx++) {
+        hash ^= key[idx];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+/*! Populates the descriptor table and builds the hash index of wire keys.
+ *  The table is populated at run time since the RFC3720 defaults and
+ *  limits it refers to are not compile-time constants in C.  Supporting a
+ *  new key requires an enum iSCSINegotiationKey value and a descriptor. */
+static void iSCSINegotiationInitKeys()
+{
+    iSCSINegotiationKeys[kiSCSINegotiationKeyHeaderDigest] = (struct iSCSINegotiationKeyDescriptor) {
+        "HeaderDigest",kiSCSINegotiationScopeConnection,kiSCSINegotiationTypeDigest,kiSCSINegotiationFunctionEqual,
+        kiSCSINegotiationDigestNone,kiSCSINegotiationDigestCRC32C,kiSCSINegotiationDigestNone,false,
+        kiSCSIHBACOUseHeaderDigest,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyDataDigest] = (struct iSCSINegotiationKeyDescriptor) {
+        "DataDigest",kiSCSINegotiationScopeConnection,kiSCSINegotiationTypeDigest,kiSCSINegotiationFunctionEqual,
+        kiSCSINegotiationDigestNone,kiSCSINegotiationDigestCRC32C,kiSCSINegotiationDigestNone,false,
+        kiSCSIHBACOUseDataDigest,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyMaxRecvDataSegmentLength] = (struct iSCSINegotiationKeyDescriptor) {
+        "MaxRecvDataSegmentLength",kiSCSINegotiationScopeConnection,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionDeclarative,
+        kRFC3720_MaxRecvDataSegmentLength_Min,kRFC3720_MaxRecvDataSegmentLength_Max,kRFC3720_MaxRecvDataSegmentLength,false,
+        kiSCSIHBACOMaxSendDataSegmentLength,kiSCSIHBACOMaxRecvDataSegmentLength };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyDefaultTime2Wait] = (struct iSCSINegotiationKeyDescriptor) {
+        "DefaultTime2Wait",kiSCSINegotiationScopeSession,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMax,
+        kRFC3720_DefaultTime2Wait_Min,kRFC3720_DefaultTime2Wait_Max,kRFC3720_DefaultTime2Wait,true,
+        kiSCSIHBASODefaultTime2Wait,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyDefaultTime2Retain] = (struct iSCSINegotiationKeyDescriptor) {
+        "DefaultTime2Retain",kiSCSINegotiationScopeSession,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMin,
+        kRFC3720_DefaultTime2Retain_Min,kRFC3720_DefaultTime2Retain_Max,kRFC3720_DefaultTime2Retain,true,
+        kiSCSIHBASODefaultTime2Retain,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyErrorRecoveryLevel] = (struct iSCSINegotiationKeyDescriptor) {
+        "ErrorRecoveryLevel",kiSCSINegotiationScopeSession,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMin,
+        kRFC3720_ErrorRecoveryLevel_Min,kRFC3720_ErrorRecoveryLevel_Max,kRFC3720_ErrorRecoveryLevel,true,
+        kiSCSIHBASOErrorRecoveryLevel,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyMaxConnections] = (struct iSCSINegotiationKeyDescriptor) {
+        "MaxConnections",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMin,
+        kRFC3720_MaxConnections_Min,kRFC3720_MaxConnections_Max,kRFC3720_MaxConnections,false,
+        kiSCSIHBASOMaxConnections,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyInitialR2T] = (struct iSCSINegotiationKeyDescriptor) {
+        "InitialR2T",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeBoolean,kiSCSINegotiationFunctionOr,
+        false,true,kRFC3720_InitialR2T,false,
+        kiSCSIHBASOInitialR2T,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyImmediateData] = (struct iSCSINegotiationKeyDescriptor) {
+        "ImmediateData",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeBoolean,kiSCSINegotiationFunctionAnd,
+        false,true,kRFC3720_ImmediateData,false,
+        kiSCSIHBASOImmediateData,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyMaxBurstLength] = (struct iSCSINegotiationKeyDescriptor) {
+        "MaxBurstLength",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMin,
+        kRFC3720_MaxBurstLength_Min,kRFC3720_MaxBurstLength_Max,kRFC3720_MaxBurstLength,false,
+        kiSCSIHBASOMaxBurstLength,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyFirstBurstLength] = (struct iSCSINegotiationKeyDescriptor) {
+        "FirstBurstLength",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMin,
+        kRFC3720_FirstBurstLength_Min,kRFC3720_FirstBurstLength_Max,kRFC3720_FirstBurstLength,false,
+        kiSCSIHBASOFirstBurstLength,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyMaxOutstandingR2T] = (struct iSCSINegotiationKeyDescriptor) {
+        "MaxOutstandingR2T",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeNumeric,kiSCSINegotiationFunctionMin,
+        kRFC3720_MaxOutstandingR2T_Min,kRFC3720_MaxOutstandingR2T_Max,kRFC3720_MaxOutstandingR2T,false,
+        kiSCSIHBASOMaxOutstandingR2T,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyDataPDUInOrder] = (struct iSCSINegotiationKeyDescriptor) {
+        "DataPDUInOrder",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeBoolean,kiSCSINegotiationFunctionOr,
+        false,true,kRFC3720_DataPDUInOrder,false,
+        kiSCSIHBASODataPDUInOrder,kiSCSINegotiationNoParameter };
+    
+    iSCSINegotiationKeys[kiSCSINegotiationKeyDataSequenceInOrder] = (struct iSCSINegotiationKeyDescriptor) {
+        "DataSequenceInOrder",kiSCSINegotiationScopeSessionNormal,kiSCSINegotiationTypeBoolean,kiSCSINegotiationFunctionOr,
+        false,true,kRFC3720_DataSequenceInOrder,false,
+        kiSCSIHBASODataSequenceInOrder,kiSCSINegotiationNoParameter };
+    
+    for(UInt8 key = 0; key < kiSCSINegotiationNumKeys; key++)
+    {
+        const char * name = iSCSINegotiationKeys[key].name;
+        size_t nameLength = strlen(name);
+        UInt32 slot = iSCSINegotiationHashKey((const UInt8 *)name,nameLength);
+        
+        while(iSCSINegotiationIndex[slot % kiSCSINegotiationIndexSize] != 0)
+            slot++;
+        
+        iSCSINegotiationIndex[slot % kiSCSINegotiationIndexSize] = key + 1;
+        iSCSINegotiationKeyLengths[key] = nameLength;
+    }
+}
+
+/*! Looks up the descriptor of a wire key.
+ *  @param key the key.
+ *  @param keyLength the length of the key.
+ *  @return the index of the descriptor, or kiSCSINegotiationNumKeys if the
+ *  key is not a negotiated key. */
+static enum iSCSINegotiationKey iSCSINegotiationLookupKey(const UInt8 * key,size_t keyLength)
+{
+    
+    UInt32 slot = iSCSINegotiationHashKey(key,keyLength);
+    UInt8 entry;
+    
+    while((entry = iSCSINegotiationIndex[slot % kiSCSINegotiationIndexSize]) != 0)
+    {
+        enum iSCSINegotiationKey candidate = entry - 1;
+        
+        if(iSCSINegotiationKeyLengths[candidate] == keyLength &&
+           memcmp(iSCSINegotiationKeys[candidate].name,key,keyLength) == 0)
+            return candidate;
+        
+        slot++;
+    }
+    return kiSCSINegotiationNumKeys;
+}
+
+/*! Compares a value received from the target to a string (values are
+ *  case-sensitive per RFC3720).
+ *  @param pair the key-value pair received.
+ *  @param value a null-terminated value.
+ *  @return true if the values are equal. */
+static Boolean iSCSINegotiationValueEquals(const iSCSIPDUTextPair * pair,const char * value)
+{
+    return strlen(value) == pair->valueLength &&
+           strncmp((const char *)pair->value,value,pair->valueLength) == 0;
+}
+
+/*! Parses a numeric value received from the target.  Per RFC3720, numbers
+ *  are expressed in decimal or in hexadecimal (prefixed by "0x").
+ *  @param pair the key-value pair received.
+ *  @param value the parsed value.
+ *  @return true if the value is a valid number. */
+static Boolean iSCSINegotiationParseNumber(const iSCSIPDUTextPair * pair,UInt32 * value)
+{
+    const UInt8 * digits = pair->value;
+    size_t count = pair->valueLength;
+    UInt64 number = 0;
+    UInt32 base = 10;
+    
+    if(count > 2 && digits[0] == '0' && (digits[1] == 'x' || digits[1] == 'X')) {
+        digits += 2;
+        count -= 2;
+        base = 16;
+    }
+    
+    if(count == 0)
+        return false;
+    
+    for(size_t idx = 0; idx < count; idx++)
+    {
+        UInt8 digit = digits[idx];
+        
+        if(digit >= '0' && digit <= '9')
+            digit -= '0';
+        else if(base == 16 && digit >= 'a' && digit <= 'f')
+            digit -= 'a' - 10;
+        else if(base == 16 && digit >= 'A' && digit <= 'F')
+            digit -= 'A' - 10;
+        else
+            return false;
+        
+        number = number * base + digit;
+        
+        if(number > UINT32_MAX)
+            return false;
+    }
+    
+    *value = (UInt32)number;
+    return true;
+}
+
+void iSCSINegotiationInit(iSCSINegotiation * negotiation,
+                          Boolean sessionWide,
+                          Boolean discoverySession)
+{
+    pthread_once(&iSCSINegotiationKeysOnce,&iSCSINegotiationInitKeys);
+    memset(negotiation,0,sizeof(iSCSINegotiation));
+    
+    for(enum iSCSINegotiationKey key = 0; key < kiSCSINegotiationNumKeys; key++)
+    {
+        const struct iSCSINegotiationKeyDescriptor * descriptor = &iSCSINegotiationKeys[key];
+        
+        if(descriptor->scope != kiSCSINegotiationScopeConnection && !sessionWide)
+            continue;
+        
+        if(descriptor->scope == kiSCSINegotiationScopeSessionNormal && discoverySession)
+            continue;
+        
+        negotiation->offer[key] = descriptor->defaultValue;
+        negotiation->offered |= (1 << key);
+    }
+}
+
+void iSCSINegotiationOffer(iSCSINegotiation * negotiation,
+                           enum iSCSINegotiationKey key,
+                           UInt32 value)
+{
+    if(!negotiation || key >= kiSCSINegotiationNumKeys || !(negotiation->offered & (1 << key)))
+        return;
+    
+    const struct iSCSINegotiationKeyDescriptor * descriptor = &iSCSINegotiationKeys[key];
+    
+    if(value < descriptor->min)
+        value = descriptor->min;
+    else if(value > descriptor->max)
+        value = descriptor->max;
+    
+    negotiation->offer[key] = value;
+}
+
+void iSCSINegotiationBuild(const iSCSINegotiation * negotiation,
+                           iSCSIPDUTextBuilder * builder)
+{
+    for(enum iSCSINegotiationKey key = 0; key < kiSCSINegotiationNumKeys; key++)
+    {
+        if(!(negotiation->offered & (1 << key)))
+            continue;
+        
+        const struct iSCSINegotiationKeyDescriptor * descriptor = &iSCSINegotiationKeys[key];
+        const char * value = NULL;
+        char number[16];
+        
+        switch(descriptor->type)
+        {
+            case kiSCSINegotiationTypeNumeric:
+                snprintf(number,sizeof(number),"%u",(unsigned int)negotiation->offer[key]);
+                value = number;
+                break;
+            case kiSCSINegotiationTypeBoolean:
+                value = negotiation->offer[key] ? "Yes" : "No";
+                break;
+            case kiSCSINegotiationTypeDigest:
+                value = (negotiation->offer[key] == kiSCSINegotiationDigestCRC32C) ? "CRC32C" : "None";
+                break;
+        }
+        
+        iSCSIPDUTextBuilderAppendCStrings(builder,descriptor->name,value);
+    }
+}
+
+void iSCSINegotiationParsePair(void * context,const iSCSIPDUTextPair * pair)
+{
+    iSCSINegotiation * negotiation = context;
+    enum iSCSINegotiationKey key = iSCSINegotiationLookupKey(pair->key,pair->keyLength);
+    
+    // The target alias and portal group tag are the only other keys of
+    // interest (the latter only when login starts with this negotiation)
+    if(key == kiSCSINegotiationNumKeys)
+    {
+        if(iSCSIPDUTextPairKeyEquals(pair,"TargetAlias") && !negotiation->targetAlias)
+            negotiation->targetAlias = CFStringCreateWithBytes(kCFAllocatorDefault,pair->value,pair->valueLength,
+                                                               kCFStringEncodingUTF8,false);
+        
+        else if(iSCSIPDUTextPairKeyEquals(pair,"TargetPortalGroupTag"))
+            negotiation->hasTargetPortalGroupTag = iSCSINegotiationParseNumber(pair,&negotiation->targetPortalGroupTag);
+        return;
+    }
+    
+    const struct iSCSINegotiationKeyDescriptor * descriptor = &iSCSINegotiationKeys[key];
+    UInt32 value = 0;
+    
+    if(iSCSINegotiationValueEquals(pair,"Irrelevant") ||
+       iSCSINegotiationValueEquals(pair,"Reject") ||
+       iSCSINegotiationValueEquals(pair,"NotUnderstood"))
+    {
+        negotiation->declined |= (1 << key);
+        return;
+    }
+    
+    switch(descriptor->type)
+    {
+        case kiSCSINegotiationTypeNumeric:
+            if(!iSCSINegotiationParseNumber(pair,&value)) {
+                negotiation->error = ENOTSUP;
+                return;
+            }
+            break;
+        case kiSCSINegotiationTypeBoolean:
+            value = iSCSINegotiationValueEquals(pair,"Yes");
+            break;
+        case kiSCSINegotiationTypeDigest:
+            // Any value other than CRC32C leaves the digest disabled
+            value = iSCSINegotiationValueEquals(pair,"CRC32C") ? kiSCSINegotiationDigestCRC32C
+                                                               : kiSCSINegotiationDigestNone;
+            break;
+    };
+    
+    negotiation->response[key] = value;
+    negotiation->received |= (1 << key);
+}
+
+errno_t iSCSINegotiationApply(iSCSINegotiation * negotiation,
+                              iSCSIHBAInterfaceRef interface,
+                              SessionIdentifier sessionId,
+                              ConnectionIdentifier connectionId)
+{
+    if(negotiation->error)
+        return negotiation->error;
+    
+    // Outcome of each key; keys that were not negotiated keep their defaults
+    UInt32 outcome[kiSCSINegotiationNumKeys];
+    
+    for(enum iSCSINegotiationKey key = 0; key < kiSCSINegotiationNumKeys; key++)
+        outcome[key] = iSCSINegotiationKeys[key].defaultValue;
+    
+    for(enum iSCSINegotiationKey key = 0; key < kiSCSINegotiationNumKeys; key++)
+    {
+        if(!(negotiation->offered & (1 << key)))
+            continue;
+        
+        const struct iSCSINegotiationKeyDescriptor * descriptor = &iSCSINegotiationKeys[key];
+        UInt32 offer = negotiation->offer[key];
+        UInt32 response = negotiation->response[key];
+        
+        // The initiator's own declaration applies regardless of the target
+        if(descriptor->declaredParameter != kiSCSINegotiationNoParameter)
+            iSCSIHBAInterfaceSetConnectionParameter(interface,sessionId,connectionId,
+                                                    descriptor->declaredParameter,
+                                                    &offer,sizeof(offer));
+        
+        if(!(negotiation->received & (1 << key)))
+        {
+            if(descriptor->required && !(negotiation->declined & (1 << key)))
+                return ENOTSUP;
+            continue;
+        }
+        
+        // FirstBurstLength is irrelevant when InitialR2T=Yes and ImmediateData=No
+        if(key == kiSCSINegotiationKeyFirstBurstLength &&
+           outcome[kiSCSINegotiationKeyInitialR2T] && !outcome[kiSCSINegotiationKeyImmediateData])
+            continue;
+        
+        if(response < descriptor->min || response > descriptor->max)
+            return ENOTSUP;
+        
+        switch(descriptor->function)
+        {
+            case kiSCSINegotiationFunctionMin:
+                outcome[key] = (offer < response) ? offer : response;
+                break;
+            case kiSCSINegotiationFunctionMax:
+                outcome[key] = (offer > response) ? offer : response;
+                break;
+            case kiSCSINegotiationFunctionAnd:
+                outcome[key] = (offer && response);
+                break;
+            case kiSCSINegotiationFunctionOr:
+                outcome[key] = (offer || response);
+                break;
+            case kiSCSINegotiationFunctionEqual:
+                outcome[key] = (offer == response) ? response : descriptor->defaultValue;
+                break;
+            case kiSCSINegotiationFunctionDeclarative:
+                outcome[key] = response;
+                break;
+        }
+        
+        if(descriptor->scope == kiSCSINegotiationScopeConnection)
+            iSCSIHBAInterfaceSetConnectionParameter(interface,sessionId,connectionId,descriptor->parameter,
+                                                    &outcome[key],sizeof(outcome[key]));
+        else
+            iSCSIHBAInterfaceSetSessionParameter(interface,sessionId,descriptor->parameter,
+                                                 &outcome[key],sizeof(outcome[key]));
+    }
+    return 0;
+}
+
+void iSCSINegotiationRelease(iSCSINegotiation * negotiation)
+{
+    if(negotiation && negotiation->targetAlias) {
+        CFRelease(negotiation->targetAlias);
+        negotiation->targetAlias = NULL;
+    }
+}
@@ -0,0 +1,150 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_NEGOTIATION_H__
+#define __ISCSI_NEGOTIATION_H__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "iSCSIHBAInterface.h"
+#include "iSCSIPDUUser.h"
+#include "iSCSITypes.h"
+
+/*! Operational keys negotiated during the login phase (see RFC3720
+ *  section 12).  Keys are negotiated in this order; keys whose outcome
+ *  depends on other keys must follow them. */
+enum iSCSINegotiationKey {
+    kiSCSINegotiationKeyHeaderDigest,
+    kiSCSINegotiationKeyDataDigest,
+    kiSCSINegotiationKeyMaxRecvDataSegmentLength,
+    kiSCSINegotiationKeyDefaultTime2Wait,
+    kiSCSINegotiationKeyDefaultTime2Retain,
+    kiSCSINegotiationKeyErrorRecoveryLevel,
+    kiSCSINegotiationKeyMaxConnections,
+    kiSCSINegotiationKeyInitialR2T,
+    kiSCSINegotiationKeyImmediateData,
+    kiSCSINegotiationKeyMaxBurstLength,
+    kiSCSINegotiationKeyFirstBurstLength,
+    kiSCSINegotiationKeyMaxOutstandingR2T,
+    kiSCSINegotiationKeyDataPDUInOrder,
+    kiSCSINegotiationKeyDataSequenceInOrder,
+    kiSCSINegotiationNumKeys
+};
+
+/*! Values used for the digest keys (HeaderDigest and DataDigest). */
+enum iSCSINegotiationDigest {
+    kiSCSINegotiationDigestNone = 0,
+    kiSCSINegotiationDigestCRC32C = 1
+};
+
+/*! Tracks the state of a login negotiation: the values offered by the
+ *  initiator and the values returned by the target for each key. */
+typedef struct __iSCSINegotiation {
+    
+    /*! The value offered for each key. */
+    UInt32 offer[kiSCSINegotiationNumKeys];
+    
+    /*! The value the target responded with for each key. */
+    UInt32 response[kiSCSINegotiationNumKeys];
+    
+    /*! Bit mask of the keys that are offered to the target. */
+    UInt32 offered;
+    
+    /*! Bit mask of the keys the target responded to with a valid value. */
+    UInt32 received;
+    
+    /*! Bit mask of the keys the target answered with Irrelevant, Reject
+     *  or NotUnderstood. */
+    UInt32 declined;
+    
+    /*! Set if the target responded with a malformed or out-of-range value. */
+    errno_t error;
+    
+    /*! The target alias, if one was returned by the target. */
+    CFStringRef targetAlias;
+    
+    /*! The target portal group tag, if one was returned by the target
+     *  (targets return it in response to the first login request). */
+    UInt32 targetPortalGroupTag;
+    
+    /*! Set if the target returned a valid target portal group tag. */
+    Boolean hasTargetPortalGroupTag;
+    
+} iSCSINegotiation;
+
+/*! Initializes a negotiation, offering the RFC3720 default value for each
+ *  key that applies to the negotiation.
+ *  @param negotiation the negotiation to initialize.
+ *  @param sessionWide true to negotiate session-wide keys, false to
+ *  negotiate connection-wide keys only (adding a connection to a session).
+ *  @param discoverySession true if the session is a discovery session. */
+void iSCSINegotiationInit(iSCSINegotiation * negotiation,
+                          Boolean sessionWide,
+                          Boolean discoverySession);
+
+/*! Offers a value for a key, replacing the default.  The value is clamped
+ *  to the range permitted for the key.  Keys that do not apply to the
+ *  negotiation are ignored.
+ *  @param negotiation the negotiation.
+ *  @param key the key.
+ *  @param value the value to offer. */
+void iSCSINegotiationOffer(iSCSINegotiation * negotiation,
+                           enum iSCSINegotiationKey key,
+                           UInt32 value);
+
+/*! Appends the key-value pairs offered by a negotiation to a text builder.
+ *  @param negotiation the negotiation.
+ *  @param builder the text builder to append to. */
+void iSCSINegotiationBuild(const iSCSINegotiation * negotiation,
+                           iSCSIPDUTextBuilder * builder);
+
+/*! Records a key-value pair received from the target.  This function is
+ *  used as the callback for iSCSISessionLoginTextQuery (the context is the
+ *  negotiation).  Keys are looked up through a hash of the wire key.
+ *  @param context the negotiation.
+ *  @param pair the key-value pair received. */
+void iSCSINegotiationParsePair(void * context,const iSCSIPDUTextPair * pair);
+
+/*! Computes the outcome of each key using the result function defined by
+ *  RFC3720 for that key and stores the outcome with the kernel.
+ *  @param negotiation the negotiation.
+ *  @param interface the HBA interface.
+ *  @param sessionId the session identifier.
+ *  @param connectionId the connection identifier.
+ *  @return an error code indicating the result of the operation; ENOTSUP
+ *  if the target responded with an invalid value or omitted a required key. */
+errno_t iSCSINegotiationApply(iSCSINegotiation * negotiation,
+                              iSCSIHBAInterfaceRef interface,
+                              SessionIdentifier sessionId,
+                              ConnectionIdentifier connectionId);
+
+/*! Releases the resources held by a negotiation.
+ *  @param negotiation the negotiation. */
+void iSCSINegotiationRelease(iSCSINegotiation * negotiation);
+
+#endif /* defined(__ISCSI_NEGOTIATION_H__) */
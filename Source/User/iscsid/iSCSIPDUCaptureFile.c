@@ -0,0 +1,315 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <asl.h>
+#include <sys/param.h>
+#include <libkern/OSByteOrder.h>
+
+#include "iSCSIPDUCaptureFile.h"
+
+/*! pcapng block types. */
+static const UInt32 kPCAPNGSectionHeaderBlock = 0x0A0D0D0A;
+static const UInt32 kPCAPNGInterfaceDescriptionBlock = 0x00000001;
+static const UInt32 kPCAPNGEnhancedPacketBlock = 0x00000006;
+
+/*! pcapng byte-order magic. */
+static const UInt32 kPCAPNGByteOrderMagic = 0x1A2B3C4D;
+
+/*! Link type for raw IPv4 packets. */
+static const UInt16 kPCAPNGLinkTypeRaw = 101;
+
+/*! Length of the synthetic IPv4 and TCP headers that precede each PDU. */
+static const UInt32 kiSCSIPDUCaptureFramingLength = 40;
+
+/*! TCP port of the target (the well-known iSCSI port, so that the iSCSI
+ *  dissector picks up the stream). */
+static const UInt16 kiSCSIPDUCaptureTargetPort = 3260;
+
+/*! TCP port of the first connection of the initiator. */
+static const UInt16 kiSCSIPDUCaptureInitiatorPort = 49152;
+
+struct __iSCSIPDUCaptureFile {
+    
+    /*! The open capture file. */
+    FILE * stream;
+    
+    /*! Path of the capture file. */
+    CFStringRef path;
+    
+    /*! Session whose PDUs are written to the file. */
+    SessionIdentifier sessionId;
+    
+    /*! Next TCP sequence number for each connection and direction. */
+    UInt32 sequenceNumber[kiSCSIMaxConnectionsPerSession][2];
+};
+
+/*! Writes a pcapng block.
+ *  @param stream the stream to write to.
+ *  @param type the block type.
+ *  @param body the block body.
+ *  @param length the length of the body (padded to four bytes on output).
+ *  @return true if the block was written. */
+static Boolean iSCSIPDUCaptureWriteBlock(FILE * stream,UInt32 type,const void * body,UInt32 length)
+{
+    UInt32 padding = 0;
+    UInt32 paddingLength = iSCSIPDUGetPaddedLength(length) - length;
+    UInt32 totalLength = 3*sizeof(UInt32) + length + paddingLength;
+    
+    return fwrite(&type,sizeof(type),1,stream) == 1 &&
+           fwrite(&totalLength,sizeof(totalLength),1,stream) == 1 &&
+           fwrite(body,length,1,stream) == 1 &&
+           fwrite(&padding,paddingLength,1,stream) <= 1 &&
+           fwrite(&totalLength,sizeof(totalLength),1,stream) == 1;
+}
+
+/*! Builds the synthetic IPv4 and TCP headers for a captured PDU.
+ *  @param file the capture file.
+ *  @param record the capture record.
+ *  @param framing buffer that receives the headers. */
+static void iSCSIPDUCaptureBuildFraming(iSCSIPDUCaptureFileRef file,
+                                        const iSCSIPDUCaptureRecord * record,
+                                        UInt8 framing[kiSCSIPDUCaptureFramingLength])
+{
+    // Initiators use 192.0.2.x (x = session + 1); targets use 198.51.100.1
+    const UInt8 initiatorAddress[4] = {192,0,2,(UInt8)(file->sessionId + 1)};
+    const UInt8 targetAddress[4] = {198,51,100,1};
+    
+    Boolean send = (record->direction == kiSCSIPDUCaptureDirectionSend);
+    ConnectionIdentifier cid = record->connectionId % kiSCSIMaxConnectionsPerSession;
+    
+    UInt16 initiatorPort = kiSCSIPDUCaptureInitiatorPort + cid;
+    UInt32 ipLength = kiSCSIPDUCaptureFramingLength + record->originalLength;
+    
+    if(ipLength > UINT16_MAX)
+        ipLength = UINT16_MAX;
+    
+    memset(framing,0,kiSCSIPDUCaptureFramingLength);
+    
+    // IPv4 header (don't fragment, TTL 64, TCP)
+    UInt8 * ip = framing;
+    ip[0] = 0x45;
+    ip[2] = ipLength >> 8;
+    ip[3] = ipLength & 0xFF;
+    ip[6] = 0x40;
+    ip[8] = 64;
+    ip[9] = IPPROTO_TCP;
+    memcpy(ip+12,send ? initiatorAddress : targetAddress,4);
+    memcpy(ip+16,send ? targetAddress : initiatorAddress,4);
+    
+    UInt32 checksum = 0;
+    for(int idx = 0; idx < 20; idx += 2)
+        checksum += (ip[idx] << 8) | ip[idx+1];
+    while(checksum >> 16)
+        checksum = (checksum & 0xFFFF) + (checksum >> 16);
+    checksum = ~checksum & 0xFFFF;
+    ip[10] = checksum >> 8;
+    ip[11] = checksum & 0xFF;
+    
+    // TCP header (PSH and ACK); the checksum is left unset
+    UInt8 * tcp = framing + 20;
+    UInt16 sourcePort = send ? initiatorPort : kiSCSIPDUCaptureTargetPort;
+    UInt16 destinationPort = send ? kiSCSIPDUCaptureTargetPort : initiatorPort;
+    UInt32 seq = file->sequenceNumber[cid][send ? 0 : 1];
+    UInt32 ack = file->sequenceNumber[cid][send ? 1 : 0];
+    
+    tcp[0] = sourcePort >> 8;
+    tcp[1] = sourcePort & 0xFF;
+    tcp[2] = destinationPort >> 8;
+    tcp[3] = destinationPort & 0xFF;
+    OSWriteBigInt32(tcp,4,seq);
+    OSWriteBigInt32(tcp,8,ack);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x18;
+    tcp[14] = 0xFF;
+    tcp[15] = 0xFF;
+    
+    file->sequenceNumber[cid][send ? 0 : 1] = seq + record->originalLength;
+}
+
+/*! Writes a captured PDU to a capture file.
+ *  @param file the capture file.
+ *  @param record the capture record.
+ *  @return true if the PDU was written. */
+static Boolean iSCSIPDUCaptureWriteRecord(iSCSIPDUCaptureFileRef file,
+                                          const iSCSIPDUCaptureRecord * record)
+{
+    struct {
+        UInt32 interfaceId;
+        UInt32 timestampHigh;
+        UInt32 timestampLow;
+        UInt32 capturedLength;
+        UInt32 originalLength;
+        UInt8 packet[kiSCSIPDUCaptureFramingLength + kiSCSIPDUCaptureMaxSnapLength];
+    } body;
+    
+    UInt32 capturedLength = record->capturedLength;
+    
+    if(capturedLength > kiSCSIPDUCaptureMaxSnapLength)
+        capturedLength = kiSCSIPDUCaptureMaxSnapLength;
+    
+    body.interfaceId = 0;
+    body.timestampHigh = (UInt32)(record->timestamp >> 32);
+    body.timestampLow = (UInt32)record->timestamp;
+    body.capturedLength = kiSCSIPDUCaptureFramingLength + capturedLength;
+    body.originalLength = kiSCSIPDUCaptureFramingLength + record->originalLength;
+    
+    iSCSIPDUCaptureBuildFraming(file,record,body.packet);
+    memcpy(body.packet + kiSCSIPDUCaptureFramingLength,record->data,capturedLength);
+    
+    UInt32 length = (UInt32)(sizeof(body) - sizeof(body.packet)) + body.capturedLength;
+    return iSCSIPDUCaptureWriteBlock(file->stream,kPCAPNGEnhancedPacketBlock,&body,length);
+}
+
+/*! Opens a capture file for a session.  Captured PDUs are appended to the
+ *  file if it already exists (as a new pcapng section).
+ *  @param path the path of the capture file.
+ *  @param sessionId the session whose PDUs are written to the file.
+ *  @return a capture file, or NULL if the file could not be opened. */
+iSCSIPDUCaptureFileRef iSCSIPDUCaptureFileCreate(CFStringRef path,
+                                                 SessionIdentifier sessionId)
+{
+    char pathBuffer[PATH_MAX];
+    
+    if(!path || !CFStringGetFileSystemRepresentation(path,pathBuffer,sizeof(pathBuffer)))
+        return NULL;
+    
+    // The daemon runs as root; don't follow symbolic links and keep the
+    // captured PDUs (which may include credentials) private
+    int fd = open(pathBuffer,O_WRONLY|O_APPEND|O_CREAT|O_NOFOLLOW,0600);
+    FILE * stream = NULL;
+    
+    if(fd < 0 || !(stream = fdopen(fd,"ab"))) {
+        asl_log(NULL,NULL,ASL_LEVEL_ERR,"failed to open PDU capture file %s: %s",pathBuffer,strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    
+    // Section header: version 1.0, section length unspecified
+    struct {
+        UInt32 byteOrderMagic;
+        UInt16 majorVersion;
+        UInt16 minorVersion;
+        SInt64 sectionLength;
+    } __attribute__((packed)) sectionHeader = {kPCAPNGByteOrderMagic,1,0,-1};
+    
+    // Interface description: raw IPv4, no snap length limit
+    struct {
+        UInt16 linkType;
+        UInt16 reserved;
+        UInt32 snapLength;
+    } interfaceDescription = {kPCAPNGLinkTypeRaw,0,0};
+    
+    if(!iSCSIPDUCaptureWriteBlock(stream,kPCAPNGSectionHeaderBlock,&sectionHeader,sizeof(sectionHeader)) ||
+       !iSCSIPDUCaptureWriteBlock(stream,kPCAPNGInterfaceDescriptionBlock,&interfaceDescription,sizeof(interfaceDescription)))
+    {
+        fclose(stream);
+        return NULL;
+    }
+    fflush(stream);
+    
+    iSCSIPDUCaptureFileRef file = calloc(1,sizeof(struct __iSCSIPDUCaptureFile));
+    
+    if(!file) {
+        fclose(stream);
+        return NULL;
+    }
+    
+    file->stream = stream;
+    file->path = CFStringCreateCopy(kCFAllocatorDefault,path);
+    file->sessionId = sessionId;
+    
+    return file;
+}
+
+/*! Closes a capture file.
+ *  @param file the capture file. */
+void iSCSIPDUCaptureFileRelease(iSCSIPDUCaptureFileRef file)
+{
+    if(!file)
+        return;
+    
+    fclose(file->stream);
+    CFRelease(file->path);
+    free(file);
+}
+
+/*! Gets the path of a capture file.
+ *  @param file the capture file.
+ *  @return the path of the capture file. */
+CFStringRef iSCSIPDUCaptureFileGetPath(iSCSIPDUCaptureFileRef file)
+{
+    return file->path;
+}
+
+/*! Retrieves the PDUs that the kernel captured for the session of a capture
+ *  file and appends them to the file.
+ *  @param file the capture file.
+ *  @param interface the HBA interface used to retrieve captured PDUs.
+ *  @return an error code indicating the result of the operation (ENOENT
+ *  if the session no longer exists). */
+errno_t iSCSIPDUCaptureFileDrain(iSCSIPDUCaptureFileRef file,
+                                 iSCSIHBAInterfaceRef interface)
+{
+    iSCSIPDUCaptureRecord records[kiSCSIPDUCaptureMaxRecordsPerRead];
+    UInt32 recordCount, lostRecords, totalLostRecords = 0;
+    errno_t error = 0;
+    
+    do {
+        recordCount = kiSCSIPDUCaptureMaxRecordsPerRead;
+        
+        IOReturn result = iSCSIHBAInterfaceReadPDUCaptureRecords(interface,file->sessionId,
+                                                                 records,&recordCount,&lostRecords);
+        if(result == kIOReturnNotFound)
+            error = ENOENT;
+        else if(result != kIOReturnSuccess)
+            error = EIO;
+        
+        if(error)
+            break;
+        
+        totalLostRecords += lostRecords;
+        
+        for(UInt32 idx = 0; idx < recordCount && !error; idx++)
+            if(!iSCSIPDUCaptureWriteRecord(file,&records[idx]))
+                error = errno ? errno : EIO;
+        
+    } while(!error && recordCount == kiSCSIPDUCaptureMaxRecordsPerRead);
+    
+    if(totalLostRecords)
+        asl_log(NULL,NULL,ASL_LEVEL_NOTICE,"PDU capture for session %d dropped %u PDUs",
+                file->sessionId,totalLostRecords);
+    
+    fflush(file->stream);
+    return error;
+}
@@ -0,0 +1,69 @@
+/*
+ * Copyright (c) 2016, Nareg Sinenian
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef __ISCSI_PDU_CAPTURE_FILE_H__
+#define __ISCSI_PDU_CAPTURE_FILE_H__
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "iSCSIHBAInterface.h"
+
+/*! A file to which PDUs captured by the kernel extension are written in
+ *  pcapng format.  Each PDU is wrapped in synthetic IPv4 and TCP headers so
+ *  that the iSCSI dissector of common protocol analyzers can decode it; the
+ *  TCP sequence numbers of each connection advance by the length of every
+ *  captured PDU. */
+typedef struct __iSCSIPDUCaptureFile * iSCSIPDUCaptureFileRef;
+
+/*! Opens a capture file for a session.  Captured PDUs are appended to the
+ *  file if it already exists (as a new pcapng section).
+ *  @param path the path of the capture file.
+ *  @param sessionId the session whose PDUs are written to the file.
+ *  @return a capture file, or NULL if the file could not be opened. */
+iSCSIPDUCaptureFileRef iSCSIPDUCaptureFileCreate(CFStringRef path,
+                                                 SessionIdentifier sessionId);
+
+/*! Closes a capture file.
+ *  @param file the capture file. */
+void iSCSIPDUCaptureFileRelease(iSCSIPDUCaptureFileRef file);
+
+/*! Gets the path of a capture file.
+ *  @param file the capture file.
+ *  @return the path of the capture file. */
+CFStringRef iSCSIPDUCaptureFileGetPath(iSCSIPDUCaptureFileRef file);
+
+/*! Retrieves the PDUs that the kernel captured for the session of a capture
+ *  file and appends them to the file.
+ *  @param file the capture file.
+ *  @param interface the HBA interface used to retrieve captured PDUs.
+ *  @return an error code indicating the result of the operation (ENOENT
+ *  if the session no longer exists). */
+errno_t iSCSIPDUCaptureFileDrain(iSCSIPDUCaptureFileRef file,
+                                 iSCSIHBAInterfaceRef interface);
+
+#endif /* defined(__ISCSI_PDU_CAPTURE_FILE_H__) */
@@ -27,6 +27,7 @@
  */
 
 #include "iSCSIPDUUser.h"
+#include <errno.h>
 
 
 const iSCSIPDULogoutReqBHS iSCSIPDULogoutReqBHSInit = {
@@ -43,6 +44,18 @@ const iSCSIPDUTextReqBHS iSCSIPDUTextReqBHSInit = {
     .reserved3                  = 0
 };
 
+const iSCSIPDUNOPOutBHS iSCSIPDUNOPOutBHSInit = {
+    .opCodeAndDeliveryMarker    = (kiSCSIPDUOpCodeNOPOut | kiSCSIPDUImmediateDeliveryFlag),
+    .reserved                   = 0x80,
+    .reserved2                  = 0,
+    .totalAHSLength             = 0,
+    .LUN                        = 0,
+    .initiatorTaskTag           = 0,
+    .targetTransferTag          = 0,
+    .reserved3                  = 0,
+    .reserved4                  = 0
+};
+
 const iSCSIPDULoginReqBHS iSCSIPDULoginReqBHSInit = {
     .opCodeAndDeliveryMarker = (kiSCSIPDUOpCodeLoginReq | kiSCSIPDUImmediateDeliveryFlag),
     .loginStage = 0,
@@ -98,6 +111,43 @@ const unsigned short kiSCSIPDUTextReqFinalFlag = 0x80;
  *  follow for this text request. */
 const unsigned short kiSCSIPDUTextReqContinueFlag = 0x40;
 
+Boolean iSCSIPDUDataGetNextTextPair(const void * data,size_t length,
+                                    size_t * offset,
+                                    iSCSIPDUTextPair * pair)
+{
+    if(!data || !offset || !pair)
+        return false;
+    
+    const UInt8 * bytes = data;
+    
+    // Each pair is terminated by a null; locate terminators and separators
+    // with memchr rather than testing each byte individually
+    while(*offset < length)
+    {
+        const UInt8 * start = bytes + *offset;
+        const UInt8 * end = memchr(start,0,length - *offset);
+        
+        if(!end)
+            return false;
+        
+        *offset = (end - bytes) + 1;
+        
+        // Skip null padding (per RFC3720 PDUs are padded up to the nearest
+        // word) and anything that is not a key-value pair
+        const UInt8 * separator = memchr(start,'=',end - start);
+        
+        if(!separator)
+            continue;
+        
+        pair->key = start;
+        pair->keyLength = separator - start;
+        pair->value = separator + 1;
+        pair->valueLength = end - (separator + 1);
+        return true;
+    }
+    return false;
+}
+
 void iSCSIPDUDataParseCommon(void * data,size_t length,
                              void * keyContainer,
                              void * valContainer,
@@ -107,64 +157,107 @@ void iSCSIPDUDataParseCommon(void * data,size_t length,
     if(!data || length == 0 || !callback)
         return;
     
-    // Parse the text response
-    UInt8 * currentByte = data;
-    
-    UInt8 * lastByte = currentByte + length;
-    UInt8 * tokenStartByte = currentByte;
-    
-    CFStringRef keyString = NULL, valString = NULL;
+    iSCSIPDUTextPair pair;
+    size_t offset = 0;
     
-    bool equalFound = false;
-    
-    // Search through bytes and look for key=value pairs.  Convert key and
-    // value strings to CFStrings and add to a dictionary
-    while(currentByte <= lastByte)
+    // Strings are created only for the pairs handed to the callback
+    while(iSCSIPDUDataGetNextTextPair(data,length,&offset,&pair))
     {
-        if(*currentByte == '=')
-        {
-            keyString = CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                tokenStartByte,
-                                                currentByte-tokenStartByte,
-                                                kCFStringEncodingUTF8,false);
-            // Advance the starting point to skip the '='
-            tokenStartByte = currentByte + 1;
-            
-            // We've crossed from key to value
-            equalFound = true;
-        }
-        // Second boolean expression is required for the case of null-padded
-        // datasegments (per RFC3720 PDUs are padded up to the nearest word)
-        else if(*currentByte == 0 && equalFound)
-        {
-            valString = CFStringCreateWithBytes(kCFAllocatorDefault,
-                                                tokenStartByte,
-                                                currentByte-tokenStartByte,
-                                                kCFStringEncodingUTF8,false);
-            // Advance the starting point to skip the '='
-            tokenStartByte = currentByte + 1;
+        CFStringRef keyString = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                        pair.key,pair.keyLength,
+                                                        kCFStringEncodingUTF8,false);
+        CFStringRef valString = CFStringCreateWithBytes(kCFAllocatorDefault,
+                                                        pair.value,pair.valueLength,
+                                                        kCFStringEncodingUTF8,false);
+        
+        if(keyString && valString)
             (*callback)(keyContainer,keyString,valContainer,valString);
-
+        
+        if(keyString)
             CFRelease(keyString);
+        
+        if(valString)
             CFRelease(valString);
-            keyString = valString = NULL;
-            
-            // Reset for next key-value pair (this allows extra 0's for padding
-            // if the string should contain any)
-            equalFound = false;
-        }
-        currentByte++;
     }
+}
+
+/*! A key of up to 63 bytes, the separator, a value of up to 8192 bytes and
+ *  the null terminator. */
+const size_t kiSCSIPDUTextAssemblerMaxPairLength = 63 + 1 + 8192 + 1;
 
-    if(keyString) {
-        CFRelease(keyString);
-        keyString = NULL;
+const iSCSIPDUTextAssembler iSCSIPDUTextAssemblerInit = {
+    .partial = NULL,
+    .partialLength = 0
+};
+
+errno_t iSCSIPDUTextAssemblerAppend(iSCSIPDUTextAssembler * assembler,
+                                    const void * data,size_t length,
+                                    iSCSIPDUTextPairCallback callback,
+                                    void * context)
+{
+    if(!assembler || !callback || (!data && length != 0))
+        return EINVAL;
+    
+    const UInt8 * bytes = data;
+    size_t offset = 0;
+    iSCSIPDUTextPair pair;
+    
+    // Complete the pair left over from the previous data segment, if any
+    if(assembler->partialLength != 0)
+    {
+        const UInt8 * end = memchr(bytes,0,length);
+        size_t count = end ? (end - bytes) + 1 : length;
+        
+        if(assembler->partialLength + count > kiSCSIPDUTextAssemblerMaxPairLength)
+            return EMSGSIZE;
+        
+        memcpy(assembler->partial + assembler->partialLength,bytes,count);
+        assembler->partialLength += count;
+        offset = count;
+        
+        // The pair continues into the next data segment
+        if(!end)
+            return 0;
+        
+        size_t partialOffset = 0;
+        if(iSCSIPDUDataGetNextTextPair(assembler->partial,assembler->partialLength,&partialOffset,&pair))
+            (*callback)(context,&pair);
+        
+        assembler->partialLength = 0;
     }
     
-    if(valString) {
-        CFRelease(valString);
-        valString = NULL;
+    // Hand complete pairs to the callback straight from the data segment
+    while(iSCSIPDUDataGetNextTextPair(bytes,length,&offset,&pair))
+        (*callback)(context,&pair);
+    
+    // Carry the incomplete pair that ends this data segment (if any)
+    if(offset < length)
+    {
+        if(length - offset > kiSCSIPDUTextAssemblerMaxPairLength)
+            return EMSGSIZE;
+        
+        if(!assembler->partial &&
+           !(assembler->partial = malloc(kiSCSIPDUTextAssemblerMaxPairLength)))
+            return ENOMEM;
+        
+        memcpy(assembler->partial,bytes + offset,length - offset);
+        assembler->partialLength = length - offset;
     }
+    return 0;
+}
+
+errno_t iSCSIPDUTextAssemblerFinish(iSCSIPDUTextAssembler * assembler)
+{
+    if(!assembler)
+        return EINVAL;
+    
+    errno_t error = (assembler->partialLength != 0) ? EINVAL : 0;
+    
+    free(assembler->partial);
+    assembler->partial = NULL;
+    assembler->partialLength = 0;
+    
+    return error;
 }
 
 void iSCSIPDUDataParseToDictCallback(void * keyContainer,CFStringRef keyString,
@@ -204,90 +297,178 @@ void iSCSIPDUDataParseToArrays(void * data,size_t length,CFMutableArrayRef keys,
     if(!data || length == 0 || !values)
         return;
     
-    iSCSIPDUDataParseCommon(data,length,keys,values,&iSCSIPDUDataParseToDictCallback);
+    iSCSIPDUDataParseCommon(data,length,keys,values,&iSCSIPDUDataParseToArraysCallback);
 }
 
 
 
-/*! Struct used to track the position of the PDU data segment being written. */
-typedef struct iSCSIPDUDataSegmentTracker  {
-    UInt8 * dataSegmentPosition;
-} iSCSIPDUDataSegmentTracker;
+/*! Initial capacity of a text builder; enough for most login PDUs. */
+static const size_t kiSCSIPDUTextBuilderInitialCapacity = 512;
 
-/*! Helper function used when creating login, logout and text request PDUs.
- *  This function calculates the total string length (byte size since the
- *  strings are UTF-8 encoded) of the key-value pairs in a dictionary.
- *  It also adds to the length for each '=' required for each
- *  key-value pair and the appropriate null terminators per RFC3720. */
-void iSCSIPDUCalculateTextCommandByteSize(const void * key,
-                                          const void * value,
-                                          void * stringByteSize)
+const iSCSIPDUTextBuilder iSCSIPDUTextBuilderInit = {
+    .data = NULL,
+    .length = 0,
+    .capacity = 0,
+    .error = 0
+};
+
+/*! Helper function used by the text builder to ensure that a number of
+ *  additional bytes can be written to the data segment.
+ *  @param builder the text builder.
+ *  @param count the number of additional bytes required.
+ *  @return true if the bytes are available. */
+static Boolean iSCSIPDUTextBuilderReserve(iSCSIPDUTextBuilder * builder,size_t count)
 {
-    // Ensure counter is valid
-    if(stringByteSize)
+    if(builder->error)
+        return false;
+    
+    if(builder->length + count <= builder->capacity)
+        return true;
+    
+    size_t capacity = builder->capacity ? builder->capacity : kiSCSIPDUTextBuilderInitialCapacity;
+    
+    while(capacity < builder->length + count)
+        capacity *= 2;
+    
+    capacity = iSCSIPDUGetPaddedLength((UInt32)capacity);
+    
+    UInt8 * data = realloc(builder->data,capacity);
+    
+    if(!data) {
+        builder->error = ENOMEM;
+        return false;
+    }
+    
+    builder->data = data;
+    builder->capacity = capacity;
+    return true;
+}
+
+/*! Helper function used by the text builder to copy bytes into the
+ *  data segment.
+ *  @param builder the text builder.
+ *  @param bytes the bytes to append.
+ *  @param count the number of bytes to append.
+ *  @return true if the bytes were appended. */
+static Boolean iSCSIPDUTextBuilderAppendBytes(iSCSIPDUTextBuilder * builder,const void * bytes,size_t count)
+{
+    if(!iSCSIPDUTextBuilderReserve(builder,count))
+        return false;
+    
+    memcpy(builder->data + builder->length,bytes,count);
+    builder->length += count;
+    return true;
+}
+
+/*! Helper function used by the text builder to encode a string as UTF-8
+ *  directly into the data segment.
+ *  @param builder the text builder.
+ *  @param string the string to append.
+ *  @return true if the string was appended. */
+static Boolean iSCSIPDUTextBuilderAppendString(iSCSIPDUTextBuilder * builder,CFStringRef string)
+{
+    // Most keys and values are ASCII and are stored as such by CFString
+    const char * cString = CFStringGetCStringPtr(string,kCFStringEncodingUTF8);
+    
+    if(cString)
+        return iSCSIPDUTextBuilderAppendBytes(builder,cString,strlen(cString));
+    
+    // Otherwise reserve the worst case and let CFString write the bytes
+    CFRange range = CFRangeMake(0,CFStringGetLength(string));
+    CFIndex maxLength = CFStringGetMaximumSizeForEncoding(range.length,kCFStringEncodingUTF8);
+    CFIndex usedLength = 0;
+    
+    if(maxLength == kCFNotFound || !iSCSIPDUTextBuilderReserve(builder,maxLength))
+        return false;
+    
+    if(CFStringGetBytes(string,range,kCFStringEncodingUTF8,0,false,
+                        builder->data + builder->length,maxLength,&usedLength) != range.length)
     {
-        // Count the length of the key and value strings, and for each pair add
-        // 2 to include the length of the '=' (equality between key-value pair)
-        // and '\0' (null terminator)
-        (*(CFIndex*)stringByteSize) = (*(CFIndex*)stringByteSize)
-            + CFStringGetLength((CFStringRef)key)
-            + CFStringGetLength((CFStringRef)value)
-            + 2;
+        builder->error = EINVAL;
+        return false;
+    }
+    
+    builder->length += usedLength;
+    return true;
+}
+
+void iSCSIPDUTextBuilderAppendPair(iSCSIPDUTextBuilder * builder,CFStringRef key,CFStringRef value)
+{
+    if(!builder || builder->error)
+        return;
+    
+    if(!key || !value) {
+        builder->error = EINVAL;
+        return;
+    }
+    
+    // Per RFC3720, each pair is of the form "key=value" followed by a null
+    if(!iSCSIPDUTextBuilderAppendString(builder,key) || !iSCSIPDUTextBuilderReserve(builder,1))
+        return;
+    
+    builder->data[builder->length++] = '=';
+    
+    if(!iSCSIPDUTextBuilderAppendString(builder,value) || !iSCSIPDUTextBuilderReserve(builder,1))
+        return;
+    
+    builder->data[builder->length++] = 0;
+}
+
+void iSCSIPDUTextBuilderAppendCStrings(iSCSIPDUTextBuilder * builder,const char * key,const char * value)
+{
+    if(!builder || builder->error)
+        return;
+    
+    if(!key || !value) {
+        builder->error = EINVAL;
+        return;
     }
+    
+    // Copy the null terminator of the value along with it
+    if(iSCSIPDUTextBuilderAppendBytes(builder,key,strlen(key)) &&
+       iSCSIPDUTextBuilderAppendBytes(builder,"=",1))
+        iSCSIPDUTextBuilderAppendBytes(builder,value,strlen(value) + 1);
+}
+
+/*! Callback used by iSCSIPDUTextBuilderAppendDict to append each pair. */
+static void iSCSIPDUTextBuilderAppendDictCallback(const void * key,
+                                                  const void * value,
+                                                  void * builder)
+{
+    iSCSIPDUTextBuilderAppendPair(builder,(CFStringRef)key,(CFStringRef)value);
 }
 
-/*! Helper function used when creating login, logout and text request PDUs.
- *  This function populates the data segment of a login, logout, or text
- *  request PDUs with the key-value pairs specified by a dictionary.
- *  @param key
- *  @param value
- *  @param posTracker */
-void iSCSIPDUPopulateWithTextCommand(const void * key,
-                                     const void * value,
-                                     void * posTracker)
+void iSCSIPDUTextBuilderAppendDict(iSCSIPDUTextBuilder * builder,CFDictionaryRef textDict)
 {
-    const int MAX_KEY_SIZE = 100;
-    const int MAX_VAL_SIZE = 100;
+    if(!builder || !textDict)
+        return;
+    
+    CFDictionaryApplyFunction(textDict,&iSCSIPDUTextBuilderAppendDictCallback,builder);
+}
+
+errno_t iSCSIPDUTextBuilderFinish(iSCSIPDUTextBuilder * builder,void * * data,size_t * length)
+{
+    if(!builder || !data || !length)
+        return EINVAL;
+    
+    errno_t error = builder->error;
     
-    // Ensure pointer to data segment is valid
-    if(posTracker)
+    if(error || builder->length == 0)
     {
-        CFIndex keyByteSize = CFStringGetLength((CFStringRef)key);
-        CFIndex valueByteSize = CFStringGetLength((CFStringRef)value);
-        CFStringEncoding stringEncoding = kCFStringEncodingUTF8;
-        
-        char keyCString[MAX_KEY_SIZE];
-        char valueCString[MAX_VAL_SIZE];
-        
-        Boolean validKeyCString = CFStringGetCString(key,keyCString,MAX_KEY_SIZE,stringEncoding);
-        Boolean validValueCString = CFStringGetCString(value,valueCString,MAX_VAL_SIZE,stringEncoding);
-        
-        // If both strings are valid C-strings, copy them into the PDU
-        if(validKeyCString && validValueCString)
-        {
-            iSCSIPDUDataSegmentTracker * position =
-                (iSCSIPDUDataSegmentTracker*)posTracker;
-            
-            // Copy key
-            memcpy(position->dataSegmentPosition,keyCString,keyByteSize);
-            position->dataSegmentPosition =
-                position->dataSegmentPosition + keyByteSize;
-            
-            // Add '='
-            memset(position->dataSegmentPosition,'=',1);
-            position->dataSegmentPosition =
-                position->dataSegmentPosition + 1;
-            
-            // Copy value
-            memcpy(position->dataSegmentPosition,valueCString,valueByteSize);
-            position->dataSegmentPosition =
-                position->dataSegmentPosition + valueByteSize;
-            
-            // Add null terminator
-            memset(position->dataSegmentPosition,0,1);
-            position->dataSegmentPosition = position->dataSegmentPosition + 1;
-        }
+        free(builder->data);
+        *data = NULL;
+        *length = 0;
+    }
+    else
+    {
+        // Zero the padding that follows the data segment
+        memset(builder->data + builder->length,0,builder->capacity - builder->length);
+        *data = builder->data;
+        *length = builder->length;
     }
+    
+    *builder = iSCSIPDUTextBuilderInit;
+    return error;
 }
 
 /*! Creates a PDU data segment consisting of key-value pairs from a dictionary.
@@ -299,25 +480,9 @@ void iSCSIPDUDataCreateFromDict(CFDictionaryRef textDict,void ** data,size_t * l
     if(!length || !data || !textDict)
         return;
     
-    // Apply a function to key-value pairs to determine total byte size of
-    // the text commands
-    CFIndex cmdByteSize = 0;
-    CFDictionaryApplyFunction(textDict,
-                              &iSCSIPDUCalculateTextCommandByteSize,
-                              &cmdByteSize);
-
-    if((*data = malloc(cmdByteSize)) == NULL) {
-        *length = 0;
-        return;
-    }
- 
-    *length = cmdByteSize;
-    
-    iSCSIPDUDataSegmentTracker posTracker;
-    posTracker.dataSegmentPosition = *data;
-    
-    // Apply a function to iterate over key-value pairs and add them to this PDU
-    CFDictionaryApplyFunction(textDict,&iSCSIPDUPopulateWithTextCommand,&posTracker);
+    iSCSIPDUTextBuilder builder = iSCSIPDUTextBuilderInit;
+    iSCSIPDUTextBuilderAppendDict(&builder,textDict);
+    iSCSIPDUTextBuilderFinish(&builder,data,length);
 }
 
 /*! Creates a PDU data segment of the specified size.
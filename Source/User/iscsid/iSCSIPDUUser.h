@@ -31,6 +31,7 @@
 
 #include "iSCSIPDUShared.h"
 #include <CoreFoundation/CoreFoundation.h>
+#include <string.h>
 
 
 /*! Basic header segment for a login request PDU. */
@@ -51,6 +52,8 @@ typedef struct __iSCSIPDULoginReqBHS {
     UInt16 reserved;
     UInt32 cmdSN;
     UInt32 expStatSN;
+    UInt64 reserved2;
+    UInt64 reserved3;
 } __attribute__((packed)) iSCSIPDULoginReqBHS;
 
 /*! Basic header segment for a login response PDU. */
@@ -73,6 +76,8 @@ typedef struct __iSCSIPDULoginRspBHS {
     UInt32 maxCmdSN;
     UInt8 statusClass;
     UInt8 statusDetail;
+    UInt16 reserved2;
+    UInt64 reserved3;
 } __attribute__((packed)) iSCSIPDULoginRspBHS;
 
 /*! Basic header segment for a logout request PDU. */
@@ -88,6 +93,8 @@ typedef struct __iSCSIPDULogoutReqBHS {
     UInt16 reserved3;
     UInt32 cmdSN;
     UInt32 expStatSN;
+    UInt64 reserved4;
+    UInt64 reserved5;
 } __attribute__((packed)) iSCSIPDULogoutReqBHS;
 
 /*! Basic header segment for a logout response PDU. */
@@ -107,6 +114,7 @@ typedef struct __iSCSIPDULogoutRspBHS {
     UInt32 reserved5;
     UInt16 time2Wait;
     UInt16 time2Retain;
+    UInt32 reserved6;
 } __attribute__((packed)) iSCSIPDULogoutRspBHS;
 
 /*! Basic header segment for a text request PDU. */
@@ -142,6 +150,48 @@ typedef struct __iSCSIPDUTextRspBHS {
     UInt32 reserved3;
 } __attribute__((packed)) iSCSIPDUTextRspBHS;
 
+/*! Basic header segment for a NOP out PDU. */
+typedef struct __iSCSIPDUNOPOutBHS {
+    const UInt8 opCodeAndDeliveryMarker;
+    UInt8 reserved;
+    UInt16 reserved2;
+    UInt8 totalAHSLength;
+    UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
+    UInt64 LUN;
+    UInt32 initiatorTaskTag;
+    UInt32 targetTransferTag;
+    UInt32 cmdSN;
+    UInt32 expStatSN;
+    UInt64 reserved3;
+    UInt64 reserved4;
+} __attribute__((packed)) iSCSIPDUNOPOutBHS;
+
+/*! Basic header segment for a NOP in PDU. */
+typedef struct __iSCSIPDUNOPInBHS {
+    const UInt8 opCode;
+    UInt8 reserved;
+    UInt16 reserved2;
+    UInt8 totalAHSLength;
+    UInt8 dataSegmentLength[kiSCSIPDUDataSegmentLengthSize];
+    UInt64 LUN;
+    UInt32 initiatorTaskTag;
+    UInt32 targetTransferTag;
+    UInt32 statSN;
+    UInt32 expCmdSN;
+    UInt32 maxCmdSN;
+    UInt32 reserved3;
+    UInt64 reserved4;
+} __attribute__((packed)) iSCSIPDUNOPInBHS;
+
+iSCSIPDUAssertBHSSize(iSCSIPDULoginReqBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDULoginRspBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDULogoutReqBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDULogoutRspBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDUTextReqBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDUTextRspBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDUNOPOutBHS);
+iSCSIPDUAssertBHSSize(iSCSIPDUNOPInBHS);
+
 /*! Default initialization for a logout request PDU. */
 extern const iSCSIPDULogoutReqBHS iSCSIPDULogoutReqBHSInit;
 
@@ -151,6 +201,9 @@ extern const iSCSIPDULoginReqBHS iSCSIPDULoginReqBHSInit;
 /*! Default initialization for a text request PDU. */
 extern const iSCSIPDUTextReqBHS iSCSIPDUTextReqBHSInit;
 
+/*! Default initialization for a NOP out PDU. */
+extern const iSCSIPDUNOPOutBHS iSCSIPDUNOPOutBHSInit;
+
 
 /*! Possible stages of the login process, used with login BHS. */
 enum iSCSIPDULoginStages {
@@ -263,12 +316,59 @@ extern const unsigned short kiSCSIPDUTextReqContinueFlag;
  *  @return the value of the data segment length. */
 static inline size_t iSCSIPDUGetDataSegmentLength(iSCSIPDUCommonBHS * bhs)
 {
-    UInt32 length = 0;
-    memcpy(&length,bhs->dataSegmentLength,kiSCSIPDUDataSegmentLengthSize);
-    length = CFSwapInt32BigToHost(length<<8);
-    return length;
+    return iSCSIPDUCommonBHSGetDataSegmentLength(bhs);
 }
 
+/*! Builds the data segment of a login or text request PDU.  Key-value pairs
+ *  are encoded as UTF-8 directly into a single growable buffer in the order
+ *  they are appended (duplicate keys are permitted).  The buffer is always
+ *  sized to a multiple of kiSCSIPDUByteAlignment with zeroed padding. */
+typedef struct __iSCSIPDUTextBuilder {
+    
+    /*! The data segment being built. */
+    UInt8 * data;
+    
+    /*! The number of bytes written to the data segment. */
+    size_t length;
+    
+    /*! The number of bytes allocated for the data segment. */
+    size_t capacity;
+    
+    /*! The first error encountered while appending (if any). */
+    errno_t error;
+    
+} iSCSIPDUTextBuilder;
+
+/*! Default initialization for a text builder. */
+extern const iSCSIPDUTextBuilder iSCSIPDUTextBuilderInit;
+
+/*! Appends a key-value pair to a text builder.
+ *  @param builder the text builder.
+ *  @param key the key to append.
+ *  @param value the value to append. */
+void iSCSIPDUTextBuilderAppendPair(iSCSIPDUTextBuilder * builder,CFStringRef key,CFStringRef value);
+
+/*! Appends a key-value pair given as null-terminated UTF-8 strings to a
+ *  text builder.
+ *  @param builder the text builder.
+ *  @param key the key to append.
+ *  @param value the value to append. */
+void iSCSIPDUTextBuilderAppendCStrings(iSCSIPDUTextBuilder * builder,const char * key,const char * value);
+
+/*! Appends the key-value pairs of a dictionary to a text builder.
+ *  @param builder the text builder.
+ *  @param textDict a dictionary of key-value pairs. */
+void iSCSIPDUTextBuilderAppendDict(iSCSIPDUTextBuilder * builder,CFDictionaryRef textDict);
+
+/*! Completes a text builder, transferring ownership of the data segment to
+ *  the caller (release it using iSCSIPDUDataRelease).  If an error occurred
+ *  while appending, the data segment is released instead.
+ *  @param builder the text builder.
+ *  @param data a pointer to a pointer the data, returned by this function.
+ *  @param length the length of the data segment, returned by this function.
+ *  @return an error code indicating the result of the operation. */
+errno_t iSCSIPDUTextBuilderFinish(iSCSIPDUTextBuilder * builder,void * * data,size_t * length);
+
 /*! Creates a PDU data segment consisting of key-value pairs from a dictionary.
  *  @param textDict the user-specified dictionary to use.
  *  @param data a pointer to a pointer the data, returned by this function.
@@ -298,6 +398,96 @@ void iSCSIPDUDataParseToDict(void * data,size_t length,CFMutableDictionaryRef te
 void iSCSIPDUDataParseToArrays(void * data,size_t length,CFMutableArrayRef keys,CFMutableArrayRef values);
 
 
+/*! A key-value pair within a PDU data segment.  The key and value refer to
+ *  bytes of the data segment (they are not copied and are not
+ *  null-terminated), so a pair is only valid while the data segment is. */
+typedef struct __iSCSIPDUTextPair {
+    
+    /*! The first byte of the key. */
+    const UInt8 * key;
+    
+    /*! The length of the key, in bytes. */
+    size_t keyLength;
+    
+    /*! The first byte of the value. */
+    const UInt8 * value;
+    
+    /*! The length of the value, in bytes. */
+    size_t valueLength;
+    
+} iSCSIPDUTextPair;
+
+/*! Gets the next key-value pair from a PDU data segment without allocating
+ *  memory.  Padding and entries that lack a '=' are skipped.  A trailing
+ *  pair that is not null-terminated is incomplete and is not returned.
+ *  @param data the data segment (from a PDU) to parse.
+ *  @param length the length of the data segment.
+ *  @param offset on input, the offset at which to start searching; on
+ *  output, the offset that follows the pair that was returned (or the
+ *  offset of the incomplete pair if none was returned).
+ *  @param pair the key-value pair that was found.
+ *  @return true if a key-value pair was found. */
+Boolean iSCSIPDUDataGetNextTextPair(const void * data,size_t length,
+                                    size_t * offset,
+                                    iSCSIPDUTextPair * pair);
+
+/*! Compares the key of a key-value pair to a string.
+ *  @param pair the key-value pair.
+ *  @param key a null-terminated key.
+ *  @return true if the keys are equal. */
+static inline Boolean iSCSIPDUTextPairKeyEquals(const iSCSIPDUTextPair * pair,const char * key)
+{
+    return strlen(key) == pair->keyLength && memcmp(pair->key,key,pair->keyLength) == 0;
+}
+
+/*! Maximum length of a key-value pair that may be split across text
+ *  response PDUs, including the separator and null terminator (RFC3720
+ *  limits keys to 63 bytes and values to 8192). */
+extern const size_t kiSCSIPDUTextAssemblerMaxPairLength;
+
+/*! Assembles the key-value pairs of a text response that spans several
+ *  PDUs.  Complete pairs are handed to a callback directly from each data
+ *  segment; only a pair split across two data segments is copied, so memory
+ *  use is bounded by kiSCSIPDUTextAssemblerMaxPairLength regardless of the
+ *  size of the response. */
+typedef struct __iSCSIPDUTextAssembler {
+    
+    /*! Buffer holding the incomplete pair at the end of the previous
+     *  data segment (allocated on demand). */
+    UInt8 * partial;
+    
+    /*! The number of bytes held in the partial buffer. */
+    size_t partialLength;
+    
+} iSCSIPDUTextAssembler;
+
+/*! Default initialization for a text assembler. */
+extern const iSCSIPDUTextAssembler iSCSIPDUTextAssemblerInit;
+
+/*! Callback used by the text assembler for each complete key-value pair.
+ *  The pair is only valid for the duration of the callback. */
+typedef void (*iSCSIPDUTextPairCallback)(void * context,const iSCSIPDUTextPair * pair);
+
+/*! Appends the data segment of a text response PDU to an assembler,
+ *  invoking a callback for each key-value pair completed by the segment.
+ *  @param assembler the text assembler.
+ *  @param data the data segment (from a PDU) to parse.
+ *  @param length the length of the data segment.
+ *  @param callback a user-specified function called for each pair.
+ *  @param context a user-specified context passed to the callback.
+ *  @return an error code indicating the result of the operation; EMSGSIZE
+ *  if a pair exceeds kiSCSIPDUTextAssemblerMaxPairLength. */
+errno_t iSCSIPDUTextAssemblerAppend(iSCSIPDUTextAssembler * assembler,
+                                    const void * data,size_t length,
+                                    iSCSIPDUTextPairCallback callback,
+                                    void * context);
+
+/*! Releases the resources held by a text assembler.
+ *  @param assembler the text assembler.
+ *  @return an error code indicating the result of the operation; EINVAL
+ *  if the response ended with an incomplete pair. */
+errno_t iSCSIPDUTextAssemblerFinish(iSCSIPDUTextAssembler * assembler);
+
 /*! Parses key-value pairs using a user-specified function.
  *  @param data the data segmetn (from a PDU) to parse.
  *  @param length the length of the data segment.
@@ -29,11 +29,64 @@
 #include "iSCSIQueryTarget.h"
 #include "iSCSIHBAInterface.h"
 
-errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
-                                     enum iSCSILoginStatusCode * statusCode,
-                                     enum iSCSIPDURejectCode * rejectCode,
-                                     CFDictionaryRef   textCmd,
-                                     CFMutableDictionaryRef  textRsp)
+/*! Maximum number of NOP in PDUs (target probes) answered while waiting for
+ *  the response to a NOP out in iSCSISessionNOPExchange(). */
+static const unsigned int kiSCSISessionMaxNOPInProbes = 8;
+
+/*! Callback used to place key-value pairs received from the target into
+ *  a dictionary (the context); pairs are discarded if the context is NULL. */
+static void iSCSISessionParseToDictCallback(void * context,const iSCSIPDUTextPair * pair)
+{
+    if(!context)
+        return;
+    
+    CFStringRef key = CFStringCreateWithBytes(kCFAllocatorDefault,pair->key,pair->keyLength,
+                                              kCFStringEncodingUTF8,false);
+    CFStringRef value = CFStringCreateWithBytes(kCFAllocatorDefault,pair->value,pair->valueLength,
+                                                kCFStringEncodingUTF8,false);
+    
+    if(key && value)
+        CFDictionaryAddValue((CFMutableDictionaryRef)context,key,value);
+    
+    if(key)
+        CFRelease(key);
+    
+    if(value)
+        CFRelease(value);
+}
+
+/*! Answers a NOP in PDU that the target sent to probe the connection (one
+ *  that carries a valid target transfer tag); the ping data is echoed back.
+ *  @param interface the HBA interface.
+ *  @param sessionId the session identifier.
+ *  @param connectionId a connection identifier.
+ *  @param ping the NOP in basic header segment received from the target.
+ *  @param data the data segment of the NOP in PDU.
+ *  @param length the length of the data segment.
+ *  @return an error code that indicates the result of the operation. */
+static errno_t iSCSISessionAnswerNOPIn(iSCSIHBAInterfaceRef interface,
+                                       SessionIdentifier sessionId,
+                                       ConnectionIdentifier connectionId,
+                                       const iSCSIPDUNOPInBHS * ping,
+                                       void * data,
+                                       size_t length)
+{
+    iSCSIPDUNOPOutBHS cmd = iSCSIPDUNOPOutBHSInit;
+    cmd.LUN = ping->LUN;
+    cmd.initiatorTaskTag = kiSCSIPDUInitiatorTaskTagReserved;
+    cmd.targetTransferTag = ping->targetTransferTag;
+    
+    return iSCSIHBAInterfaceSend(interface,sessionId,connectionId,
+                                 (iSCSIPDUInitiatorBHS *)&cmd,data,length);
+}
+
+static errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
+                                            enum iSCSILoginStatusCode * statusCode,
+                                            enum iSCSIPDURejectCode * rejectCode,
+                                            const void * data,
+                                            size_t length,
+                                            iSCSIPDUTextPairCallback callback,
+                                            void * callbackContext)
 {
     // Create a new login request basic header segment
     iSCSIPDULoginReqBHS cmd = iSCSIPDULoginReqBHSInit;
@@ -47,29 +100,24 @@ errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
     if(context->currentStage != context->nextStage)
         cmd.loginStage |= kiSCSIPDULoginTransitFlag;
     
-    // Create a data segment based on text commands (key-value pairs)
-    void * data = NULL;
-    size_t length = 0;
-    iSCSIPDUDataCreateFromDict(textCmd,&data,&length);
-
     errno_t error = iSCSIHBAInterfaceSend(context->interface,context->sessionId,context->connectionId,
-                                          (iSCSIPDUInitiatorBHS *)&cmd,data,length);
-    iSCSIPDUDataRelease(&data);
-    
+                                          (iSCSIPDUInitiatorBHS *)&cmd,(void *)data,length);
     if(error) {
         return error;
     }
     
-    // Get response from iSCSI portal, continue until response is complete
+    // Get response from iSCSI portal, continue until response is complete;
+    // key-value pairs may be split across response PDUs
+    iSCSIPDUTextAssembler assembler = iSCSIPDUTextAssemblerInit;
     iSCSIPDULoginRspBHS rsp;
+    void * rspData = NULL;
+    size_t rspLength = 0;
     
-    do {
+    while(true)
+    {
         if((error = iSCSIHBAInterfaceReceive(context->interface,context->sessionId,context->connectionId,
-                                             (iSCSIPDUTargetBHS *)&rsp,&data,&length)))
-        {
-            iSCSIPDUDataRelease(&data);
-            return error;
-        }
+                                             (iSCSIPDUTargetBHS *)&rsp,&rspData,&rspLength)))
+            break;
         
         if(rsp.opCode == kiSCSIPDUOpCodeLoginRsp)
         {
@@ -80,7 +128,8 @@ errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
             if(*statusCode != kiSCSILoginSuccess)
                 break;
             
-            iSCSIPDUDataParseToDict(data,length,textRsp);
+            if((error = iSCSIPDUTextAssemblerAppend(&assembler,rspData,rspLength,callback,callbackContext)))
+                break;
             
             // Save & return the TSIH if this is the leading login
             if(context->targetSessionId == 0 && context->nextStage == kiSCSIPDUFullFeaturePhase) {
@@ -99,13 +148,77 @@ errno_t iSCSISessionLoginSingleQuery(struct iSCSILoginQueryContext * context,
             error = EOPNOTSUPP;
             break;
         }
+        
+        // The continue bit is only meaningful in a login response
+        if(rsp.opCode != kiSCSIPDUOpCodeLoginRsp || !(rsp.loginStage & kiSCSIPDULoginContinueFlag))
+            break;
+        
+        // The target has more to send; per RFC3720 an empty login request
+        // for the current stage, without the transit bit (and with the
+        // same TSIH, CID and ISID as the request), asks for it
+        iSCSIPDUDataRelease(&rspData);
+        
+        cmd.loginStage = (context->currentStage << kiSCSIPDULoginCSGBitOffset);
+        
+        if((error = iSCSIHBAInterfaceSend(context->interface,context->sessionId,context->connectionId,
+                                          (iSCSIPDUInitiatorBHS *)&cmd,NULL,0)))
+            break;
     }
-    while(rsp.loginStage & kiSCSIPDUTextReqContinueFlag);
     
-    iSCSIPDUDataRelease(&data);
+    iSCSIPDUDataRelease(&rspData);
+    
+    errno_t finishError = iSCSIPDUTextAssemblerFinish(&assembler);
+    
+    if(!error && *statusCode == kiSCSILoginSuccess)
+        error = finishError;
+    
     return error;
 }
 
+errno_t iSCSISessionLoginTextQuery(struct iSCSILoginQueryContext * context,
+                                   enum iSCSILoginStatusCode * statusCode,
+                                   enum iSCSIPDURejectCode * rejectCode,
+                                   const void * data,
+                                   size_t length,
+                                   iSCSIPDUTextPairCallback callback,
+                                   void * callbackContext)
+{
+    // Try a single query first
+    errno_t error = iSCSISessionLoginSingleQuery(context,statusCode,rejectCode,data,length,
+                                                 callback,callbackContext);
+    
+    // If error occured, do nothing
+    if(error || *statusCode != kiSCSILoginSuccess)
+        return error;
+    
+    // If we are not transitioning stages, or we are and the target agreed to
+    // transition, then we can move on...
+    if(context->currentStage == context->nextStage || context->transitNextStage)
+        return error;
+
+    // If we were expecting the target to advance to the next stage; make sure
+    // it agrees.  If it does not, we need to send login queries until it does
+    // (with a maximum count specified below).  See RFC3720 at Section 5.4.
+    CFIndex maxRetryCount = 5;
+    CFIndex retryCount = 0;
+    
+    for(retryCount = 0; retryCount < maxRetryCount; retryCount++)
+    {
+        // Retries are blank, to get target to advance (per RFC3720)
+        error = iSCSISessionLoginSingleQuery(context,statusCode,rejectCode,NULL,0,
+                                             callback,callbackContext);
+        
+        if(error || *statusCode != kiSCSILoginSuccess || context->transitNextStage)
+            break;
+    }
+    
+    // If the target refuses to advance after max. retry count,
+    // set an iSCSI error and quit
+    if(!error && retryCount == maxRetryCount)
+        *statusCode = kiSCSILoginInvalidReqDuringLogin;
+    
+    return error;
+}
 
 /*! Helper function used throughout the login process to query the target.
  *  This function will take a dictionary of key-value pairs and send the
@@ -129,37 +242,93 @@ errno_t iSCSISessionLoginQuery(struct iSCSILoginQueryContext * context,
                                CFDictionaryRef   textCmd,
                                CFMutableDictionaryRef  textRsp)
 {
-    // Try a single query first
-    errno_t error = iSCSISessionLoginSingleQuery(context,statusCode,rejectCode,textCmd,textRsp);
+    // Create a data segment based on text commands (key-value pairs)
+    void * data = NULL;
+    size_t length = 0;
+    iSCSIPDUDataCreateFromDict(textCmd,&data,&length);
     
-    // If error occured, do nothing
-    if(error || *statusCode != kiSCSILoginSuccess)
-        return error;
+    errno_t error = iSCSISessionLoginTextQuery(context,statusCode,rejectCode,data,length,
+                                               &iSCSISessionParseToDictCallback,textRsp);
+    iSCSIPDUDataRelease(&data);
     
-    // If we are not transitioning stages, or we are and the target agreed to
-    // transition, then we can move on...
-    if(context->currentStage == context->nextStage || context->transitNextStage)
-        return error;
+    return error;
+}
 
-    // If we were expecting the target to advance to the next stage; make sure
-    // it agrees.  If it does not, we need to send login queries until it does
-    // (with a maximum count specified below).  See RFC3720 at Section 5.4.
-    CFIndex maxRetryCount = 5;
-    CFIndex retryCount = 0;
+errno_t iSCSISessionTextExchange(iSCSIHBAInterfaceRef interface,
+                                 SessionIdentifier sessionId,
+                                 ConnectionIdentifier connectionId,
+                                 const void * data,
+                                 size_t length,
+                                 iSCSIPDUTextPairCallback callback,
+                                 void * context)
+{
+    // Create a new text request basic header segment; the request is
+    // complete so the final bit is set
+    iSCSIPDUTextReqBHS cmd = iSCSIPDUTextReqBHSInit;
+    cmd.textReqStageFlags = kiSCSIPDUTextReqFinalFlag;
+    cmd.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
     
-    for(retryCount = 0; retryCount < maxRetryCount; retryCount++)
+    errno_t error = iSCSIHBAInterfaceSend(interface,sessionId,connectionId,
+                                          (iSCSIPDUInitiatorBHS *)&cmd,(void *)data,length);
+    if(error)
+        return error;
+    
+    // Get response from iSCSI portal, continue until response is complete
+    iSCSIPDUTextAssembler assembler = iSCSIPDUTextAssemblerInit;
+    iSCSIPDUTextRspBHS rsp;
+    void * rspData = NULL;
+    size_t rspLength = 0;
+    
+    while(true)
     {
-        // Retries are blank, to get target to advance (per RFC3720)
-        error = iSCSISessionLoginSingleQuery(context,statusCode,rejectCode,NULL,NULL);
+        if((error = iSCSIHBAInterfaceReceive(interface,sessionId,connectionId,
+                                             (iSCSIPDUTargetBHS *)&rsp,&rspData,&rspLength)))
+            break;
+        
+        // The target may probe an idle connection (e.g., a discovery session
+        // kept open between queries) before it answers the request
+        iSCSIPDUNOPInBHS * ping = (iSCSIPDUNOPInBHS *)&rsp;
+        
+        if(rsp.opCode == kiSCSIPDUOpCodeNOPIn && ping->targetTransferTag != kiSCSIPDUTargetTransferTagReserved)
+        {
+            error = iSCSISessionAnswerNOPIn(interface,sessionId,connectionId,ping,rspData,rspLength);
+            iSCSIPDUDataRelease(&rspData);
+            
+            if(error)
+                break;
+            continue;
+        }
+        
+        // For this case some other kind of PDU or invalid data was received
+        if(rsp.opCode != kiSCSIPDUOpCodeTextRsp)
+        {
+            error = EINVAL;
+            break;
+        }
+        
+        error = iSCSIPDUTextAssemblerAppend(&assembler,rspData,rspLength,callback,context);
+        iSCSIPDUDataRelease(&rspData);
+        
+        if(error || (rsp.textReqStageBits & kiSCSIPDUTextReqFinalFlag))
+            break;
+        
+        // The target has more to send; per RFC3720 an empty text request
+        // carrying the target transfer tag asks for the next part
+        cmd = iSCSIPDUTextReqBHSInit;
+        cmd.textReqStageFlags = kiSCSIPDUTextReqFinalFlag;
+        cmd.targetTransferTag = rsp.targetTransferTag;
         
-        if(context->transitNextStage)
+        if((error = iSCSIHBAInterfaceSend(interface,sessionId,connectionId,
+                                          (iSCSIPDUInitiatorBHS *)&cmd,NULL,0)))
             break;
     }
     
-    // If the target refuses to advance after max. retry count,
-    // set an iSCSI error and quit
-    if(retryCount == maxRetryCount)
-        *statusCode = kiSCSILoginInvalidReqDuringLogin;
+    iSCSIPDUDataRelease(&rspData);
+    
+    errno_t finishError = iSCSIPDUTextAssemblerFinish(&assembler);
+    
+    if(!error)
+        error = finishError;
     
     return error;
 }
@@ -172,58 +341,95 @@ errno_t iSCSISessionLoginQuery(struct iSCSILoginQueryContext * context,
  *  pairs received as a dictionary.  If an error occurs, this function will
  *  parse the iSCSI error and express it in terms of a system errno_t as
  *  the system would treat any other device.
+ *  @param interface the HBA interface.
  *  @param sessionId the session identifier.
  *  @param connectionId a connection identifier.
  *  @param textCmd a dictionary of key-value pairs to send.
  *  @param textRsp a dictionary of key-value pairs to receive.
  *  @return an error code that indicates the result of the operation. */
-errno_t iSCSISessionTextQuery(SessionIdentifier sessionId,
+errno_t iSCSISessionTextQuery(iSCSIHBAInterfaceRef interface,
+                              SessionIdentifier sessionId,
                               ConnectionIdentifier connectionId,
                               CFDictionaryRef   textCmd,
                               CFMutableDictionaryRef  textRsp)
 {
-    // Create a new login request basic header segment
-    iSCSIPDUTextReqBHS cmd = iSCSIPDUTextReqBHSInit;
-    cmd.textReqStageFlags = 0;
+    if(!textRsp)
+        return EINVAL;
     
     // Create a data segment based on text commands (key-value pairs)
-    void * data;
-    size_t length;
+    void * data = NULL;
+    size_t length = 0;
     iSCSIPDUDataCreateFromDict(textCmd,&data,&length);
     
-    errno_t error = iSCSIHBAInterfaceSend(0,sessionId,
-                                    connectionId,
-                                    (iSCSIPDUInitiatorBHS *)&cmd,
-                                    data,length);
+    errno_t error = iSCSISessionTextExchange(interface,sessionId,connectionId,data,length,
+                                             &iSCSISessionParseToDictCallback,textRsp);
     iSCSIPDUDataRelease(&data);
     
-    if(error) {
+    return error;
+}
+
+/*! Helper function used during the full feature phase of a connection to
+ *  verify that the connection (and the target) is still responsive.  A NOP
+ *  out PDU is sent and the matching NOP in PDU is awaited; NOP in PDUs with
+ *  which the target probes the connection are answered in the meantime, up
+ *  to kiSCSISessionMaxNOPInProbes of them.
+ *  @param interface the HBA interface.
+ *  @param sessionId the session identifier.
+ *  @param connectionId a connection identifier.
+ *  @return an error code that indicates the result of the operation. */
+errno_t iSCSISessionNOPExchange(iSCSIHBAInterfaceRef interface,
+                                SessionIdentifier sessionId,
+                                ConnectionIdentifier connectionId)
+{
+    // Ask the target to respond (target transfer tag is reserved and the
+    // initiator task tag is valid)
+    iSCSIPDUNOPOutBHS cmd = iSCSIPDUNOPOutBHSInit;
+    cmd.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
+    
+    errno_t error = iSCSIHBAInterfaceSend(interface,sessionId,connectionId,
+                                          (iSCSIPDUInitiatorBHS *)&cmd,NULL,0);
+    if(error)
         return error;
-    }
     
-    // Get response from iSCSI portal, continue until response is complete
-    iSCSIPDUTextRspBHS rsp;
+    iSCSIPDUNOPInBHS rsp;
+    void * rspData = NULL;
+    size_t rspLength = 0;
+    unsigned int probes = 0;
     
-    do {
-        if((error = iSCSIHBAInterfaceReceive(0,sessionId,connectionId,
-                                    (iSCSIPDUTargetBHS *)&rsp,&data,&length)))
+    while(true)
+    {
+        if((error = iSCSIHBAInterfaceReceive(interface,sessionId,connectionId,
+                                             (iSCSIPDUTargetBHS *)&rsp,&rspData,&rspLength)))
+            break;
+        
+        // Some other kind of PDU (e.g., an asynchronous message asking us
+        // to logout, or a reject) was received
+        if(rsp.opCode != kiSCSIPDUOpCodeNOPIn)
         {
-            iSCSIPDUDataRelease(&data);
-            return error;
+            error = EINVAL;
+            break;
         }
         
-        if(rsp.opCode == kiSCSIPDUOpCodeTextRsp)
-            iSCSIPDUDataParseToDict(data,length,textRsp);
+        // Response to our NOP out
+        if(rsp.targetTransferTag == kiSCSIPDUTargetTransferTagReserved)
+            break;
         
-        // For this case some other kind of PDU or invalid data was received
-        else if(rsp.opCode == kiSCSIPDUOpCodeReject)
+        // The target is probing the connection; give up if it keeps doing
+        // so instead of responding
+        if(++probes > kiSCSISessionMaxNOPInProbes)
         {
-            error = EIO;
+            error = ETIMEDOUT;
             break;
         }
+        
+        error = iSCSISessionAnswerNOPIn(interface,sessionId,connectionId,&rsp,rspData,rspLength);
+        iSCSIPDUDataRelease(&rspData);
+        
+        if(error)
+            break;
     }
-    while(rsp.textReqStageBits & kiSCSIPDUTextReqContinueFlag);
     
-    iSCSIPDUDataRelease(&data);
+    iSCSIPDUDataRelease(&rspData);
+    
     return error;
-}
\ No newline at end of file
+}
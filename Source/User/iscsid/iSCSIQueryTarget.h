@@ -69,6 +69,27 @@ struct iSCSILoginQueryContext {
     bool transitNextStage;
 };
 
+/*! Helper function used throughout the login process to query the target.
+ *  This function behaves like iSCSISessionLoginQuery, except that the
+ *  key-value pairs to send are given as an encoded data segment and the
+ *  key-value pairs received are handed to a callback (in place, without
+ *  creating strings) as each is parsed from the login responses.
+ *  @param context the context to query (session identifier, etc)
+ *  @param statusCode the iSCSI status code returned by the target
+ *  @param rejectCode the iSCSI reject code, if the command was rejected
+ *  @param data the data segment to send (may be NULL).
+ *  @param length the length of the data segment.
+ *  @param callback a user-specified function called for each pair received.
+ *  @param callbackContext a user-specified context passed to the callback.
+ *  @return an error code that indicates the result of the operation. */
+errno_t iSCSISessionLoginTextQuery(struct iSCSILoginQueryContext * context,
+                                   enum iSCSILoginStatusCode * statusCode,
+                                   enum iSCSIPDURejectCode * rejectCode,
+                                   const void * data,
+                                   size_t length,
+                                   iSCSIPDUTextPairCallback callback,
+                                   void * callbackContext);
+
 /*! Helper function used throughout the login process to query the target.
  *  This function will take a dictionary of key-value pairs and send the
  *  appropriate login PDU to the target.  It will then receive one or more
@@ -92,6 +113,29 @@ errno_t iSCSISessionLoginQuery(struct iSCSILoginQueryContext * context,
                                CFMutableDictionaryRef  textRsp);
 
 
+/*! Helper function used during the full feature phase of a connection to
+ *  send a text request and stream the text response back.  The data segment
+ *  is sent in a single text request PDU.  The target may split its response
+ *  across several text response PDUs; these are requested automatically
+ *  (using the target transfer tag of each partial response) and each
+ *  key-value pair is handed to the callback as soon as it is complete, even
+ *  if it spans two PDUs.  The response is never buffered as a whole.
+ *  @param interface the HBA interface.
+ *  @param sessionId the session identifier.
+ *  @param connectionId a connection identifier.
+ *  @param data the data segment of the text request.
+ *  @param length the length of the data segment.
+ *  @param callback a user-specified function called for each pair.
+ *  @param context a user-specified context passed to the callback.
+ *  @return an error code that indicates the result of the operation. */
+errno_t iSCSISessionTextExchange(iSCSIHBAInterfaceRef interface,
+                                 SessionIdentifier sessionId,
+                                 ConnectionIdentifier connectionId,
+                                 const void * data,
+                                 size_t length,
+                                 iSCSIPDUTextPairCallback callback,
+                                 void * context);
+
 /*! Helper function used during the full feature phase of a connection to
  *  send and receive text requests and responses.
  *  This function will take a dictionary of key-value pairs and send the
@@ -100,15 +144,28 @@ errno_t iSCSISessionLoginQuery(struct iSCSILoginQueryContext * context,
  *  pairs received as a dictionary.  If an error occurs, this function will
  *  parse the iSCSI error and express it in terms of a system errno_t as
  *  the system would treat any other device.
+ *  @param interface the HBA interface.
  *  @param sessionId the session identifier.
  *  @param connectionId a connection identifier.
  *  @param textCmd a dictionary of key-value pairs to send.
  *  @param textRsp a dictionary of key-value pairs to receive.
  *  @return an error code that indicates the result of the operation. */
-errno_t iSCSISessionTextQuery(SessionIdentifier sessionId,
+errno_t iSCSISessionTextQuery(iSCSIHBAInterfaceRef interface,
+                              SessionIdentifier sessionId,
                               ConnectionIdentifier connectionId,
                               CFDictionaryRef   textCmd,
                               CFMutableDictionaryRef  textRsp);
 
+/*! Helper function used during the full feature phase of a connection to
+ *  verify that the connection (and the target) is still responsive.  A NOP
+ *  out PDU is sent and the matching NOP in PDU is awaited; NOP in PDUs with
+ *  which the target probes the connection are answered in the meantime.
+ *  @param interface the HBA interface.
+ *  @param sessionId the session identifier.
+ *  @param connectionId a connection identifier.
+ *  @return an error code that indicates the result of the operation. */
+errno_t iSCSISessionNOPExchange(iSCSIHBAInterfaceRef interface,
+                                SessionIdentifier sessionId,
+                                ConnectionIdentifier connectionId);
 
 #endif /* defined(__ISCSI_QUERY_TARGET_H__) */
@@ -32,6 +32,7 @@
 #include "iSCSIHBAInterface.h"
 #include "iSCSIAuth.h"
 #include "iSCSIQueryTarget.h"
+#include "iSCSINegotiation.h"
 
 #include "iSCSI.h"
 
@@ -39,486 +40,117 @@
  *  to produce the data section of text and login PDUs. */
 const unsigned int kiSCSISessionMaxTextKeyValuePairs = 100;
 
-/*! Helper function used during session negotiation.  Returns true if BOTH
- *  the command and the response strings are "Yes" */
-Boolean iSCSILVGetEqual(CFStringRef cmdStr,CFStringRef rspStr)
-{
-    if(CFStringCompare(cmdStr,rspStr,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
-        return true;
-
-    return false;
-}
-
-/*! Helper function used during session negotiation.  Returns true if BOTH
- *  the command and the response strings are "Yes" */
-Boolean iSCSILVGetAnd(CFStringRef cmdStr,CFStringRef rspStr)
-{
-    CFComparisonResult cmd, rsp;
-    cmd = CFStringCompare(cmdStr,kRFC3720_Value_Yes,kCFCompareCaseInsensitive);
-    rsp = CFStringCompare(rspStr,kRFC3720_Value_Yes,kCFCompareCaseInsensitive);
-    
-    if(cmd == kCFCompareEqualTo && rsp == kCFCompareEqualTo)
-        return true;
-    
-    return false;
-}
-
-/*! Helper function used during session negotiation.  Returns true if either
- *  one of the command or response strings are "Yes" */
-Boolean iSCSILVGetOr(CFStringRef cmdStr,CFStringRef rspStr)
-{
-    if(CFStringCompare(cmdStr,kRFC3720_Value_Yes,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
-        return true;
-    
-    if(CFStringCompare(rspStr,kRFC3720_Value_Yes,kCFCompareCaseInsensitive) == kCFCompareEqualTo)
-        return true;
-    
-    return false;
-}
-
-/*! Helper function used during session negotiation.  Converts values in 
- *  the command and response strings to numbers and returns the minimum. */
-UInt32 iSCSILVGetMin(CFStringRef cmdStr, CFStringRef rspStr)
-{
-    // Convert string to unsigned integers
-    UInt32 cmdInt = (UInt32)CFStringGetIntValue(cmdStr);
-    UInt32 rspInt = (UInt32)CFStringGetIntValue(rspStr);
-    
-    // Compare & return minimum
-    if(cmdInt < rspInt)
-        return cmdInt;
-    return rspInt;
-}
-
-/*! Helper function used during session negotiation.  Converts values in
- *  the command and response strings to numbers and returns the minimum. */
-UInt32 iSCSILVGetMax(CFStringRef cmdStr, CFStringRef rspStr)
-{
-    // Convert string to unsigned integers
-    UInt32 cmdInt = (UInt32)CFStringGetIntValue(cmdStr);
-    UInt32 rspInt = (UInt32)CFStringGetIntValue(rspStr);
-    
-    // Compare & return minimum
-    if(cmdInt > rspInt)
-        return cmdInt;
-    return rspInt;
-}
-
-/*! Helper function used during session negotiation.  Checks range of
- *  a particular value associated with a given key. */
-Boolean iSCSILVRangeInvalid(UInt32 value,UInt32 min, UInt32 max)
-{
-    return (value < min || value > max);
-}
-
-/*! Helper function used by iSCSINegotiateSession to build a dictionary
- *  of session options (key-value pairs) that will be sent to the target.
- *  @param sessCfg a session configuration object.
- *  @param sessCmd a dictionary of key-value pairs used to negotiate session
- *  parameters during the iSCSI operational login negotiation. */
-void iSCSINegotiateBuildSWDictNormal(iSCSISessionConfigRef sessCfg,
-                                     CFMutableDictionaryRef sessCmd)
-{
-    CFStringRef value;
-    
-    // If the maximum number of connections was specified in the target,
-    // use it.  Else default to RFC3720 value
-    UInt32 maxConnections = iSCSISessionConfigGetMaxConnections(sessCfg);
-    
-    if(maxConnections == 0)
-        value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxConnections);
-    else
-        value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),maxConnections);
-    
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxConnections,value);
-    CFRelease(value);
-    
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_InitialR2T,kRFC3720_Value_Yes);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_ImmediateData,kRFC3720_Value_Yes);
-    
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxBurstLength);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxBurstLength,value);
-    CFRelease(value);
-    
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_FirstBurstLength);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_FirstBurstLength,value);
-    CFRelease(value);
-    
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxOutstandingR2T);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_MaxOutstandingR2T,value);
-    CFRelease(value);
-    
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_DataPDUInOrder,kRFC3720_Value_Yes);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_DataSequenceInOrder,kRFC3720_Value_Yes);
-}
-
-/*! Helper function used by iSCSINegotiateSession to build a dictionary
- *  of session options (key-value pairs) that will be sent to the target.
- *  @param sessCfg a session configuration object.
- *  @param sessCmd a dictionary of key-value pairs used to negotiate session
- *  parameters during the iSCSI operational login negotiation. */
-void iSCSINegotiateBuildSWDictCommon(iSCSISessionConfigRef sessCfg,
-                                     CFMutableDictionaryRef sessCmd)
-{
-    CFStringRef value;
-    
-    // Add key-value pair for time to retain and time to wait
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_DefaultTime2Wait);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_DefaultTime2Wait,value);
-    CFRelease(value);
-    
-    value = CFStringCreateWithFormat(kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_DefaultTime2Retain);
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_DefaultTime2Retain,value);
-    CFRelease(value);
-    
-    // Add key-value pair for supported error recovery level.  Use the error
-    // recovery level specified by the target.  If the value was invalid, then
-    // use the RFC3720 default value of session-level instead.
-    enum iSCSIErrorRecoveryLevels errorRecoveryLevel = iSCSISessionConfigGetErrorRecoveryLevel(sessCfg);
-    
-    switch (errorRecoveryLevel) {
-        case kiSCSIErrorRecoverySession:
-            value = kRFC3720_Value_ErrorRecoveryLevelSession;
-            break;
-        case kiSCSIErrorRecoveryDigest:
-            value = kRFC3720_Value_ErrorRecoveryLevelDigest;
-            break;
-        case kiSCSIErrorRecoveryConnection:
-            value = kRFC3720_Value_ErrorRecoveryLevelConnection;
-            break;
-        default:
-            value = kRFC3720_Value_ErrorRecoveryLevelSession;
-            break;
-    }
-    CFDictionaryAddValue(sessCmd,kRFC3720_Key_ErrorRecoveryLevel,value);
-}
-
-errno_t iSCSINegotiateParseSWDictCommon(iSCSISessionManagerRef managerRef,
-                                        SessionIdentifier sessionId,
-                                        CFDictionaryRef sessCmd,
-                                        CFDictionaryRef sessRsp)
-
-{
-    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
-    
-    // Holds target value & comparison result for keys that we'll process
-    CFStringRef targetRsp;
-    
-    // Grab minimum of default time 2 retain
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_DefaultTime2Retain,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_DefaultTime2Retain);
-        UInt32 defaultTime2Retain = CFStringGetIntValue(targetRsp);
-
-        // Range-check value...
-        if(iSCSILVRangeInvalid(defaultTime2Retain,kRFC3720_DefaultTime2Retain_Min,kRFC3720_DefaultTime2Retain_Max))
-            return ENOTSUP;
-        
-        defaultTime2Retain = iSCSILVGetMin(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,
-                                             kiSCSIHBASODefaultTime2Retain,
-                                             &defaultTime2Retain,sizeof(defaultTime2Retain));
-    }
-    else
-        return ENOTSUP;
-    
-    
-    // Grab maximum of default time 2 wait
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_DefaultTime2Wait,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_DefaultTime2Wait);
-        UInt32 defaultTime2Wait = CFStringGetIntValue(targetRsp);
-        
-        // Range-check value...
-        if(iSCSILVRangeInvalid(defaultTime2Wait,kRFC3720_DefaultTime2Wait_Min,kRFC3720_DefaultTime2Wait_Max))
-            return ENOTSUP;
-        
-        defaultTime2Wait = iSCSILVGetMin(initCmd,targetRsp);;
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,
-                                             kiSCSIHBASODefaultTime2Wait,
-                                             &defaultTime2Wait,sizeof(defaultTime2Wait));
-    }
-    else
-        return ENOTSUP;
-
-    // Grab minimum value of error recovery level
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_ErrorRecoveryLevel,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_ErrorRecoveryLevel);
-        UInt8 errorRecoveryLevel = CFStringGetIntValue(targetRsp);
-        
-        // Range-check value...
-        if(iSCSILVRangeInvalid(errorRecoveryLevel,kRFC3720_ErrorRecoveryLevel_Min,kRFC3720_ErrorRecoveryLevel_Max))
-            return ENOTSUP;
-        
-        errorRecoveryLevel = iSCSILVGetMin(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOErrorRecoveryLevel,
-                                 &errorRecoveryLevel,sizeof(errorRecoveryLevel));
-    }
-    else
-        return ENOTSUP;
-    
-    // Success
-    return 0;
-}
-
-errno_t iSCSINegotiateParseSWDictNormal(iSCSISessionManagerRef managerRef,
-                                        SessionIdentifier sessionId,
-                                        CFDictionaryRef sessCmd,
-                                        CFDictionaryRef sessRsp)
-
-{
-    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
-    
-    // Holds target value & comparison result for keys that we'll process
-    CFStringRef targetRsp;
-    
-    // Holds parameters that are used to process other parameters
-    Boolean initialR2T = false, immediateData = false;
-    
-    // Get data digest key and compare to requested value
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_MaxConnections,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_MaxConnections);
-        UInt32 maxConnections = CFStringGetIntValue(targetRsp);
-        
-        // Range-check value...
-        if(iSCSILVRangeInvalid(maxConnections,kRFC3720_MaxConnections_Min,kRFC3720_MaxConnections_Max))
-            return ENOTSUP;
-        
-        maxConnections = iSCSILVGetMin(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxConnections,
-                                             &maxConnections,sizeof(maxConnections));
-    }
-
-    // Grab the OR for initialR2T command and response
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_InitialR2T,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_InitialR2T);
-        initialR2T = iSCSILVGetOr(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOInitialR2T,
-                                             &initialR2T,sizeof(initialR2T));
-    }
-    
-    // Grab the AND for immediate data command and response
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_ImmediateData,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_ImmediateData);
-        immediateData = iSCSILVGetAnd(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOImmediateData,
-                                             &immediateData,sizeof(immediateData));
-    }
-
-    // Get the OR of data PDU in order
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_DataPDUInOrder,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_DataPDUInOrder);
-        Boolean dataPDUInOrder = iSCSILVGetAnd(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASODataPDUInOrder,
-                                 &dataPDUInOrder,sizeof(dataPDUInOrder));
-    }
-    
-    // Get the OR of data PDU in order
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_DataSequenceInOrder,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_DataSequenceInOrder);
-        Boolean dataSequenceInOrder = iSCSILVGetAnd(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASODataSequenceInOrder,
-                                 &dataSequenceInOrder,sizeof(dataSequenceInOrder));
-    }
-
-    // Grab minimum of max burst length
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_MaxBurstLength,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_MaxBurstLength);
-        UInt32 maxBurstLength = iSCSILVGetMin(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxBurstLength,
-                                 &maxBurstLength,sizeof(maxBurstLength));
-    }
-
-    // Grab minimum of first burst length
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_FirstBurstLength,(void*)&targetRsp))
-    {
-        // This parameter is irrelevant when initialR2T = yes and immediateData = no.
-        if(!initialR2T || immediateData) {
-        
-            CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_FirstBurstLength);
-            UInt32 firstBurstLength = CFStringGetIntValue(targetRsp);
-        
-            // Range-check value...
-            if(iSCSILVRangeInvalid(firstBurstLength,kRFC3720_FirstBurstLength_Min,kRFC3720_FirstBurstLength_Max))
-                return ENOTSUP;
-        
-            firstBurstLength = iSCSILVGetMin(initCmd,targetRsp);
-            iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOFirstBurstLength,
-                                                 &firstBurstLength,sizeof(firstBurstLength));
-        }
-    }
-
-    // Grab minimum of max outstanding R2T
-    if(CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_MaxOutstandingR2T,(void*)&targetRsp))
-    {
-        CFStringRef initCmd = CFDictionaryGetValue(sessCmd,kRFC3720_Key_MaxOutstandingR2T);
-        UInt32 maxOutStandingR2T = CFStringGetIntValue(targetRsp);
-        
-        // Range-check value...
-        if(iSCSILVRangeInvalid(maxOutStandingR2T,kRFC3720_MaxOutstandingR2T_Min,kRFC3720_MaxOutstandingR2T_Max))
-            return ENOTSUP;
-        
-        maxOutStandingR2T = iSCSILVGetMin(initCmd,targetRsp);
-        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOMaxOutstandingR2T,
-                                 &maxOutStandingR2T,sizeof(maxOutStandingR2T));
-    }
-    
-    // Success
-    return 0;
-}
-
-/*! Helper function used by iSCSISessionNegotiateCW to build a dictionary
- *  of connection options (key-value pairs) that will be sent to the target.
+/*! Helper function used by iSCSINegotiateSession and
+ *  iSCSINegotiateConnection to offer the connection options specified by a
+ *  connection configuration.
  *  @param connCfg a connection configuration object.
- *  @param connCmd  a dictionary that is populated with key-value pairs that
- *  will be used to negotiate connection parameters. */
-void iSCSINegotiateBuildCWDict(iSCSIConnectionConfigRef connCfg,
-                               CFMutableDictionaryRef connCmd)
+ *  @param negotiation the negotiation to update. */
+static void iSCSINegotiateOfferConnection(iSCSIConnectionConfigRef connCfg,
+                                          iSCSINegotiation * negotiation)
 {
-    // Setup digest options
-    if(iSCSIConnectionConfigGetDataDigest(connCfg))
-        CFDictionaryAddValue(connCmd,kRFC3720_Key_DataDigest,kRFC3720_Value_DataDigestCRC32C);
-    else
-        CFDictionaryAddValue(connCmd,kRFC3720_Key_DataDigest,kRFC3720_Value_DataDigestNone);
-    
-    if(iSCSIConnectionConfigGetHeaderDigest(connCfg))
-        CFDictionaryAddValue(connCmd,kRFC3720_Key_HeaderDigest,kRFC3720_Value_HeaderDigestCRC32C);
-    else
-        CFDictionaryAddValue(connCmd,kRFC3720_Key_HeaderDigest,kRFC3720_Value_HeaderDigestNone);
-    
-    // Setup maximum received data length
-    CFStringRef maxRecvLength = CFStringCreateWithFormat(
-        kCFAllocatorDefault,NULL,CFSTR("%u"),kRFC3720_MaxRecvDataSegmentLength);
+    iSCSINegotiationOffer(negotiation,kiSCSINegotiationKeyDataDigest,
+                          iSCSIConnectionConfigGetDataDigest(connCfg) ? kiSCSINegotiationDigestCRC32C
+                                                                      : kiSCSINegotiationDigestNone);
     
-    CFDictionaryAddValue(connCmd,kRFC3720_Key_MaxRecvDataSegmentLength,maxRecvLength);
-    
-    CFRelease(maxRecvLength);
+    iSCSINegotiationOffer(negotiation,kiSCSINegotiationKeyHeaderDigest,
+                          iSCSIConnectionConfigGetHeaderDigest(connCfg) ? kiSCSINegotiationDigestCRC32C
+                                                                        : kiSCSINegotiationDigestNone);
 }
 
-/*! Helper function used by iSCSISessionNegotiateCW to parse a dictionary
- *  of connection options received from the target.  This function stores
- *  those options with the kernel.
- *  @param sessionId the session qualifier.
- *  @param connCmd a dictionary of connection commands (key-value pairs)
- *  that were sent to the target.
- *  @param connRsp a dictionary of connection respones (key-value pairs)
- *  @param connInfo a connection information object.
- *  @param connCfgKernel a connection options object used to store options with
- *  the iSCSI kernel extension
- *  there were received from the target. */
-errno_t iSCSINegotiateParseCWDict(iSCSISessionManagerRef managerRef,
-                                  SessionIdentifier sessionId,
-                                  ConnectionIdentifier connectionId,
-                                  CFDictionaryRef connCmd,
-                                  CFDictionaryRef connRsp)
-
+/*! Helper function used by iSCSINegotiateSession and
+ *  iSCSINegotiateConnection to exchange the offered options with the target
+ *  and store the outcome with the kernel.
+ *  @param context the login query context.
+ *  @param builder a text builder holding any keys to send ahead of the
+ *  offered options (the builder is finished by this function).
+ *  @param negotiation the negotiation.
+ *  @param statusCode the iSCSI status code returned by the target.
+ *  @return an error code that indicates the result of the operation. */
+static errno_t iSCSINegotiateQuery(struct iSCSILoginQueryContext * context,
+                                   iSCSIPDUTextBuilder * builder,
+                                   iSCSINegotiation * negotiation,
+                                   enum iSCSILoginStatusCode * statusCode)
 {
-    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
-    
-    // Holds target value & comparison result for keys that we'll process
-    CFStringRef targetRsp;
-    
-    // Flag that indicates that target and initiator agree on a parameter
-    Boolean agree = false;
-    
-    // Get data digest key and compare to requested value
-    if(CFDictionaryGetValueIfPresent(connRsp,kRFC3720_Key_DataDigest,(void*)&targetRsp))
-        agree = iSCSILVGetEqual(CFDictionaryGetValue(connCmd,kRFC3720_Key_DataDigest),targetRsp);
-    
-    // If we wanted to use data digest and target didn't set connInfo
-    Boolean useDataDigest = agree && iSCSILVGetEqual(targetRsp,kRFC3720_Value_DataDigestCRC32C);
-    
-    // Store value
-    iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,
-                                            kiSCSIHBACOUseDataDigest,
-                                            &useDataDigest,sizeof(useDataDigest));
-    // Reset agreement flag
-    agree = false;
-    
-    // Get header digest key and compare to requested value
-    if(CFDictionaryGetValueIfPresent(connRsp,kRFC3720_Key_HeaderDigest,(void*)&targetRsp))
-        agree = iSCSILVGetEqual(CFDictionaryGetValue(connCmd,kRFC3720_Key_HeaderDigest),targetRsp);
-    
-    // If we wanted to use header digest and target didn't set connInfo
-    Boolean useHeaderDigest = agree && iSCSILVGetEqual(targetRsp,kRFC3720_Value_HeaderDigestCRC32C);
-    
-    // Store value
-    iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,
-                                            kiSCSIHBACOUseHeaderDigest,
-                                            &useHeaderDigest,sizeof(useHeaderDigest));
+    // Encode the offered keys directly into the login request data segment
+    void * data = NULL;
+    size_t length = 0;
+    iSCSINegotiationBuild(negotiation,builder);
     
-    // This option is declarative; we sent the default length, and the target
-    // must accept our choice as it is within a valid range
-    UInt32 maxRecvDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
+    errno_t error = iSCSIPDUTextBuilderFinish(builder,&data,&length);
     
-    iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,
-                                            kiSCSIHBACOMaxRecvDataSegmentLength,
-                                            &maxRecvDataSegmentLength,sizeof(maxRecvDataSegmentLength));
+    if(error)
+        return error;
     
-    // This is the declaration made by the target as to the length it can
-    // receive.  Accept the value if it is within the RFC3720 allowed range
-    // otherwise, terminate the connection...
-    UInt32 maxSendDataSegmentLength = kRFC3720_MaxRecvDataSegmentLength;
+    enum iSCSIPDURejectCode rejectCode;
     
-    if(CFDictionaryGetValueIfPresent(connRsp,kRFC3720_Key_MaxRecvDataSegmentLength,(void*)&targetRsp))
-    {
-        UInt32 maxSendDataSegmentLengthRsp = CFStringGetIntValue(targetRsp);
-        
-        // Range-check value...
-        if(iSCSILVRangeInvalid(maxSendDataSegmentLengthRsp,kRFC3720_MaxRecvDataSegmentLength_Min,kRFC3720_MaxRecvDataSegmentLength_Max))
-            return ENOTSUP;
-        
-        maxSendDataSegmentLength = maxSendDataSegmentLengthRsp;
-    }
+    // Send options to target; responses are recorded as they are parsed
+    error = iSCSISessionLoginTextQuery(context,statusCode,&rejectCode,data,length,
+                                       &iSCSINegotiationParsePair,negotiation);
+    iSCSIPDUDataRelease(&data);
     
-    // Store value
-    iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,
-                                            kiSCSIHBACOMaxSendDataSegmentLength,
-                                            &maxSendDataSegmentLength,sizeof(maxSendDataSegmentLength));
-    return 0;
+    return error;
 }
 
+/*! Helper function.  Negotiates operational parameters for a session as
+ *  part of the login process.  If leadingLogin is set, the login begins
+ *  with this negotiation (there is no security negotiation stage) and the
+ *  first login request also identifies the initiator and the target.
+ *  Most targets then complete the login in a single round trip. */
 errno_t iSCSINegotiateSession(iSCSISessionManagerRef managerRef,
                               iSCSIMutableTargetRef target,
                               SessionIdentifier sessionId,
                               ConnectionIdentifier connectionId,
                               iSCSISessionConfigRef sessCfg,
                               iSCSIConnectionConfigRef connCfg,
+                              Boolean leadingLogin,
                               enum iSCSILoginStatusCode * statusCode)
 {
     iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
     
-    // Create a new dictionary for connection parameters we want to send
-    CFMutableDictionaryRef sessCmd = CFDictionaryCreateMutable(
-                                            kCFAllocatorDefault,
-                                            kiSCSISessionMaxTextKeyValuePairs,
-                                            &kCFTypeDictionaryKeyCallBacks,
-                                            &kCFTypeDictionaryValueCallBacks);
-    
-    // Add session parameters common to all session types
-    iSCSINegotiateBuildSWDictCommon(sessCfg,sessCmd);
-    
     // If target name is specified, this is a normal session; add parameters
     Boolean discoverySession = CFStringCompare(iSCSITargetGetIQN(target),kiSCSIUnspecifiedTargetIQN,0) == kCFCompareEqualTo;
-    if(!discoverySession)
-        iSCSINegotiateBuildSWDictNormal(sessCfg,sessCmd);
     
-    // Add connection parameters
-    iSCSINegotiateBuildCWDict(connCfg,sessCmd);
+    // Offer session-wide and connection-wide options; keys that are not
+    // explicitly offered below use RFC3720 defaults
+    iSCSINegotiation negotiation;
+    iSCSINegotiationInit(&negotiation,true,discoverySession);
+    
+    // If the maximum number of connections was specified in the target,
+    // use it (up to the number the kernel supports).  Else default to
+    // RFC3720 value
+    UInt32 maxConnections = iSCSISessionConfigGetMaxConnections(sessCfg);
+    
+    if(maxConnections > kiSCSIMaxConnectionsPerSession)
+        maxConnections = kiSCSIMaxConnectionsPerSession;
+    
+    if(maxConnections != 0)
+        iSCSINegotiationOffer(&negotiation,kiSCSINegotiationKeyMaxConnections,maxConnections);
+    
+    // Use the error recovery level specified by the target.  If the value
+    // was invalid, then use the RFC3720 default value of session-level.
+    enum iSCSIErrorRecoveryLevels errorRecoveryLevel = iSCSISessionConfigGetErrorRecoveryLevel(sessCfg);
+    
+    if(errorRecoveryLevel == kiSCSIErrorRecoveryDigest || errorRecoveryLevel == kiSCSIErrorRecoveryConnection)
+        iSCSINegotiationOffer(&negotiation,kiSCSINegotiationKeyErrorRecoveryLevel,errorRecoveryLevel);
+    
+    iSCSINegotiateOfferConnection(connCfg,&negotiation);
     
-    // Create a dictionary to store query response
-    CFMutableDictionaryRef sessRsp = CFDictionaryCreateMutable(
-                                            kCFAllocatorDefault,
-                                            kiSCSISessionMaxTextKeyValuePairs,
-                                            &kCFTypeDictionaryKeyCallBacks,
-                                            &kCFTypeDictionaryValueCallBacks);
+    // Without a security negotiation stage, the keys that would have been
+    // sent during that stage lead the first login request (RFC3720 5.3.1)
+    iSCSIPDUTextBuilder builder = iSCSIPDUTextBuilderInit;
+    
+    if(leadingLogin) {
+        if(discoverySession)
+            iSCSIPDUTextBuilderAppendPair(&builder,kRFC3720_Key_SessionType,kRFC3720_Value_SessionTypeDiscovery);
+        else {
+            iSCSIPDUTextBuilderAppendPair(&builder,kRFC3720_Key_SessionType,kRFC3720_Value_SessionTypeNormal);
+            iSCSIPDUTextBuilderAppendPair(&builder,kRFC3720_Key_TargetName,iSCSITargetGetIQN(target));
+        }
+        iSCSIPDUTextBuilderAppendPair(&builder,kRFC3720_Key_InitiatorName,
+                                      iSCSISessionManagerGetInitiatorName(managerRef));
+        iSCSIPDUTextBuilderAppendPair(&builder,kRFC3720_Key_InitiatorAlias,
+                                      iSCSISessionManagerGetInitiatorAlias(managerRef));
+    }
     
     struct iSCSILoginQueryContext context;
     context.interface    = hbaInterface;
@@ -528,69 +160,60 @@ errno_t iSCSINegotiateSession(iSCSISessionManagerRef managerRef,
     context.nextStage    = kiSCSIPDUFullFeaturePhase;
     context.targetSessionId = 0;
 
-    enum iSCSIPDURejectCode rejectCode;
-    
-    // Send session-wide options to target and retreive a response dictionary
-    errno_t error = iSCSISessionLoginQuery(&context,
-                                           statusCode,
-                                           &rejectCode,
-                                           sessCmd,sessRsp);
+    errno_t error = iSCSINegotiateQuery(&context,&builder,&negotiation,statusCode);
     
-    // Parse dictionaries and store session parameters if no I/O error occured
+    // Store negotiated parameters if no I/O error occured
     if(*statusCode == kiSCSILoginSuccess) {
         
         // The TSIH was recorded by iSCSISessionLoginQuery since we're
-        // entering the full-feature phase (see iSCSISessionLoginQuery documentation)
+        // entering the full feature phase (see iSCSISessionLoginQuery documentation)
         iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,
                                              kiSCSIHBASOTargetSessionId,
                                              &context.targetSessionId,sizeof(context.targetSessionId));
+        
+        // These are otherwise recorded during security negotiation; a normal
+        // session requires the target portal group tag of the leading login
+        if(!error && leadingLogin) {
+            UInt32 expStatSN = context.statSN + 1;
+            iSCSIHBAInterfaceSetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOInitialExpStatSN,
+                                                    &expStatSN,sizeof(expStatSN));
+            
+            if(!discoverySession && !negotiation.hasTargetPortalGroupTag)
+                error = EAUTH;
+            else if(!discoverySession) {
+                TargetPortalGroupTag targetPortalGroupTag = negotiation.targetPortalGroupTag;
+                iSCSIHBAInterfaceSetSessionParameter(hbaInterface,sessionId,kiSCSIHBASOTargetPortalGroupTag,
+                                                     &targetPortalGroupTag,sizeof(TargetPortalGroupTag));
+            }
+        }
+        
         if(!error)
-            error = iSCSINegotiateParseSWDictCommon(managerRef,sessionId,sessCmd,sessRsp);
-    
-        if(!error && iSCSITargetGetIQN(target) != NULL)
-            error = iSCSINegotiateParseSWDictNormal(managerRef,sessionId,sessCmd,sessRsp);
-    
-        if(!error)
-            error = iSCSINegotiateParseCWDict(managerRef,sessionId,connectionId,sessCmd,sessRsp);
+            error = iSCSINegotiationApply(&negotiation,hbaInterface,sessionId,connectionId);
     }
     
     // If no error and the target returned an alias save it...
-    CFStringRef targetAlias;
-    if(!error && CFDictionaryGetValueIfPresent(sessRsp,kRFC3720_Key_TargetAlias,(const void **)&targetAlias)) {
-        iSCSITargetSetAlias(target,targetAlias);
-    }
+    if(!error && negotiation.targetAlias)
+        iSCSITargetSetAlias(target,negotiation.targetAlias);
     
-    CFRelease(sessCmd);
-    CFRelease(sessRsp);
+    iSCSINegotiationRelease(&negotiation);
     return error;
 }
 
 /*! Helper function.  Negotiates operational parameters for a connection
  *  as part of the login and connection instantiation process. */
 errno_t iSCSINegotiateConnection(iSCSISessionManagerRef managerRef,
-                                 iSCSITargetRef target,
+                                 iSCSIConnectionConfigRef connCfg,
                                  SessionIdentifier sessionId,
                                  ConnectionIdentifier connectionId,
                                  enum iSCSILoginStatusCode * statusCode)
 {
     iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
 
-    // Create a dictionary to store query request
-    CFMutableDictionaryRef connCmd = CFDictionaryCreateMutable(
-                                            kCFAllocatorDefault,
-                                            kiSCSISessionMaxTextKeyValuePairs,
-                                            &kCFTypeDictionaryKeyCallBacks,
-                                            &kCFTypeDictionaryValueCallBacks);
-    
-    // Populate dictionary with connection options based on connInfo
-    iSCSINegotiateBuildCWDict(target,connCmd);
-
-    // Create a dictionary to store query response
-    CFMutableDictionaryRef connRsp = CFDictionaryCreateMutable(
-                                            kCFAllocatorDefault,
-                                            kiSCSISessionMaxTextKeyValuePairs,
-                                            &kCFTypeDictionaryKeyCallBacks,
-                                            &kCFTypeDictionaryValueCallBacks);
+    // Offer connection-wide options only
+    iSCSINegotiation negotiation;
+    iSCSINegotiationInit(&negotiation,false,false);
+    iSCSINegotiateOfferConnection(connCfg,&negotiation);
+    iSCSIPDUTextBuilder builder = iSCSIPDUTextBuilderInit;
 
     struct iSCSILoginQueryContext context;
     context.interface    = hbaInterface;
@@ -611,21 +234,13 @@ errno_t iSCSINegotiateConnection(iSCSISessionManagerRef managerRef,
     if(context.targetSessionId != 0)
         context.nextStage = kiSCSIPDUFullFeaturePhase;
 
-    enum iSCSIPDURejectCode rejectCode;
-
-    // Send connection-wide options to target and retreive a response dictionary
-    errno_t error = iSCSISessionLoginQuery(&context,
-                                           statusCode,
-                                           &rejectCode,
-                                           connCmd,
-                                           connRsp);
+    errno_t error = iSCSINegotiateQuery(&context,&builder,&negotiation,statusCode);
 
-    // If no error, parse received dictionary and store connection options
+    // If no error, store connection options
     if(!error && *statusCode == kiSCSILoginSuccess)
-        error = iSCSINegotiateParseCWDict(managerRef,sessionId,connectionId,connCmd,connRsp);
+        error = iSCSINegotiationApply(&negotiation,hbaInterface,sessionId,connectionId);
     
-    CFRelease(connCmd);
-    CFRelease(connRsp);
+    iSCSINegotiationRelease(&negotiation);
     return error;
 }
 
@@ -707,7 +322,9 @@ errno_t iSCSISessionAddConnection(iSCSISessionManagerRef managerRef,
                                               iSCSIPortalGetPort(portal),
                                               iSCSIPortalGetHostInterface(portal),
                                               &ssTarget,
-                                              &ssHost,connectionId);
+                                              &ssHost,
+                                              iSCSIPortalGetSocketBufferSize(portal),
+                                              connectionId);
     
     // If we can't accomodate a new connection quit; try again later
     if(error || *connectionId == kiSCSIInvalidConnectionId)
@@ -717,17 +334,22 @@ errno_t iSCSISessionAddConnection(iSCSISessionManagerRef managerRef,
     iSCSIMutableTargetRef target = iSCSITargetCreateMutableCopy(targetTemp);
     iSCSITargetRelease(targetTemp);
     
-    // If no error, authenticate (negotiate security parameters)
+    // Authenticate (negotiate security parameters)
+    error = iSCSIAuthNegotiate(managerRef,target,initiatorAuth,targetAuth,sessionId,*connectionId,statusCode);
+    
+    // Negotiate connection parameters and enter the full feature phase
     if(!error && *statusCode == kiSCSILoginSuccess)
-       error = iSCSIAuthNegotiate(managerRef,target,initiatorAuth,targetAuth,sessionId,*connectionId,statusCode);
+        error = iSCSINegotiateConnection(managerRef,connCfg,sessionId,*connectionId,statusCode);
     
     if(!error && *statusCode == kiSCSILoginSuccess)
         iSCSIHBAInterfaceActivateConnection(hbaInterface,sessionId,*connectionId);
-    else
+    else {
         iSCSIHBAInterfaceReleaseConnection(hbaInterface,sessionId,*connectionId);
+        *connectionId = kiSCSIInvalidConnectionId;
+    }
     
     iSCSITargetRelease(target);
-    return 0;
+    return error;
 }
 
 errno_t iSCSISessionRemoveConnection(iSCSISessionManagerRef managerRef,
@@ -763,8 +385,68 @@ errno_t iSCSISessionRemoveConnection(iSCSISessionManagerRef managerRef,
     return error;
 }
 
+/*! Helper function used by iSCSISessionLogin.  Creates a new session in the
+ *  kernel and connects it to the specified portal.  This allocates session
+ *  and connection identifiers. */
+static errno_t iSCSISessionLoginCreateSession(iSCSISessionManagerRef managerRef,
+                                              iSCSITargetRef target,
+                                              iSCSIPortalRef portal,
+                                              struct sockaddr_storage * ssTarget,
+                                              struct sockaddr_storage * ssHost,
+                                              SessionIdentifier * sessionId,
+                                              ConnectionIdentifier * connectionId)
+{
+    iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
+    
+    errno_t error = iSCSIHBAInterfaceCreateSession(hbaInterface,
+                                                   iSCSITargetGetIQN(target),
+                                                   iSCSIPortalGetAddress(portal),
+                                                   iSCSIPortalGetPort(portal),
+                                                   iSCSIPortalGetHostInterface(portal),
+                                                   ssTarget,ssHost,
+                                                   iSCSIPortalGetSocketBufferSize(portal),
+                                                   sessionId,connectionId);
+    if(error)
+        return error;
+    
+    // If session couldn't be allocated were maxed out; try again later
+    if(*sessionId == kiSCSIInvalidSessionId || *connectionId == kiSCSIInvalidConnectionId)
+        return EAGAIN;
+    
+    return 0;
+}
+
+/*! Helper function used by iSCSISessionLogin.  Determines whether a target
+ *  that refused a login without a security negotiation stage may accept
+ *  a login that includes one.  Some targets reject such a login by
+ *  dropping the connection rather than with a status code.
+ *  @param error the error returned by the first login exchange.
+ *  @param statusCode the iSCSI status code returned by the target.
+ *  @return true if the login should be retried with a security stage. */
+static Boolean iSCSISessionLoginShouldRetryWithSecurity(errno_t error,
+                                                        enum iSCSILoginStatusCode statusCode)
+{
+    if(error)
+        return (error == ECONNRESET || error == EPIPE || error == EIO);
+    
+    switch(statusCode)
+    {
+        case kiSCSILoginInitiatorError:
+        case kiSCSILoginAuthFail:
+        case kiSCSILoginMissingParam:
+        case kiSCSILoginInvalidReqDuringLogin:
+            return true;
+        default:
+            return false;
+    }
+}
+
 /*! Creates a normal iSCSI session and returns a handle to the session. Users
  *  must call iSCSISessionClose to close this session and free resources.
+ *  If neither the initiator nor the target is authenticated, the login skips
+ *  the security negotiation stage and offers all operational parameters in
+ *  the first login request; if the target refuses such a login, the login
+ *  is retried on a new connection with a security negotiation stage.
  *  @param target specifies the target and connection parameters to use.
  *  @param portal specifies the portal to use for the new session.
  *  @param initiatorAuth specifies the initiator authentication parameters.
@@ -801,26 +483,47 @@ errno_t iSCSISessionLogin(iSCSISessionManagerRef managerRef,
 
     // Create a new session in the kernel.  This allocates session and
     // connection identifiers
-    error = iSCSIHBAInterfaceCreateSession(hbaInterface,
-                                           iSCSITargetGetIQN(target),
-                                           iSCSIPortalGetAddress(portal),
-                                           iSCSIPortalGetPort(portal),
-                                           iSCSIPortalGetHostInterface(portal),
-                                           &ssTarget,&ssHost,sessionId,connectionId);
+    if((error = iSCSISessionLoginCreateSession(managerRef,target,portal,&ssTarget,&ssHost,
+                                               sessionId,connectionId)))
+        return error;
     
-    // If session couldn't be allocated were maxed out; try again later
-    if(!error && (*sessionId == kiSCSIInvalidSessionId || *connectionId == kiSCSIInvalidConnectionId))
-        return EAGAIN;
+    // Without authentication there is nothing to negotiate during the
+    // security stage; skip it and negotiate session & connection parameters
+    Boolean securityStage = (iSCSIAuthGetMethod(initiatorAuth) != kiSCSIAuthMethodNone ||
+                             iSCSIAuthGetMethod(targetAuth) != kiSCSIAuthMethodNone);
+    
+    if(!securityStage) {
+        error = iSCSINegotiateSession(managerRef,target,*sessionId,*connectionId,sessCfg,connCfg,true,statusCode);
+        
+        // The target closes the connection after a failed login; if the
+        // target insists on a security stage, start over on a new connection
+        if(iSCSISessionLoginShouldRetryWithSecurity(error,*statusCode)) {
+            iSCSIHBAInterfaceReleaseSession(hbaInterface,*sessionId);
+            securityStage = true;
+            error = 0;
+            
+            if((error = iSCSISessionLoginCreateSession(managerRef,target,portal,&ssTarget,&ssHost,
+                                                       sessionId,connectionId)))
+                return error;
+        }
+    }
 
-    // If no error, authenticate (negotiate security parameters)
-    if(!error) {
+    // Authenticate (negotiate security parameters), then negotiate session
+    // & connection parameters
+    if(securityStage) {
         error = iSCSIAuthNegotiate(managerRef,target,initiatorAuth,targetAuth,
                                    *sessionId,*connectionId,statusCode);
+        
+        if(!error && *statusCode == kiSCSILoginSuccess)
+            error = iSCSINegotiateSession(managerRef,target,*sessionId,*connectionId,sessCfg,connCfg,false,statusCode);
+    }
+    
+    // Apply local session options (these are not negotiated with the target)
+    if(!error && *statusCode == kiSCSILoginSuccess) {
+        UInt32 busyPollBudget = iSCSISessionConfigGetBusyPollBudget(sessCfg);
+        iSCSIHBAInterfaceSetSessionParameter(hbaInterface,*sessionId,kiSCSIHBASOBusyPollBudget,
+                                             &busyPollBudget,sizeof(busyPollBudget));
     }
-
-    // Negotiate session & connection parameters
-    if(!error && *statusCode == kiSCSILoginSuccess)
-        error = iSCSINegotiateSession(managerRef,target,*sessionId,*connectionId,sessCfg,connCfg,statusCode);
 
     // Only activate connections for kernel use if no errors have occurred and
     // the session is not a discovery session
@@ -864,72 +567,125 @@ errno_t iSCSISessionLogout(iSCSISessionManagerRef managerRef,
     return error;
 }
 
-/*! Callback function used by iSCSIQueryPortalForTargets to parse discovery
- *  data into an iSCSIDiscoveryRec object. */
-void iSCSIPDUDataParseToDiscoveryRecCallback(void * keyContainer,CFStringRef key,
-                                             void * valContainer,CFStringRef val)
+/*! Adds a portal to a discovery record from the value of a TargetAddress
+ *  key.  Per RFC3720, the value is of the form <address>[:<port>],<tag>,
+ *  where the address may be an IPv4/IPv6 address or a domain name.
+ *  @param discoveryRec the discovery record to update.
+ *  @param targetIQN the target the portal belongs to.
+ *  @param value the value of the TargetAddress key.
+ *  @param valueLength the length of the value. */
+static void iSCSISessionAddDiscoveredPortal(iSCSIMutableDiscoveryRecRef discoveryRec,
+                                            CFStringRef targetIQN,
+                                            const UInt8 * value,
+                                            size_t valueLength)
 {
-    static CFStringRef targetIQN = NULL;
+    // Split off the portal group tag
+    size_t tagSeparator = valueLength;
+    while(tagSeparator > 0 && value[tagSeparator-1] != ',')
+        tagSeparator--;
     
-    // If the discovery data has a "TargetName = xxx" field, we're starting
-    // a record for a new target
-    if(CFStringCompare(key,kRFC3720_Key_TargetName,0) == kCFCompareEqualTo)
-    {
-        targetIQN = CFStringCreateCopy(kCFAllocatorDefault,val);
-        iSCSIMutableDiscoveryRecRef discoveryRec = (iSCSIMutableDiscoveryRecRef)(valContainer);
-        iSCSIDiscoveryRecAddTarget(discoveryRec,targetIQN);
-    }
-    // Otherwise we're dealing with a portal entry. Per RFC3720, this is
-    // of the form "TargetAddress = <address>:<port>,<portalGroupTag>
-    else if(CFStringCompare(key,kRFC3720_Key_TargetAddress,0) == kCFCompareEqualTo)
+    if(tagSeparator == 0)
+        return;
+    
+    size_t addressLength = tagSeparator - 1;
+    
+    // Search for the port separator backwards, since IPv6 addresses use ':'
+    // as separators; a ':' inside brackets is part of the address
+    size_t portSeparator = addressLength;
+    while(portSeparator > 0 && value[portSeparator-1] != ':' && value[portSeparator-1] != ']')
+        portSeparator--;
+    
+    if(portSeparator == 0 || value[portSeparator-1] == ']')
+        portSeparator = addressLength + 1;
+    
+    CFStringRef address = CFStringCreateWithBytes(kCFAllocatorDefault,value,portSeparator-1,
+                                                  kCFStringEncodingUTF8,false);
+    CFStringRef port = NULL;
+    
+    if(portSeparator <= addressLength)
+        port = CFStringCreateWithBytes(kCFAllocatorDefault,value+portSeparator,addressLength-portSeparator,
+                                       kCFStringEncodingUTF8,false);
+    else
+        port = CFRetain(kiSCSIDefaultPort);
+    
+    CFStringRef portalGroupTag = CFStringCreateWithBytes(kCFAllocatorDefault,value+tagSeparator,
+                                                         valueLength-tagSeparator,
+                                                         kCFStringEncodingUTF8,false);
+    
+    if(address && port && portalGroupTag)
     {
-        // Split the value string to extract the portal group tag
-        CFArrayRef targetAddress = CFStringCreateArrayBySeparatingStrings(kCFAllocatorDefault,val,CFSTR(","));
-        CFStringRef addressAndPort = CFArrayGetValueAtIndex(targetAddress,0);
-        CFStringRef portalGroupTag = CFArrayGetValueAtIndex(targetAddress,1);
-        
-        // Split the address and port, construct an iSCSIPortal object (do the
-        // search for a ":" backwards since IPv6 addresses use ":" as
-        // separators and the address can be IPv4/IPv6 or a domain name.
-        CFRange sepRange = CFStringFind(addressAndPort,CFSTR(":"),kCFCompareBackwards);
-        CFRange addressRange = CFRangeMake(0,sepRange.location);
-        CFRange portRange = CFRangeMake(sepRange.location+1,CFStringGetLength(addressAndPort)-(sepRange.location+1));
-        
-        CFStringRef address = CFStringCreateWithSubstring(kCFAllocatorDefault,addressAndPort,addressRange);
-        CFStringRef port = CFStringCreateWithSubstring(kCFAllocatorDefault,addressAndPort,portRange);
-        
         iSCSIMutablePortalRef portal = iSCSIPortalCreateMutable();
         iSCSIPortalSetAddress(portal,address);
         iSCSIPortalSetPort(portal,port);
         iSCSIPortalSetHostInterface(portal,kiSCSIDefaultHostInterface);
-    
-        iSCSIMutableDiscoveryRecRef discoveryRec = (iSCSIMutableDiscoveryRecRef)(valContainer);
-        iSCSIDiscoveryRecAddPortal(discoveryRec,targetIQN,portalGroupTag,portal);
         
-        CFRelease(port);
-        CFRelease(address);
-        CFRelease(targetAddress);
-        if (targetIQN) {
-            CFRelease(targetIQN);
-            targetIQN = NULL;
-        }
+        iSCSIDiscoveryRecAddPortal(discoveryRec,targetIQN,portalGroupTag,portal);
         iSCSIPortalRelease(portal);
     }
+    
+    if(address)
+        CFRelease(address);
+    
+    if(port)
+        CFRelease(port);
+    
+    if(portalGroupTag)
+        CFRelease(portalGroupTag);
 }
 
-/*! Queries a portal for available targets (utilizes iSCSI SendTargets).
- *  @param portal the iSCSI portal to query.
- *  @param auth specifies the authentication parameters to use.
- *  @param discoveryRec a discovery record, containing the query results.
+/*! Context used by iSCSISessionSendTargetsCallback while a SendTargets
+ *  response is streamed from the target. */
+struct iSCSISessionSendTargetsContext {
+    
+    /*! The discovery record to update. */
+    iSCSIMutableDiscoveryRecRef discoveryRec;
+    
+    /*! The target that TargetAddress keys are associated with. */
+    CFStringRef targetIQN;
+};
+
+/*! Callback used by iSCSIQueryPortalForTargets to add the targets and portals
+ *  of a SendTargets text response to a discovery record.  Keys are matched
+ *  in place; strings are created only for the values that are stored. */
+static void iSCSISessionSendTargetsCallback(void * context,const iSCSIPDUTextPair * pair)
+{
+    struct iSCSISessionSendTargetsContext * sendTargets = context;
+    
+    // If the discovery data has a "TargetName = xxx" field, we're starting
+    // a record for a new target
+    if(iSCSIPDUTextPairKeyEquals(pair,"TargetName"))
+    {
+        if(sendTargets->targetIQN)
+            CFRelease(sendTargets->targetIQN);
+        
+        sendTargets->targetIQN = CFStringCreateWithBytes(kCFAllocatorDefault,pair->value,pair->valueLength,
+                                                         kCFStringEncodingUTF8,false);
+        if(sendTargets->targetIQN)
+            iSCSIDiscoveryRecAddTarget(sendTargets->discoveryRec,sendTargets->targetIQN);
+    }
+    // Otherwise we're dealing with a portal entry for the current target
+    else if(sendTargets->targetIQN && iSCSIPDUTextPairKeyEquals(pair,"TargetAddress"))
+        iSCSISessionAddDiscoveredPortal(sendTargets->discoveryRec,sendTargets->targetIQN,
+                                        pair->value,pair->valueLength);
+}
+
+/*! Opens a discovery session (a session with an unspecified target name)
+ *  to a portal.  The session is left in the full feature phase so that it
+ *  may be queried with iSCSIQueryDiscoverySessionForTargets().
+ *  @param portal the iSCSI portal to log into.
+ *  @param initiatorAuth specifies the authentication parameters to use.
+ *  @param sessionId the new session identifier.
+ *  @param connectionId the new connection identifier.
  *  @param statusCode iSCSI response code indicating operation status.
  *  @return an error code indicating whether the operation was successful. */
-errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
-                                   iSCSIPortalRef portal,
-                                   iSCSIAuthRef initiatorAuth,
-                                   iSCSIMutableDiscoveryRecRef * discoveryRec,
-                                   enum iSCSILoginStatusCode * statusCode)
+errno_t iSCSISessionLoginForDiscovery(iSCSISessionManagerRef managerRef,
+                                      iSCSIPortalRef portal,
+                                      iSCSIAuthRef initiatorAuth,
+                                      SessionIdentifier * sessionId,
+                                      ConnectionIdentifier * connectionId,
+                                      enum iSCSILoginStatusCode * statusCode)
 {
-    if(!portal || !discoveryRec)
+    if(!portal || !sessionId || !connectionId)
         return EINVAL;
     
     // Create a discovery session to the portal (empty target name is assumed to
@@ -937,93 +693,73 @@ errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
     iSCSIMutableTargetRef target = iSCSITargetCreateMutable();
     iSCSITargetSetIQN(target,kiSCSIUnspecifiedTargetIQN);
     
-    SessionIdentifier sessionId;
-    ConnectionIdentifier connectionId;
-    
     iSCSIMutableSessionConfigRef sessCfg = iSCSISessionConfigCreateMutable();
     iSCSIMutableConnectionConfigRef connCfg = iSCSIConnectionConfigCreateMutable();
 
     iSCSIAuthRef targetAuth = iSCSIAuthCreateNone();
 
     errno_t error = iSCSISessionLogin(managerRef,target,portal,initiatorAuth,targetAuth,
-                                      sessCfg,connCfg,&sessionId,
-                                      &connectionId,statusCode);
+                                      sessCfg,connCfg,sessionId,
+                                      connectionId,statusCode);
 
     iSCSIAuthRelease(targetAuth);
     iSCSITargetRelease(target);
     iSCSISessionConfigRelease(sessCfg);
     iSCSIConnectionConfigRelease(connCfg);
     
-    if(error)
-        return error;
+    return error;
+}
+
+/*! Queries an open discovery session for available targets (utilizes
+ *  iSCSI SendTargets).  The session remains open.
+ *  @param sessionId the discovery session identifier.
+ *  @param connectionId the connection identifier.
+ *  @param portal the iSCSI portal the session is connected to.
+ *  @param discoveryRec a discovery record, containing the query results.
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIQueryDiscoverySessionForTargets(iSCSISessionManagerRef managerRef,
+                                             SessionIdentifier sessionId,
+                                             ConnectionIdentifier connectionId,
+                                             iSCSIPortalRef portal,
+                                             iSCSIMutableDiscoveryRecRef * discoveryRec)
+{
+    if(!portal || !discoveryRec)
+        return EINVAL;
     
-    // Place text commands to get target list into a dictionary
-    CFMutableDictionaryRef textCmd =
-        CFDictionaryCreateMutable(kCFAllocatorDefault,
-                                  kiSCSISessionMaxTextKeyValuePairs,
-                                  &kCFTypeDictionaryKeyCallBacks,
-                                  &kCFTypeDictionaryValueCallBacks);
-    
-    // Can't use a text query; must manually send/receive as the received
-    // keys will be duplicates and CFDictionary doesn't support them
-    CFDictionarySetValue(textCmd,kRFC3720_Key_SendTargets,kRFC3720_Value_SendTargetsAll);
-     
-    // Create a data segment based on text commands (key-value pairs)
+    // Create a data segment holding the SendTargets command; can't use a
+    // text query as the received keys will be duplicates
     void * data;
     size_t length;
-    iSCSIPDUDataCreateFromDict(textCmd,&data,&length);
+    errno_t error = 0;
+    iSCSIPDUTextBuilder builder = iSCSIPDUTextBuilderInit;
+    iSCSIPDUTextBuilderAppendPair(&builder,kRFC3720_Key_SendTargets,kRFC3720_Value_SendTargetsAll);
     
-    iSCSIPDUTextReqBHS cmd = iSCSIPDUTextReqBHSInit;
-    cmd.textReqStageFlags |= kiSCSIPDUTextReqFinalFlag;
-    cmd.targetTransferTag = kiSCSIPDUTargetTransferTagReserved;
+    if((error = iSCSIPDUTextBuilderFinish(&builder,&data,&length)))
+        return error;
+    
+    // Stream the response into the discovery record; large responses span
+    // several PDUs, which are requested and parsed one at a time
+    *discoveryRec = iSCSIDiscoveryRecCreateMutable();
+    
+    struct iSCSISessionSendTargetsContext context;
+    context.discoveryRec = *discoveryRec;
+    context.targetIQN = NULL;
     
     iSCSIHBAInterfaceRef hbaInterface = iSCSISessionManagerGetHBAInterface(managerRef);
-    error = iSCSIHBAInterfaceSend(hbaInterface,sessionId,connectionId,(iSCSIPDUInitiatorBHS *)&cmd,data,length);
+    error = iSCSISessionTextExchange(hbaInterface,sessionId,connectionId,data,length,
+                                     &iSCSISessionSendTargetsCallback,&context);
     
     iSCSIPDUDataRelease(&data);
-    CFRelease(textCmd);
-     
+    
+    if(context.targetIQN)
+        CFRelease(context.targetIQN);
+    
     if(error)
     {
-        enum iSCSILogoutStatusCode statusCode;
-        iSCSISessionLogout(managerRef,sessionId,&statusCode);
+        iSCSIDiscoveryRecRelease(*discoveryRec);
+        *discoveryRec = NULL;
         return error;
     }
-    
-    // Get response from iSCSI portal, continue until response is complete
-    iSCSIPDUTextRspBHS rsp;
-    
-    *discoveryRec = iSCSIDiscoveryRecCreateMutable();
-
-    do {
-        if((error = iSCSIHBAInterfaceReceive(hbaInterface,sessionId,connectionId,(iSCSIPDUTargetBHS *)&rsp,&data,&length)))
-        {
-            iSCSIPDUDataRelease(&data);
-
-            enum iSCSILogoutStatusCode statusCode;
-            iSCSISessionLogout(managerRef,sessionId,&statusCode);
-
-            return error;
-        }
-     
-        if(rsp.opCode == kiSCSIPDUOpCodeTextRsp)
-        {
-            iSCSIPDUDataParseCommon(data,length,NULL,*discoveryRec,
-                                    &iSCSIPDUDataParseToDiscoveryRecCallback);
-        }
-        // For this case some other kind of PDU or invalid data was received
-        else if(rsp.opCode == kiSCSIPDUOpCodeReject)
-        {
-            error = EINVAL;
-            break;
-        }
-    }
-    while(rsp.textReqStageBits & kiSCSIPDUTextReqContinueFlag);
-     
-    iSCSIPDUDataRelease(&data);
-    
-    enum iSCSILogoutStatusCode logoutStatusCode;
-    iSCSISessionLogout(managerRef,sessionId,&logoutStatusCode);
 
     // Per RFC3720, the "TargetAddress" key is optional in a SendTargets
     // discovery operation.  Therefore, certain targets may respond with
@@ -1060,6 +796,38 @@ errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
     return error;
 }
 
+/*! Queries a portal for available targets (utilizes iSCSI SendTargets).
+ *  @param portal the iSCSI portal to query.
+ *  @param auth specifies the authentication parameters to use.
+ *  @param discoveryRec a discovery record, containing the query results.
+ *  @param statusCode iSCSI response code indicating operation status.
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIQueryPortalForTargets(iSCSISessionManagerRef managerRef,
+                                   iSCSIPortalRef portal,
+                                   iSCSIAuthRef initiatorAuth,
+                                   iSCSIMutableDiscoveryRecRef * discoveryRec,
+                                   enum iSCSILoginStatusCode * statusCode)
+{
+    if(!portal || !discoveryRec)
+        return EINVAL;
+    
+    SessionIdentifier sessionId;
+    ConnectionIdentifier connectionId;
+    
+    errno_t error = iSCSISessionLoginForDiscovery(managerRef,portal,initiatorAuth,
+                                                  &sessionId,&connectionId,statusCode);
+    
+    if(error || *statusCode != kiSCSILoginSuccess)
+        return error;
+    
+    error = iSCSIQueryDiscoverySessionForTargets(managerRef,sessionId,connectionId,portal,discoveryRec);
+    
+    enum iSCSILogoutStatusCode logoutStatusCode;
+    iSCSISessionLogout(managerRef,sessionId,&logoutStatusCode);
+    
+    return error;
+}
+
 /*! Retrieves a list of targets available from a give portal.
  *  @param portal the iSCSI portal to look for targets.
  *  @param initiatorAuth specifies the initiator authentication parameters.
@@ -1098,6 +866,7 @@ errno_t iSCSIQueryTargetForAuthMethod(iSCSISessionManagerRef managerRef,
                                      iSCSIPortalGetHostInterface(portal),
                                      &ssTarget,
                                      &ssHost,
+                                     iSCSIPortalGetSocketBufferSize(portal),
                                      &sessionId,
                                      &connectionId);
     
@@ -1393,6 +1162,12 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForPortal(iSCSISessionManagerRef man
     
     CFNumberRef connectionIdentifier = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&connectionId);
     
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOBytesPerSecond,&paramVal32,sizeof(paramVal32));
+    CFNumberRef bytesPerSecond = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
+    
+    iSCSIHBAInterfaceGetConnectionParameter(hbaInterface,sessionId,connectionId,kiSCSIHBACOLatency,&paramVal32,sizeof(paramVal32));
+    CFNumberRef latency = CFNumberCreate(kCFAllocatorDefault,kCFNumberIntType,&paramVal32);
+    
 
     enum iSCSIDigestTypes dataDigestType = kiSCSIDigestNone;
     enum iSCSIDigestTypes headerDigestType = kiSCSIDigestNone;
@@ -1418,20 +1193,32 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForPortal(iSCSISessionManagerRef man
         kRFC3720_Key_DataDigest,
         kRFC3720_Key_HeaderDigest,
         kRFC3720_Key_MaxRecvDataSegmentLength,
-        kRFC3720_Key_ConnectionId
+        kRFC3720_Key_ConnectionId,
+        kRFC3720_Key_BytesPerSecond,
+        kRFC3720_Key_Latency
     };
 
     const void * values[] = {
         dataDigest,
         headerDigest,
         maxRecvDataSegmentLength,
-        connectionIdentifier
+        connectionIdentifier,
+        bytesPerSecond,
+        latency
     };
 
     dictionary = CFDictionaryCreate(kCFAllocatorDefault,keys,values,
                                     sizeof(keys)/sizeof(void*),
                                     &kCFTypeDictionaryKeyCallBacks,
                                     &kCFTypeDictionaryValueCallBacks);
+    
+    CFRelease(dataDigest);
+    CFRelease(headerDigest);
+    CFRelease(maxRecvDataSegmentLength);
+    CFRelease(connectionIdentifier);
+    CFRelease(bytesPerSecond);
+    CFRelease(latency);
+    
     return dictionary;
 }
 
@@ -95,6 +95,37 @@ errno_t iSCSISessionRemoveConnection(iSCSISessionManagerRef managerRef,
                                      ConnectionIdentifier connectionId,
                                      enum iSCSILogoutStatusCode * statusCode);
 
+/*! Opens a discovery session (a session with an unspecified target name)
+ *  to a portal.  The session is left in the full feature phase so that it
+ *  may be queried with iSCSIQueryDiscoverySessionForTargets().
+ *  @param managerRef a session manager instance.
+ *  @param portal the iSCSI portal to log into.
+ *  @param initiatorAuth specifies the authentication parameters to use.
+ *  @param sessionId the new session identifier.
+ *  @param connectionId the new connection identifier.
+ *  @param statusCode iSCSI response code indicating operation status.
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSISessionLoginForDiscovery(iSCSISessionManagerRef managerRef,
+                                      iSCSIPortalRef portal,
+                                      iSCSIAuthRef initiatorAuth,
+                                      SessionIdentifier * sessionId,
+                                      ConnectionIdentifier * connectionId,
+                                      enum iSCSILoginStatusCode * statusCode);
+
+/*! Queries an open discovery session for available targets (utilizes
+ *  iSCSI SendTargets).  The session remains open.
+ *  @param managerRef a session manager instance.
+ *  @param sessionId the discovery session identifier.
+ *  @param connectionId the connection identifier.
+ *  @param portal the iSCSI portal the session is connected to.
+ *  @param discoveryRec a discovery record, containing the query results.
+ *  @return an error code indicating whether the operation was successful. */
+errno_t iSCSIQueryDiscoverySessionForTargets(iSCSISessionManagerRef managerRef,
+                                             SessionIdentifier sessionId,
+                                             ConnectionIdentifier connectionId,
+                                             iSCSIPortalRef portal,
+                                             iSCSIMutableDiscoveryRecRef * discoveryRec);
+
 /*! Queries a portal for available targets (utilizes iSCSI SendTargets).
  *  @param managerRef a session manager instance.
  *  @param portal the iSCSI portal to query.
@@ -199,6 +230,8 @@ CFDictionaryRef iSCSISessionCopyCFPropertiesForTarget(iSCSISessionManagerRef man
  *  kRFC3720_Key_HeaderDigest               (CFNumberRef)
  *  kRFC3720_Key_MaxRecvDataSegmentLength   (CFNumberRef)
  *  kRFC3720_Key_ConnectionId               (CFNumberRef)
+ *  kRFC3720_Key_BytesPerSecond             (CFNumberRef)
+ *  kRFC3720_Key_Latency                    (CFNumberRef)
  *
  *  @param managerRef a session manager instance.
  *  @param target the target associated with the the specified portal.
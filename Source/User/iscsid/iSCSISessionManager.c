@@ -217,3 +217,19 @@ void iSCSISessionManagerSetInitiatorAlias(iSCSISessionManagerRef managerRef,
     CFRelease(managerRef->initiatorAlias);
     managerRef->initiatorAlias = CFStringCreateCopy(kCFAllocatorDefault,initiatorAlias);
 }
+
+/*! Gets the initiator name used for new sessions.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @return the initiator name. */
+CFStringRef iSCSISessionManagerGetInitiatorName(iSCSISessionManagerRef managerRef)
+{
+    return managerRef->initiatorName;
+}
+
+/*! Gets the initiator alias used for new sessions.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @return the initiator alias. */
+CFStringRef iSCSISessionManagerGetInitiatorAlias(iSCSISessionManagerRef managerRef)
+{
+    return managerRef->initiatorAlias;
+}
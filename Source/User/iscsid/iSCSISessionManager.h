@@ -99,5 +99,15 @@ void iSCSISessionManagerSetInitiatorName(iSCSISessionManagerRef managerRef,
 void iSCSISessionManagerSetInitiatorAlias(iSCSISessionManagerRef managerRef,
                                           CFStringRef initiatorAlias);
 
+/*! Gets the initiator name used for new sessions.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @return the initiator name. */
+CFStringRef iSCSISessionManagerGetInitiatorName(iSCSISessionManagerRef managerRef);
+
+/*! Gets the initiator alias used for new sessions.
+ *  @param managerRef an instance of an iSCSISessionManagerRef.
+ *  @return the initiator alias. */
+CFStringRef iSCSISessionManagerGetInitiatorAlias(iSCSISessionManagerRef managerRef);
+
 
 #endif